@@ -30,29 +30,38 @@ void allium_hash(void *state, const void *input)
 
 	// sph_blake256_set_rounds(14);
 
+	PROF_START();
+
 	sph_blake256_init(&ctx_blake);
 	sph_blake256(&ctx_blake, input, 80);
 	sph_blake256_close(&ctx_blake, hashA);
+	PROF_STAGE(PROF_BLAKE256);
 
 	sph_keccak256_init(&ctx_keccak);
 	sph_keccak256(&ctx_keccak, hashA, 32);
 	sph_keccak256_close(&ctx_keccak, hashB);
+	PROF_STAGE(PROF_KECCAK256);
 
 	LYRA2(hashA, 32, hashB, 32, hashB, 32, 1, 8, 8);
+	PROF_STAGE(PROF_LYRA2);
 
 	sph_cubehash256_init(&ctx_cube);
 	sph_cubehash256(&ctx_cube, hashA, 32);
 	sph_cubehash256_close(&ctx_cube, hashB);
+	PROF_STAGE(PROF_CUBEHASH256);
 
 	LYRA2(hashA, 32, hashB, 32, hashB, 32, 1, 8, 8);
+	PROF_STAGE(PROF_LYRA2);
 
 	sph_skein256_init(&ctx_skein);
 	sph_skein256(&ctx_skein, hashA, 32);
 	sph_skein256_close(&ctx_skein, hashB);
+	PROF_STAGE(PROF_SKEIN256);
 
 	sph_groestl256_init(&ctx_groestl);
 	sph_groestl256(&ctx_groestl, hashB, 32);
 	sph_groestl256_close(&ctx_groestl, hashA);
+	PROF_STAGE(PROF_GROESTL256);
 
 	memcpy(state, hashA, 32);
 }
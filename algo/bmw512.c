@@ -39,10 +39,9 @@ int scanhash_bmw512(int thr_id, struct work *work, uint32_t max_nonce, uint64_t
 	};
 
 	do {
-		pdata[19] = ++n;
 		be32enc(&endiandata[19], n);
 		bmw512_hash(hash64, endiandata);
-		if (((hash64[7]&0xFFFFFF00)==0) && fulltest(hash64, ptarget)) {
+		if (hash64[7] <= Htarg && fulltest(hash64, ptarget)) {
 			work_set_target_ratio(work, hash64);
 			*hashes_done = n - first_nonce + 1;
 			pdata[19] = n;
@@ -52,7 +51,7 @@ int scanhash_bmw512(int thr_id, struct work *work, uint32_t max_nonce, uint64_t
 
 	} while (n < max_nonce && !work_restart[thr_id].restart);
 
-	*hashes_done = n - first_nonce + 1;
+	*hashes_done = n - first_nonce;
 	pdata[19] = n;
 
 	return 0;
@@ -172,6 +172,25 @@ static inline void sha256_hash(unsigned char *hash, const unsigned char *data, i
         be32enc((uint32_t *)hash + i, S[i]);
 }
 
+/* single hash of a big endian header (selftest) */
+void curvehash(void *output, const void *input)
+{
+    secp256k1_context *ctx = secp256k1_context_create(SECP256K1_CONTEXT_SIGN);
+    secp256k1_pubkey pubkey;
+    unsigned char pub[65];
+    size_t publen = 65;
+    uint32_t _ALIGN(128) hash[8];
+
+    sha256_hash((unsigned char *) hash, (const unsigned char *) input, 80);
+    for (int round = 0; round < 8; round++) {
+        secp256k1_ec_pubkey_create(ctx, &pubkey, (unsigned char *) hash);
+        secp256k1_ec_pubkey_serialize(ctx, pub, &publen, &pubkey, SECP256K1_EC_UNCOMPRESSED);
+        sha256_hash((unsigned char *) hash, pub, 65);
+    }
+    memcpy(output, hash, 32);
+    secp256k1_context_destroy(ctx);
+}
+
 int scanhash_curvehash(int thr_id, struct work *work, uint32_t max_nonce, uint64_t *hashes_done) {
     secp256k1_context *ctx = secp256k1_context_create(SECP256K1_CONTEXT_SIGN);
     secp256k1_pubkey pubkey;
@@ -109,6 +109,21 @@ static void getAlgoString(void *mem, unsigned int size, uint8_t* selectedAlgoOut
   }
 }
 
+/* core and cryptonight orders of a header, for the api */
+void gr_hash_order(const void *input, char *output)
+{
+        uint8_t core[15], cn[6];
+        int i;
+        getAlgoString((uint8_t*) input + 4, 64, core, 15);
+        getAlgoString((uint8_t*) input + 4, 64, cn, 6);
+        for (i = 0; i < 15; i++)
+                *output++ = "0123456789ABCDEF"[core[i]];
+        *output++ = ':';
+        for (i = 0; i < 6; i++)
+                *output++ = '0' + cn[i];
+        *output = '\0';
+}
+
 void gr_hash(const char* input, char* output, uint32_t len) {
         uint32_t hash[64/4];
         sph_blake512_context ctx_blake;
@@ -138,6 +153,7 @@ void gr_hash(const char* input, char* output, uint32_t len) {
         getAlgoString(&input[4], 64, selectedAlgoOutput, 15);
         getAlgoString(&input[4], 64, selectedCNAlgoOutput, 6);
         int i;
+        PROF_START();
         for (i = 0; i < 18; i++)
         {
                 uint8_t algo;
@@ -195,6 +211,8 @@ void gr_hash(const char* input, char* output, uint32_t len) {
                         cryptonightturtlelite_hash(in, hash, size, 1);
                         break;
                 }
+                if(cnAlgo < CN_HASH_FUNC_COUNT)
+                        PROF_STAGE(PROF_CN_DARK + cnAlgo);
                 //selection core algo
                 switch (algo) {
                 case BLAKE:
@@ -273,6 +291,8 @@ void gr_hash(const char* input, char* output, uint32_t len) {
                                 sph_whirlpool_close(&ctx_whirlpool, hash);
                                 break;
                 }
+                if(algo < HASH_FUNC_COUNT)
+                        PROF_STAGE(PROF_BLAKE512 + algo);
                 if(cnSelection >= 0) {
                         memset(&hash[8], 0, 32);
                 }
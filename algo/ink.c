@@ -28,7 +28,7 @@ int scanhash_ink(int thr_id, struct work *work, uint32_t max_nonce, uint64_t *ha
 	uint32_t *pdata = work->data;
 	uint32_t *ptarget = work->target;
 
-	uint32_t n = pdata[19] - 1;
+	uint32_t n = pdata[19];
 	const uint32_t first_nonce = pdata[19];
 
 	for (int k=0; k < 19; k++)
@@ -42,14 +42,14 @@ int scanhash_ink(int thr_id, struct work *work, uint32_t max_nonce, uint64_t *ha
 		if (hash32[7] <= Htarg && fulltest(hash32, ptarget)) {
 			work_set_target_ratio(work, hash32);
 			pdata[19] = n;
-			*hashes_done = pdata[19] - first_nonce;
+			*hashes_done = pdata[19] - first_nonce + 1;
 			return 1;
 		}
 		n++;
 
 	} while (n < max_nonce && !work_restart[thr_id].restart);
 	
-	*hashes_done = n - first_nonce + 1;
+	*hashes_done = n - first_nonce;
 	pdata[19] = n;
 	return 0;
 }
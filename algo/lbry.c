@@ -36,6 +36,8 @@ void lbry_hash(void* output, const void* input)
 	uint32_t _ALIGN(A) hashB[8];
 	uint32_t _ALIGN(A) hashC[8];
 
+	if (!ctx_init) lbry_initstate();
+
 	//memset(&hashA[8], 0, 32);
 
 	// sha256d
@@ -79,8 +81,6 @@ int scanhash_lbry(int thr_id, struct work *work, uint32_t max_nonce, uint64_t *h
 		be32enc(&endiandata[i], pdata[i]);
 	}
 
-	if (!ctx_init) lbry_initstate();
-
 	do {
 		be32enc(&endiandata[27], n);
 		lbry_hash(vhashcpu, endiandata);
@@ -58,10 +58,20 @@ struct TortureGarden {
     } nodes[22];
 };
 
+#ifdef USE_STAGE_PROFILE
+// Profiler stage of each algo index
+static const int minotaur_stages[MINOTAUR_ALGO_COUNT + 1] = {
+    PROF_BLAKE512, PROF_BMW512, PROF_CUBEHASH512, PROF_ECHO512, PROF_FUGUE512, PROF_GROESTL512,
+    PROF_HAMSI512, PROF_SHA512, PROF_JH512, PROF_KECCAK512, PROF_LUFFA512, PROF_SHABAL512,
+    PROF_SHAVITE512, PROF_SIMD512, PROF_SKEIN512, PROF_WHIRLPOOL, PROF_YESPOWER
+};
+#endif
+
 // Get a 64-byte hash for given 64-byte input, using given TortureGarden contexts and given algo index
 void get_hash(void *output, const void *input, TortureGarden *garden, unsigned int algo)
 {    
 	unsigned char _ALIGN(64) hash[64];
+    PROF_START();
     memset(hash, 0, sizeof(hash));                        // Doesn't affect Minotaur as all hash outputs are 64 bytes; required for MinotaurX due to yespower's 32 byte output.
 
     switch (algo) {
@@ -149,6 +159,7 @@ void get_hash(void *output, const void *input, TortureGarden *garden, unsigned i
         case 16:
             yespower_tls(input, 64, &yespower_params, (yespower_binary_t*)hash);
     }
+    PROF_STAGE(minotaur_stages[algo]);
 
     // Output the hash
     memcpy(output, hash, 64);
@@ -218,9 +229,11 @@ void minotaurhash(void *output, const void *input, bool minotaurX)
         
     // Find initial sha512 hash
     unsigned char _ALIGN(64) hash[64];
+    PROF_START();
 	sph_sha512_init(&garden.context_sha2);
 	sph_sha512(&garden.context_sha2, input, 80);
 	sph_sha512_close(&garden.context_sha2, hash);
+    PROF_STAGE(PROF_SHA512);
 
 #ifdef MINOTAUR_DEBUG
     printf("** Initial hash:\t\t");
@@ -502,9 +502,25 @@ static inline void scrypt_core(uint32_t *X, uint32_t *V, int N)
 #define scrypt_best_throughput() 1
 #endif
 
+size_t scrypt_buffer_size(int N)
+{
+	return (size_t)N * SCRYPT_MAX_WAYS * 128 + 63;
+}
+
 unsigned char *scrypt_buffer_alloc(int N)
 {
-	return (uchar*) malloc((size_t)N * SCRYPT_MAX_WAYS * 128 + 63);
+	return (uchar*) malloc(scrypt_buffer_size(N));
+}
+
+/* hashes per round of scanhash_scrypt */
+int scrypt_lanes(void)
+{
+	int throughput = scrypt_best_throughput();
+#ifdef HAVE_SHA256_4WAY
+	if (sha256_use_4way())
+		throughput *= 4;
+#endif
+	return throughput;
 }
 
 static void scrypt_1024_1_1_256(const uint32_t *input, uint32_t *output,
@@ -700,14 +716,9 @@ extern int scanhash_scrypt(int thr_id, struct work *work, uint32_t max_nonce, ui
 	uint32_t midstate[8];
 	uint32_t n = pdata[19] - 1;
 	const uint32_t Htarg = ptarget[7];
-	int throughput = scrypt_best_throughput();
+	int throughput = scrypt_lanes();
 	int i;
 	
-#ifdef HAVE_SHA256_4WAY
-	if (sha256_use_4way())
-		throughput *= 4;
-#endif
-	
 	for (i = 0; i < throughput; i++)
 		memcpy(data + i * 20, pdata, 80);
 	
@@ -65,6 +65,12 @@ static void getAlgoString(const uint8_t* prevblock, char *output)
 	*sptr = '\0';
 }
 
+/* hash order of a header, for the api */
+void x16rv2_hash_order(const void *input, char *output)
+{
+	getAlgoString((const uint8_t*) input + 4, output);
+}
+
 // Pad the 24 bytes tiger hash to 64 bytes
 void padtiger512(uint32_t* hash) {
 	for (int i = (24/4); i < (64/4); i++) hash[i] = 0;
@@ -69,6 +69,12 @@ static void getAlgoString(const uint8_t* prevblock, char *output)
 	}
 }
 
+/* hash order of a header, for the api */
+void x16s_hash_order(const void *input, char *output)
+{
+	getAlgoString((const uint8_t*) input + 4, output);
+}
+
 void x16s_hash(void* output, const void* input)
 {
 	uint32_t _ALIGN(128) hash[64/4];
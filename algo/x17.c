@@ -47,73 +47,92 @@ void x17hash(void *output, const void *input)
 	sph_sha512_context       ctx_sha512;
 	sph_haval256_5_context   ctx_haval;
 
+	PROF_START();
+
 	sph_blake512_init(&ctx_blake);
 	sph_blake512(&ctx_blake, input, 80);
 	sph_blake512_close(&ctx_blake, hash);
+	PROF_STAGE(PROF_BLAKE512);
 
 	sph_bmw512_init(&ctx_bmw);
 	sph_bmw512(&ctx_bmw, hash, 64);
 	sph_bmw512_close(&ctx_bmw, hash);
+	PROF_STAGE(PROF_BMW512);
 
 	sph_groestl512_init(&ctx_groestl);
 	sph_groestl512(&ctx_groestl, hash, 64);
 	sph_groestl512_close(&ctx_groestl, hash);
+	PROF_STAGE(PROF_GROESTL512);
 
 	sph_skein512_init(&ctx_skein);
 	sph_skein512(&ctx_skein, hash, 64);
 	sph_skein512_close(&ctx_skein, hash);
+	PROF_STAGE(PROF_SKEIN512);
 
 	sph_jh512_init(&ctx_jh);
 	sph_jh512(&ctx_jh, hash, 64);
 	sph_jh512_close(&ctx_jh, hash);
+	PROF_STAGE(PROF_JH512);
 
 	sph_keccak512_init(&ctx_keccak);
 	sph_keccak512(&ctx_keccak, hash, 64);
 	sph_keccak512_close(&ctx_keccak, hash);
+	PROF_STAGE(PROF_KECCAK512);
 
 	sph_luffa512_init(&ctx_luffa);
 	sph_luffa512(&ctx_luffa, hash, 64);
 	sph_luffa512_close(&ctx_luffa, hash);
+	PROF_STAGE(PROF_LUFFA512);
 
 	sph_cubehash512_init(&ctx_cubehash);
 	sph_cubehash512(&ctx_cubehash, hash, 64);
 	sph_cubehash512_close(&ctx_cubehash, hash);
+	PROF_STAGE(PROF_CUBEHASH512);
 
 	sph_shavite512_init(&ctx_shavite);
 	sph_shavite512(&ctx_shavite, hash, 64);
 	sph_shavite512_close(&ctx_shavite, hash);
+	PROF_STAGE(PROF_SHAVITE512);
 
 	sph_simd512_init(&ctx_simd);
 	sph_simd512(&ctx_simd, hash, 64);
 	sph_simd512_close(&ctx_simd, hash);
+	PROF_STAGE(PROF_SIMD512);
 
 	sph_echo512_init(&ctx_echo);
 	sph_echo512(&ctx_echo, hash, 64);
 	sph_echo512_close(&ctx_echo, hash);
+	PROF_STAGE(PROF_ECHO512);
 
 	sph_hamsi512_init(&ctx_hamsi);
 	sph_hamsi512(&ctx_hamsi, hash, 64);
 	sph_hamsi512_close(&ctx_hamsi, hash);
+	PROF_STAGE(PROF_HAMSI512);
 
 	sph_fugue512_init(&ctx_fugue);
 	sph_fugue512(&ctx_fugue, hash, 64);
 	sph_fugue512_close(&ctx_fugue, hash);
+	PROF_STAGE(PROF_FUGUE512);
 
 	sph_shabal512_init(&ctx_shabal);
 	sph_shabal512(&ctx_shabal, hash, 64);
 	sph_shabal512_close(&ctx_shabal, hash);
+	PROF_STAGE(PROF_SHABAL512);
 
 	sph_whirlpool_init(&ctx_whirlpool);
 	sph_whirlpool(&ctx_whirlpool, hash, 64);
 	sph_whirlpool_close(&ctx_whirlpool, hash);
+	PROF_STAGE(PROF_WHIRLPOOL);
 
 	sph_sha512_init(&ctx_sha512);
 	sph_sha512(&ctx_sha512,(const void*) hash, 64);
 	sph_sha512_close(&ctx_sha512,(void*) hash);
+	PROF_STAGE(PROF_SHA512);
 
 	sph_haval256_5_init(&ctx_haval);
 	sph_haval256_5(&ctx_haval,(const void*) hash, 64);
 	sph_haval256_5_close(&ctx_haval, hash);
+	PROF_STAGE(PROF_HAVAL256);
 
 	memcpy(output, hash, 32);
 }
@@ -477,6 +477,17 @@ void xelisv2_hash(const uint32_t* input, uint32_t* output, uint8_t* xel_input, u
                         return;
 }
 
+/* single hash with its own buffers (selftest) */
+void xelisv2hash(void *output, const void *input)
+{
+	uint8_t *xel_input = (uint8_t *)calloc(INPUT_LEN, sizeof(uint8_t));
+	uint64_t *scratch = (uint64_t *)calloc(MEMSIZE, sizeof(uint64_t));
+
+	xelisv2_hash((const uint32_t*) input, (uint32_t*) output, xel_input, scratch);
+	free(scratch);
+	free(xel_input);
+}
+
 int scanhash_xelisv2(int thr_id, struct work *work, uint32_t max_nonce, uint64_t *hashes_done)
 {
         uint32_t _ALIGN(128) hash[8];
@@ -46,6 +46,9 @@
 # define CLOSESOCKET close
 # define SOCKETINIT {}
 # define SOCKERRMSG strerror(errno)
+# define SOCKWOULDBLOCK (errno == EAGAIN || errno == EWOULDBLOCK)
+# include <poll.h>
+# include <fcntl.h>
 #else
 # define SOCKETTYPE SOCKET
 # define SOCKETFAIL(a) ((a) == SOCKET_ERROR)
@@ -53,6 +56,12 @@
 # define INVINETADDR INADDR_NONE
 # define CLOSESOCKET closesocket
 # define in_addr_t uint32_t
+# define SOCKWOULDBLOCK (WSAGetLastError() == WSAEWOULDBLOCK)
+# define poll(fds, n, t) WSAPoll(fds, n, t)
+#endif
+
+#ifndef MSG_NOSIGNAL
+# define MSG_NOSIGNAL 0
 #endif
 
 #define GROUP(g) (toupper(g))
@@ -103,26 +112,112 @@ extern uint32_t rejected_count;
 #define cpu_threads opt_n_threads
 
 #define USE_MONITORING
-extern float cpu_temp(int);
-extern uint32_t cpu_clock(int);
-extern int cpu_fanpercent(void);
 
 /***************************************************************/
 
-static void cpustatus(int thr_id)
-{
-	if (thr_id >= 0 && thr_id < opt_n_threads) {
-		struct cpu_info *cpu = &thr_info[thr_id].cpu;
-		char buf[512]; *buf = '\0';
+/**
+ * The commands are answered from a snapshot of the miner stats taken
+ * once per second by the api thread, two copies are swapped so a request
+ * never waits on a miner lock or does a sensor read.
+ */
+#define SNAPSHOT_WINDOWS 4
+static const int snapshot_windows[SNAPSHOT_WINDOWS] = { STATS_EWMA, 10, 60, 900 };
+
+struct thr_snapshot {
+	double speed[SNAPSHOT_WINDOWS]; /* H/s */
+	struct scan_stats scan;
+	struct work_restart stale;
+	uint64_t affinity;
+};
+
+struct api_snapshot {
+	time_t ts;
+	char algo[64];
+	char pool[256];
+	int threads;
+	double speed[SNAPSHOT_WINDOWS];
+	uint32_t solved, accepted, rejected;
+	uint32_t dups, invalid;
+	uint32_t log_dropped, log_suppressed;
+	uint32_t rejects[REJECT_REASONS];
+	double net_diff, stratum_diff;
+	struct latency_stats submits, jobs;
+	struct sensors_snapshot sensors;
+	struct governor_state governor;
+	double mem_virtual, mem_resident; /* bytes, 0 if unknown */
+	struct pool_state pstate;
+	char kernel[32];
+	int lanes;
+	size_t scratch; /* bytes per thread */
+	struct thr_snapshot *thr;
+};
 
-		cpu->thr_id = thr_id;
-		cpu->khashes = thr_hashrates[thr_id] / 1000.0; //todo: stats_get_speed(thr_id, 0.0) / 1000.0;
+static struct api_snapshot snapshots[2];
+static struct api_snapshot *volatile snap = NULL;
 
-		snprintf(buf, sizeof(buf), "CPU=%d;KHS=%.2f|", thr_id, cpu->khashes);
+static void snapshot_update(void)
+{
+	struct api_snapshot *s = (snap == &snapshots[0]) ? &snapshots[1] : &snapshots[0];
+	int i, w;
 
-		// append to buffer
-		strcat(buffer, buf);
+	if (!s->thr) {
+		s->thr = (struct thr_snapshot*) calloc(opt_n_threads, sizeof(struct thr_snapshot));
+		if (!s->thr)
+			return;
+	}
+	s->ts = time(NULL);
+	s->threads = opt_n_threads;
+	get_currentalgo(s->algo, sizeof(s->algo));
+	get_currentpool(s->pool, sizeof(s->pool));
+
+	memset(s->speed, 0, sizeof(s->speed));
+	for (i = 0; i < opt_n_threads; i++) {
+		struct thr_snapshot *t = &s->thr[i];
+		for (w = 0; w < SNAPSHOT_WINDOWS; w++) {
+			t->speed[w] = stats_get_speed(i, snapshot_windows[w]);
+			s->speed[w] += t->speed[w];
+		}
+		stats_get_scan(i, &t->scan);
+		memcpy(&t->stale, &work_restart[i], sizeof(t->stale));
+		t->affinity = get_threadaffinity(i);
 	}
+	s->lanes = get_currentkernel(s->kernel, sizeof(s->kernel));
+	s->scratch = get_currentscratch();
+	get_poolstate(&s->pstate);
+
+	s->solved = solved_count;
+	s->accepted = accepted_count;
+	s->rejected = rejected_count;
+	shares_get_filtered(&s->dups, &s->invalid);
+	log_get_counts(&s->log_dropped, &s->log_suppressed);
+	stats_get_rejects(s->rejects);
+	s->net_diff = net_diff;
+	s->stratum_diff = stratum_diff;
+	stats_get_submit(&s->submits);
+	stats_get_job(&s->jobs);
+#ifdef USE_MONITORING
+	sensors_read(&s->sensors);
+#endif
+	memcpy(&s->governor, &governor, sizeof(s->governor));
+
+	proc_memory(&s->mem_virtual, &s->mem_resident);
+
+	mem_barrier();
+	snap = s;
+}
+
+/* one thread row at p, returns its length */
+static int cpustatus(int thr_id, char *p, size_t left)
+{
+	struct thr_snapshot *t = &snap->thr[thr_id];
+	float temp = 0.;
+#ifdef USE_MONITORING
+	temp = sensors_cpu_temp(&snap->sensors, thr_id % num_cpus);
+#endif
+
+	return snprintf(p, left, "CPU=%d;KHS=%.2f;KHS10S=%.2f;KHS1M=%.2f;KHS15M=%.2f;"
+		"TEMP=%.1f|", thr_id, t->speed[0] / 1000.0,
+		t->speed[1] / 1000.0, t->speed[2] / 1000.0, t->speed[3] / 1000.0, temp);
 }
 
 /*****************************************************************************/
@@ -132,31 +227,26 @@ static void cpustatus(int thr_id)
 */
 static char *getsummary(char *params)
 {
-	char algo[64]; *algo = '\0';
-	time_t ts = time(NULL);
-	double uptime = difftime(ts, startup);
-	double accps = (60.0 * accepted_count) / (uptime ? uptime : 1.0);
-
-	struct cpu_info cpu = { 0 };
-#ifdef USE_MONITORING
-	cpu.has_monitoring = true;
-	cpu.cpu_temp = cpu_temp(0);
-	cpu.cpu_fan = cpu_fanpercent();
-	cpu.cpu_clock = cpu_clock(0);
-#endif
-
-	get_currentalgo(algo, sizeof(algo));
+	struct api_snapshot *s = snap;
+	double uptime = difftime(s->ts, startup);
+	double accps = (60.0 * s->accepted) / (uptime ? uptime : 1.0);
 
 	*buffer = '\0';
 	sprintf(buffer, "NAME=%s;VER=%s;API=%s;"
-		"ALGO=%s;CPUS=%d;KHS=%.2f;SOLV=%d;ACC=%d;REJ=%d;"
+		"ALGO=%s;CPUS=%d;KHS=%.2f;KHS10S=%.2f;KHS1M=%.2f;KHS15M=%.2f;"
+		"SOLV=%d;ACC=%d;REJ=%d;DUP=%u;BAD=%u;"
 		"ACCMN=%.3f;DIFF=%.6f;TEMP=%.1f;FAN=%d;FREQ=%d;"
+		"SUBMITMS=%.1f;SUBMITMAX=%.1f;JOBMS=%.2f;JOBMAX=%.2f;"
 		"UPTIME=%.0f;TS=%u|",
 		PACKAGE_NAME, PACKAGE_VERSION, APIVERSION,
-		algo, opt_n_threads, (double)global_hashrate / 1000.0,
-		solved_count, accepted_count, rejected_count, accps, net_diff > 0. ? net_diff : stratum_diff,
-		cpu.cpu_temp, cpu.cpu_fan, cpu.cpu_clock,
-		uptime, (uint32_t) ts);
+		s->algo, s->threads, s->speed[0] / 1000.0,
+		s->speed[1] / 1000.0, s->speed[2] / 1000.0, s->speed[3] / 1000.0,
+		s->solved, s->accepted, s->rejected, s->dups, s->invalid, accps,
+		s->net_diff > 0. ? s->net_diff : s->stratum_diff,
+		s->sensors.temp, s->sensors.fan, s->sensors.clock,
+		s->submits.count ? s->submits.total_ms / s->submits.count : 0., s->submits.max_ms,
+		s->jobs.count ? s->jobs.total_ms / s->jobs.count : 0., s->jobs.max_ms,
+		uptime, (uint32_t) s->ts);
 	return buffer;
 }
 
@@ -165,9 +255,309 @@ static char *getsummary(char *params)
  */
 static char *getthreads(char *params)
 {
+	char *p = buffer;
+	*buffer = '\0';
+	for (int i = 0; i < snap->threads; i++) {
+		if (p - buffer > MYBUFSIZ - 256)
+			break;
+		p += cpustatus(i, p, MYBUFSIZ - (p - buffer));
+	}
+	return buffer;
+}
+
+/**
+ * Time spent hashing stale work after a job change, per thread
+ * HISTO is a count list of log2 ms buckets (<1, <2, <4 ... >=1024 ms)
+ */
+static char *getstale(char *params)
+{
+	char *p = buffer;
+	*buffer = '\0';
+	for (int i = 0; i < snap->threads; i++) {
+		struct work_restart *wr = &snap->thr[i].stale;
+		double avg = wr->stale_count ? wr->stale_total_us / 1e3 / wr->stale_count : 0.;
+		// a row is below 256 bytes
+		if (p - buffer > MYBUFSIZ - 256)
+			break;
+		p += snprintf(p, MYBUFSIZ - (p - buffer), "CPU=%d;RESTARTS=%u;AVGMS=%.2f;MAXMS=%.2f;HISTO=",
+			i, wr->stale_count, avg, wr->stale_max_us / 1e3);
+		for (int n = 0; n < STALE_HISTO_SLOTS; n++)
+			p += snprintf(p, MYBUFSIZ - (p - buffer), n ? ",%u" : "%u", wr->stale_histo[n]);
+		p += snprintf(p, MYBUFSIZ - (p - buffer), "|");
+	}
+	return buffer;
+}
+
+/**
+ * Current decision of the thermal/power governor
+ */
+static char *getgovernor(char *params)
+{
+	struct governor_state *g = &snap->governor;
+	*buffer = '\0';
+	if (!g->enabled) {
+		sprintf(buffer, "ENABLED=0|");
+		return buffer;
+	}
+	sprintf(buffer, "ENABLED=1;MODE=%s;SETPOINT=%.1f;VALUE=%.1f;LEVEL=%.3f;"
+		"THREADS=%d;CPUS=%d;DUTY=%.1f;P=%.3f;I=%.3f;D=%.3f|",
+		g->power ? "power" : "temp", g->setpoint, g->value,
+		g->level, g->threads, snap->threads, g->duty / 10.0,
+		g->p, g->i, g->d);
+	return buffer;
+}
+
+/**
+ * Current pool connection, PING is the subscribe round trip
+ * NOTIFYAGE is the time since the last job, -1 without job
+ */
+static char *getpool(char *params)
+{
+	struct pool_state *ps = &snap->pstate;
+	*buffer = '\0';
+	snprintf(buffer, MYBUFSIZ, "URL=%s;STRATUM=%d;CONNECTED=%d;CONNTIME=%.0f;"
+		"PING=%.1f;NOTIFYAGE=%.0f;DIFF=%.6f;NETDIFF=%.6f;XNONCE1=%d;XNONCE2=%d|",
+		ps->url, (int) ps->stratum, (int) ps->connected,
+		ps->connected ? difftime(snap->ts, ps->connected_at) : 0.,
+		ps->ping_ms, ps->notify_age_ms, ps->diff, snap->net_diff,
+		ps->xnonce1_size, ps->xnonce2_size);
+	return buffer;
+}
+
+/**
+ * Per thread detail: cpu mask (0 if not bound), kernel variant and
+ * hashes per call, scratch bytes and the last restart latency
+ */
+static char *getthreadsdetail(char *params)
+{
+	char *p = buffer;
+	*buffer = '\0';
+	for (int i = 0; i < snap->threads; i++) {
+		struct thr_snapshot *t = &snap->thr[i];
+		if (p - buffer > MYBUFSIZ - 256)
+			break;
+		p += sprintf(p, "CPU=%d;AFFINITY=%llx;KERNEL=%s;LANES=%d;"
+			"KHS=%.2f;KHS10S=%.2f;KHS1M=%.2f;KHS15M=%.2f;SCRATCH=%lu;RESTARTMS=%.2f|",
+			i, (unsigned long long) t->affinity, snap->kernel, snap->lanes,
+			t->speed[0] / 1000.0, t->speed[1] / 1000.0,
+			t->speed[2] / 1000.0, t->speed[3] / 1000.0,
+			(unsigned long) snap->scratch, t->stale.stale_last_us / 1e3);
+	}
+	return buffer;
+}
+
+/**
+ * Current job, ORDER is the hash order of the x16r and gr like algos
+ */
+static char *getjob(char *params)
+{
+	struct pool_state *ps = &snap->pstate;
 	*buffer = '\0';
-	for (int i = 0; i < opt_n_threads; i++)
-		cpustatus(i);
+	snprintf(buffer, MYBUFSIZ, "JOB=%s;HEIGHT=%d;CLEAN=%d;AGE=%.0f;ALGO=%s;ORDER=%s|",
+		ps->job_id, ps->height, (int) ps->clean, ps->notify_age_ms,
+		snap->algo, ps->order);
+	return buffer;
+}
+
+/**
+ * Prometheus text exposition, GET /metrics (http only, not a websocket)
+ * The output buffer is kept between the scrapes.
+ */
+static char *mbuf = NULL;
+static size_t mbuf_size = 0, mbuf_len = 0;
+
+static void metric_printf(const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	for (;;) {
+		va_start(ap, fmt);
+		n = vsnprintf(mbuf + mbuf_len, mbuf_size - mbuf_len, fmt, ap);
+		va_end(ap);
+		if (n < 0)
+			return;
+		if (mbuf_len + n < mbuf_size) {
+			mbuf_len += n;
+			return;
+		}
+		size_t size = mbuf_size ? mbuf_size * 2 : 16384;
+		while (size <= mbuf_len + n)
+			size *= 2;
+		char *p = (char*) realloc(mbuf, size);
+		if (!p)
+			return;
+		mbuf = p;
+		mbuf_size = size;
+	}
+}
+
+static void metric_head(const char *name, const char *type, const char *help)
+{
+	metric_printf("# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/* label values escaping: backslash, double quote and newline */
+static void metric_label(char *out, size_t sz, const char *in)
+{
+	size_t n = 0;
+	for (; *in && n + 3 < sz; in++) {
+		if (*in == '\\' || *in == '"')
+			out[n++] = '\\';
+		if (*in == '\n') {
+			out[n++] = '\\';
+			out[n++] = 'n';
+			continue;
+		}
+		out[n++] = *in;
+	}
+	out[n] = '\0';
+}
+
+static void metric_histogram(const char *name, const char *help, const char *labels,
+	const struct latency_stats *ls)
+{
+	uint32_t sum = 0;
+
+	metric_head(name, "histogram", help);
+	for (int b = 0; b < LATENCY_BUCKETS; b++) {
+		sum += ls->histo[b];
+		metric_printf("%s_bucket{%s,le=\"%g\"} %u\n", name, labels,
+			stats_latency_bounds[b] / 1e3, sum);
+	}
+	metric_printf("%s_bucket{%s,le=\"+Inf\"} %u\n", name, labels, ls->count);
+	metric_printf("%s_sum{%s} %.6f\n", name, labels, ls->total_ms / 1e3);
+	metric_printf("%s_count{%s} %u\n", name, labels, ls->count);
+}
+
+static char *getmetrics(char *params)
+{
+	struct api_snapshot *s = snap;
+	char algo[64], pool[256], tmp[16];
+	char labels[640];
+	int i, w;
+
+	metric_label(algo, sizeof(algo), s->algo);
+	metric_label(pool, sizeof(pool), s->pool);
+	snprintf(labels, sizeof(labels), "algo=\"%s\",pool=\"%s\"", algo, pool);
+
+	mbuf_len = 0;
+	metric_printf("");
+	if (!mbuf)
+		return NULL;
+
+	metric_head("cpuminer_info", "gauge", "Miner version, algorithm and current pool");
+	metric_printf("cpuminer_info{%s,version=\"%s\"} 1\n", labels, PACKAGE_VERSION);
+	metric_head("cpuminer_uptime_seconds", "gauge", "Time since the api start");
+	metric_printf("cpuminer_uptime_seconds{%s} %.0f\n", labels, difftime(s->ts, startup));
+	metric_head("cpuminer_threads", "gauge", "Miner threads");
+	metric_printf("cpuminer_threads{%s} %d\n", labels, s->threads);
+
+	metric_head("cpuminer_hashrate", "gauge", "Hashes per second, window in seconds or ewma");
+	for (i = 0; i < s->threads; i++) {
+		for (w = 0; w < SNAPSHOT_WINDOWS; w++) {
+			if (snapshot_windows[w] == STATS_EWMA)
+				sprintf(tmp, "ewma");
+			else
+				sprintf(tmp, "%d", snapshot_windows[w]);
+			metric_printf("cpuminer_hashrate{%s,thread=\"%d\",window=\"%s\"} %.2f\n",
+				labels, i, tmp, s->thr[i].speed[w]);
+		}
+	}
+	metric_head("cpuminer_hashes_total", "counter", "Hashes done");
+	for (i = 0; i < s->threads; i++)
+		metric_printf("cpuminer_hashes_total{%s,thread=\"%d\"} %.0f\n", labels, i,
+			s->thr[i].scan.hashes);
+	metric_head("cpuminer_scan_window_nonces", "gauge", "Nonce range of the last scan slice");
+	for (i = 0; i < s->threads; i++)
+		metric_printf("cpuminer_scan_window_nonces{%s,thread=\"%d\"} %u\n", labels, i,
+			s->thr[i].scan.window);
+	metric_head("cpuminer_scan_slice_seconds", "gauge", "Duration of the last scan slice");
+	for (i = 0; i < s->threads; i++)
+		metric_printf("cpuminer_scan_slice_seconds{%s,thread=\"%d\"} %.6f\n", labels, i,
+			s->thr[i].scan.slice_ms / 1e3);
+	metric_head("cpuminer_job_restarts_total", "counter", "Scans interrupted by a new job");
+	for (i = 0; i < s->threads; i++)
+		metric_printf("cpuminer_job_restarts_total{%s,thread=\"%d\"} %u\n", labels, i,
+			s->thr[i].stale.stale_count);
+
+	metric_head("cpuminer_shares_accepted_total", "counter", "Shares accepted by the pool");
+	metric_printf("cpuminer_shares_accepted_total{%s} %u\n", labels, s->accepted);
+	metric_head("cpuminer_shares_rejected_total", "counter", "Shares rejected by the pool");
+	for (i = 0; i < REJECT_REASONS; i++)
+		metric_printf("cpuminer_shares_rejected_total{%s,reason=\"%s\"} %u\n", labels,
+			stats_reject_names[i], s->rejects[i]);
+	metric_head("cpuminer_shares_filtered_total", "counter", "Shares dropped before the submit");
+	metric_printf("cpuminer_shares_filtered_total{%s,reason=\"duplicate\"} %u\n", labels, s->dups);
+	metric_printf("cpuminer_shares_filtered_total{%s,reason=\"invalid\"} %u\n", labels, s->invalid);
+	metric_head("cpuminer_log_lost_total", "counter", "Log messages not written");
+	metric_printf("cpuminer_log_lost_total{%s,reason=\"dropped\"} %u\n", labels, s->log_dropped);
+	metric_printf("cpuminer_log_lost_total{%s,reason=\"suppressed\"} %u\n", labels, s->log_suppressed);
+	metric_head("cpuminer_blocks_solved_total", "counter", "Shares over the network difficulty");
+	metric_printf("cpuminer_blocks_solved_total{%s} %u\n", labels, s->solved);
+	metric_head("cpuminer_difficulty", "gauge", "Network or pool difficulty");
+	metric_printf("cpuminer_difficulty{%s,kind=\"pool\"} %.6f\n", labels, s->stratum_diff);
+	metric_printf("cpuminer_difficulty{%s,kind=\"network\"} %.6f\n", labels, s->net_diff);
+
+	metric_histogram("cpuminer_share_latency_seconds", "Share submit round trip",
+		labels, &s->submits);
+	metric_histogram("cpuminer_job_switch_seconds", "Delay between a job notify and its first hash",
+		labels, &s->jobs);
+
+#ifdef USE_MONITORING
+	metric_head("cpuminer_cpu_temperature_celsius", "gauge", "Package or core temperature");
+	metric_printf("cpuminer_cpu_temperature_celsius{%s,sensor=\"package\"} %.1f\n", labels, s->sensors.temp);
+	for (i = 0; i < s->sensors.sensors && i < MAX_SENSORS; i++)
+		metric_printf("cpuminer_cpu_temperature_celsius{%s,sensor=\"core%d\"} %.1f\n", labels, i,
+			s->sensors.core_temp[i]);
+	metric_head("cpuminer_cpu_frequency_hertz", "gauge", "Cpu clock");
+	metric_printf("cpuminer_cpu_frequency_hertz{%s} %.0f\n", labels, s->sensors.clock * 1e3);
+	metric_head("cpuminer_fan_percent", "gauge", "Fan speed");
+	metric_printf("cpuminer_fan_percent{%s} %d\n", labels, s->sensors.fan);
+	if (sensors_have_power()) {
+		metric_head("cpuminer_cpu_power_watts", "gauge", "Package power (rapl)");
+		metric_printf("cpuminer_cpu_power_watts{%s} %.2f\n", labels, s->sensors.power);
+	}
+#endif
+
+	if (s->mem_resident > 0.) {
+		metric_head("cpuminer_memory_bytes", "gauge", "Process memory");
+		metric_printf("cpuminer_memory_bytes{%s,kind=\"virtual\"} %.0f\n", labels, s->mem_virtual);
+		metric_printf("cpuminer_memory_bytes{%s,kind=\"resident\"} %.0f\n", labels, s->mem_resident);
+	}
+	return mbuf;
+}
+
+/**
+ * Cycles per hash stage (--stage-profile), all threads or stages|N
+ * NS is the average in nanoseconds, SHARE the part of the profiled time
+ */
+static char *getstages(char *params)
+{
+	struct prof_stats st[PROF_STAGES];
+	int thr_id = params && *params ? atoi(params) : -1;
+	uint64_t total = 0;
+	char *p = buffer;
+	int i;
+
+	*buffer = '\0';
+	if (!opt_stage_profile) {
+		sprintf(buffer, "ENABLED=0|");
+		return buffer;
+	}
+	for (i = 0; i < PROF_STAGES; i++) {
+		prof_get(thr_id, i, &st[i]);
+		total += st[i].ticks;
+	}
+	for (i = 0; i < PROF_STAGES; i++) {
+		if (!st[i].count)
+			continue;
+		p += sprintf(p, "STAGE=%s;CALLS=%llu;TICKS=%.0f;NS=%.1f;P50=%llu;P99=%llu;SHARE=%.2f|",
+			prof_stage_names[i], (unsigned long long) st[i].count, st[i].avg,
+			st[i].rate > 0. ? st[i].avg * 1e3 / st[i].rate : 0.,
+			(unsigned long long) st[i].p50, (unsigned long long) st[i].p99,
+			100. * st[i].ticks / total);
+	}
 	return buffer;
 }
 
@@ -216,6 +606,13 @@ struct CMDS {
 } cmds[] = {
 	{ "summary", getsummary },
 	{ "threads", getthreads },
+	{ "stale",   getstale },
+	{ "governor", getgovernor },
+	{ "metrics", getmetrics },
+	{ "stages",  getstages },
+	{ "pool",    getpool },
+	{ "threadsdetail", getthreadsdetail },
+	{ "job",     getjob },
 	/* remote functions */
 	{ "seturl", remote_seturl },
 	{ "quit",    remote_quit },
@@ -235,16 +632,68 @@ static char *gethelp(char *params)
 }
 
 
-static int send_result(SOCKETTYPE c, char *result)
+/**
+ * Clients are served by a single poll() loop, each one has its own
+ * input and output buffers so a slow reader can't stall the others.
+ * Plain requests are closed once answered, websocket sessions stay
+ * open and get one text frame per command.
+ */
+#define API_MAX_CLIENTS 64
+#define API_IDLE_TIMEOUT 10 /* seconds, websocket sessions: 30x */
+
+struct api_client {
+	SOCKETTYPE fd;
+	char group;
+	bool websocket;
+	bool closing; /* once the output is sent */
+	time_t last;
+	int inlen;
+	char in[SOCK_REC_BUFSZ + 1];
+	char *out;
+	size_t outpos, outlen, outsize;
+};
+
+static struct api_client clients[API_MAX_CLIENTS];
+static int num_clients = 0;
+
+static bool client_write(struct api_client *cl, const void *data, size_t len)
 {
-	int n;
-	if (!result) {
-		n = (int) send(c, "", 1, 0);
-	} else {
-		// ignore failure - it's closed immediately anyway
-		n = (int) send(c, result, (int) strlen(result) + 1, 0);
+	if (cl->outpos && cl->outpos == cl->outlen)
+		cl->outpos = cl->outlen = 0;
+	if (cl->outlen + len > cl->outsize) {
+		size_t size = cl->outsize ? cl->outsize : 4096;
+		while (size < cl->outlen + len)
+			size *= 2;
+		char *p = (char*) realloc(cl->out, size);
+		if (!p)
+			return false;
+		cl->out = p;
+		cl->outsize = size;
 	}
-	return n;
+	memcpy(cl->out + cl->outlen, data, len);
+	cl->outlen += len;
+	return true;
+}
+
+static void send_result(struct api_client *cl, char *result)
+{
+	if (!result)
+		client_write(cl, "", 1);
+	else
+		client_write(cl, result, strlen(result) + 1);
+	cl->closing = true;
+}
+
+/* false if the connection is lost */
+static bool client_flush(struct api_client *cl)
+{
+	while (cl->outpos < cl->outlen) {
+		int n = (int) send(cl->fd, cl->out + cl->outpos, (int) (cl->outlen - cl->outpos), MSG_NOSIGNAL);
+		if (SOCKETFAIL(n))
+			return SOCKWOULDBLOCK;
+		cl->outpos += n;
+	}
+	return true;
 }
 
 /* ---- Base64 Encoding/Decoding Table --- */
@@ -317,8 +766,33 @@ static size_t base64_encode(const uchar *indata, size_t insize, char *outptr, si
 
 #include "compat/curl-for-windows/openssl/openssl/crypto/sha/sha.h"
 
-/* websocket handshake (tested in Chrome) */
-static int websocket_handshake(SOCKETTYPE c, char *result, char *clientkey)
+/* websocket frame, FIN + opcode (0x1 text, 0x8 close, 0xA pong) */
+static void websocket_frame(struct api_client *cl, int opcode, const char *data, size_t datalen)
+{
+	uchar hd[10] = { 0 };
+	int frames = 2;
+
+	hd[0] = (uchar) (0x80 | opcode);
+	if (datalen <= 125) {
+		hd[1] = (uchar) (datalen);
+	} else if (datalen <= 65535) {
+		hd[1] = (uchar) 126;
+		hd[2] = (uchar) (datalen >> 8);
+		hd[3] = (uchar) (datalen);
+		frames = 4;
+	} else {
+		uint64_t len64 = (uint64_t) datalen;
+		hd[1] = (uchar) 127;
+		for (int i = 0; i < 8; i++)
+			hd[2 + i] = (uchar) (len64 >> (56 - 8 * i));
+		frames = 10;
+	}
+	client_write(cl, hd, frames);
+	client_write(cl, data, datalen);
+}
+
+/* websocket handshake (tested in Chrome), the result is the first frame */
+static void websocket_handshake(struct api_client *cl, char *result, char *clientkey)
 {
 	char answer[256];
 	char inpkey[128] = { 0 };
@@ -329,7 +803,7 @@ static int websocket_handshake(SOCKETTYPE c, char *result, char *clientkey)
 	if (opt_protocol)
 		applog(LOG_DEBUG, "clientkey: %s", clientkey);
 
-	sprintf(inpkey, "%s258EAFA5-E914-47DA-95CA-C5AB0DC85B11", clientkey);
+	snprintf(inpkey, sizeof(inpkey), "%s258EAFA5-E914-47DA-95CA-C5AB0DC85B11", clientkey);
 
 	// SHA-1 test from rfc, returns in base64 "s3pPLMBiTxaQ9kYGzzhZRbK+xOo="
 	//sprintf(inpkey, "dGhlIHNhbXBsZSBub25jZQ==258EAFA5-E914-47DA-95CA-C5AB0DC85B11");
@@ -347,48 +821,10 @@ static int websocket_handshake(SOCKETTYPE c, char *result, char *clientkey)
 		"Sec-WebSocket-Protocol: text\r\n"
 		"\r\n", seckey);
 
-	// data result as tcp frame
-
-	uchar hd[10] = { 0 };
-	hd[0] = 129; // 0x1 text frame (FIN + opcode)
-	uint64_t datalen = (uint64_t) strlen(result);
-	uint8_t frames = 2;
-	if (datalen <= 125) {
-		hd[1] = (uchar) (datalen);
-	} else if (datalen <= 65535) {
-		hd[1] = (uchar) 126;
-		hd[2] = (uchar) (datalen >> 8);
-		hd[3] = (uchar) (datalen);
-		frames = 4;
-	} else {
-		hd[1] = (uchar) 127;
-		hd[2] = (uchar) (datalen >> 56);
-		hd[3] = (uchar) (datalen >> 48);
-		hd[4] = (uchar) (datalen >> 40);
-		hd[5] = (uchar) (datalen >> 32);
-		hd[6] = (uchar) (datalen >> 24);
-		hd[7] = (uchar) (datalen >> 16);
-		hd[8] = (uchar) (datalen >> 8);
-		hd[9] = (uchar) (datalen);
-		frames = 10;
-	}
-
-	size_t handlen = strlen(answer);
-	uchar *data = (uchar*) calloc(1, handlen + frames + (size_t) datalen + 1);
-	if (data == NULL)
-		return -1;
-	else {
-		uchar *p = data;
-		// HTTP header 101
-		memcpy(p, answer, handlen);
-		p += handlen;
-		// WebSocket Frame - Header + Data
-		memcpy(p, hd, frames);
-		memcpy(p + frames, result, (size_t)datalen);
-		send(c, (const char*)data, (int) (strlen(answer) + frames + (size_t)datalen + 1), 0);
-		free(data);
-	}
-	return 0;
+	client_write(cl, answer, strlen(answer));
+	if (result)
+		websocket_frame(cl, 0x1, result, strlen(result));
+	cl->websocket = true;
 }
 
 /*
@@ -509,23 +945,251 @@ static bool check_connect(struct sockaddr_in *cli, char **connectaddr, char *gro
 	return addrok;
 }
 
+static void set_nonblocking(SOCKETTYPE fd)
+{
+#ifdef WIN32
+	u_long on = 1;
+	ioctlsocket(fd, FIONBIO, &on);
+#else
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+#endif
+}
+
+/* cmd|params, NULL if the command is unknown */
+static char *api_exec(char *cmd)
+{
+	char *params = strchr(cmd, '|');
+	if (params != NULL)
+		*(params++) = '\0';
+
+	if (opt_debug && opt_protocol)
+		applog(LOG_DEBUG, "API: exec command %s(%s)", cmd, params);
+
+	for (int i = 0; i < CMDMAX; i++) {
+		if (strcmp(cmd, cmds[i].name) == 0) {
+			if (params && strlen(params)) {
+				// remove possible trailing |
+				if (params[strlen(params) - 1] == '|')
+					params[strlen(params) - 1] = '\0';
+			}
+			return (cmds[i].func)(params);
+		}
+	}
+	return NULL;
+}
+
+/* GET /cmd/params, websocket upgrade or /metrics */
+static void client_http(struct api_client *cl, char *msg)
+{
+	char cmd[256] = { 0 };
+	char *params, *wskey;
+	char *result;
+
+	sscanf(&msg[5], "%255s", cmd);
+	params = strchr(cmd, '/');
+	if (params)
+		*(params++) = '|';
+	params = strchr(cmd, '/');
+	if (params)
+		*(params++) = '\0';
+	wskey = strstr(msg, "Sec-WebSocket-Key");
+	if (wskey) {
+		char *eol = strchr(wskey, '\r');
+		if (eol) *eol = '\0';
+		wskey = strchr(wskey, ':');
+		if (wskey) {
+			wskey++;
+			while ((*wskey) == ' ') wskey++; // ltrim
+		}
+	}
+
+	if (!wskey && !strncmp(cmd, "metrics", 7) && (!cmd[7] || cmd[7] == '?')) {
+		char head[160];
+		int n;
+		result = getmetrics(NULL);
+		if (!result)
+			n = sprintf(head, "HTTP/1.0 500 Internal Server Error\r\nContent-Length: 0\r\n\r\n");
+		else
+			n = sprintf(head, "HTTP/1.0 200 OK\r\n"
+				"Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+				"Content-Length: %u\r\nConnection: close\r\n\r\n", (uint32_t) mbuf_len);
+		client_write(cl, head, n);
+		if (result)
+			client_write(cl, result, mbuf_len);
+		cl->closing = true;
+		return;
+	}
+
+	result = *cmd ? api_exec(cmd) : NULL;
+	if (wskey)
+		websocket_handshake(cl, result, wskey);
+	else if (result)
+		send_result(cl, result);
+	else
+		cl->closing = true;
+}
+
+/* client frames are masked, only the small ones are accepted */
+static void client_frames(struct api_client *cl)
+{
+	while (cl->inlen >= 2 && !cl->closing) {
+		uchar *p = (uchar*) cl->in;
+		int opcode = p[0] & 0x0f;
+		int hl = 2, len = p[1] & 0x7f;
+		char cmd[SOCK_REC_BUFSZ + 1];
+
+		if (len == 126) {
+			if (cl->inlen < 4)
+				return;
+			len = (p[2] << 8) | p[3];
+			hl = 4;
+		} else if (len == 127) {
+			cl->closing = true;
+			return;
+		}
+		if (p[1] & 0x80)
+			hl += 4;
+		if (hl + len > SOCK_REC_BUFSZ) {
+			cl->closing = true;
+			return;
+		}
+		if (cl->inlen < hl + len)
+			return;
+
+		memcpy(cmd, cl->in + hl, len);
+		cmd[len] = '\0';
+		if (p[1] & 0x80) {
+			for (int i = 0; i < len; i++)
+				cmd[i] ^= p[hl - 4 + (i & 3)];
+		}
+
+		switch (opcode) {
+		case 0x1: {
+			char *result;
+			while (len > 0 && (cmd[len - 1] == '\n' || cmd[len - 1] == '\r'))
+				cmd[--len] = '\0';
+			result = api_exec(cmd);
+			if (result)
+				websocket_frame(cl, 0x1, result, strlen(result));
+			break;
+		}
+		case 0x8:
+			websocket_frame(cl, 0x8, cmd, len < 2 ? len : 2);
+			cl->closing = true;
+			break;
+		case 0x9:
+			websocket_frame(cl, 0xA, cmd, len);
+			break;
+		}
+
+		cl->inlen -= hl + len;
+		memmove(cl->in, cl->in + hl + len, cl->inlen);
+	}
+}
+
+/* false if the connection is lost */
+static bool client_read(struct api_client *cl, time_t now)
+{
+	char *msg;
+	int n;
+
+	n = (int) recv(cl->fd, cl->in + cl->inlen, SOCK_REC_BUFSZ - cl->inlen, 0);
+	if (n == 0)
+		return false;
+	if (SOCKETFAIL(n))
+		return SOCKWOULDBLOCK;
+	cl->inlen += n;
+	cl->in[cl->inlen] = '\0';
+	cl->last = now;
+
+	if (cl->closing) {
+		cl->inlen = 0;
+		return true;
+	}
+	if (cl->websocket) {
+		client_frames(cl);
+		return true;
+	}
+
+	/* Websocket requests compat, wait for the complete http header */
+	if ((msg = strstr(cl->in, "GET /")) && strlen(msg) > 5) {
+		if (!strstr(msg, "\r\n\r\n") && !strstr(msg, "\n\n") && cl->inlen < SOCK_REC_BUFSZ)
+			return true;
+		client_http(cl, msg);
+		cl->inlen = 0;
+		return true;
+	}
+
+	/* telnet compat \r\n */
+	while (cl->inlen > 0 && (cl->in[cl->inlen - 1] == '\n' || cl->in[cl->inlen - 1] == '\r'))
+		cl->in[--cl->inlen] = '\0';
+	msg = api_exec(cl->in);
+	if (msg)
+		send_result(cl, msg);
+	else
+		cl->closing = true;
+	cl->inlen = 0;
+	return true;
+}
+
+static void client_close(struct api_client *cl)
+{
+	CLOSESOCKET(cl->fd);
+	cl->fd = INVSOCK;
+	free(cl->out);
+	cl->out = NULL;
+}
+
+/* false on a fatal error of the listening socket */
+static bool api_accept(SOCKETTYPE apisock, time_t now)
+{
+	struct sockaddr_in cli;
+	socklen_t clisiz;
+	char *connectaddr;
+	char group;
+	bool addrok;
+	SOCKETTYPE c;
+
+	for (;;) {
+		clisiz = sizeof(cli);
+		c = accept(apisock, (struct sockaddr *)(&cli), &clisiz);
+		if (SOCKETFAIL(c)) {
+			if (SOCKWOULDBLOCK || errno == EINTR || errno == ECONNABORTED)
+				return true;
+			applog(LOG_ERR, "API failed (%s)%s", strerror(errno), UNAVAILABLE);
+			return false;
+		}
+
+		addrok = check_connect(&cli, &connectaddr, &group);
+		if (opt_debug && opt_protocol)
+			applog(LOG_DEBUG, "API: connection from %s - %s",
+				connectaddr, addrok ? "Accepted" : "Ignored");
+
+		if (!addrok || num_clients >= API_MAX_CLIENTS) {
+			if (addrok && opt_debug)
+				applog(LOG_DEBUG, "API: too many clients");
+			CLOSESOCKET(c);
+			continue;
+		}
+
+		set_nonblocking(c);
+		struct api_client *cl = &clients[num_clients++];
+		memset(cl, 0, sizeof(*cl));
+		cl->fd = c;
+		cl->group = group;
+		cl->last = now;
+	}
+}
+
 static void api()
 {
 	const char *addr = opt_api_allow;
 	unsigned short port = (unsigned short) opt_api_listen; // 4048
-	char buf[MYBUFSIZ];
-	int c, n, bound;
-	char *connectaddr;
+	int n, bound;
 	char *binderror;
-	char group;
 	time_t bindstart;
 	struct sockaddr_in serv;
-	struct sockaddr_in cli;
-	socklen_t clisiz;
-	bool addrok = false;
-	long long counter;
-	char *result;
-	char *params;
+	struct timeval snap_tv;
 	int i;
 
 	SOCKETTYPE *apisock;
@@ -608,96 +1272,75 @@ static void api()
 	}
 
 	buffer = (char *) calloc(1, MYBUFSIZ + 1);
+	set_nonblocking(*apisock);
+
+	snapshot_update();
+	gettimeofday(&snap_tv, NULL);
 
-	counter = 0;
 	while (bye == 0) {
-		counter++;
+		struct pollfd fds[API_MAX_CLIENTS + 1];
+		struct timeval now, diff;
+		int wait_ms, polled = num_clients;
+
+		fds[0].fd = *apisock;
+		fds[0].events = POLLIN;
+		fds[0].revents = 0;
+		for (i = 0; i < polled; i++) {
+			fds[i + 1].fd = clients[i].fd;
+			fds[i + 1].events = POLLIN;
+			if (clients[i].outpos < clients[i].outlen)
+				fds[i + 1].events |= POLLOUT;
+			fds[i + 1].revents = 0;
+		}
 
-		clisiz = sizeof(cli);
-		if (SOCKETFAIL(c = accept((SOCKETTYPE)*apisock, (struct sockaddr *)(&cli), &clisiz))) {
+		gettimeofday(&now, NULL);
+		timeval_subtract(&diff, &now, &snap_tv);
+		wait_ms = 1000 - (int) (diff.tv_sec * 1000 + diff.tv_usec / 1000);
+		if (wait_ms < 0) wait_ms = 0;
+		if (wait_ms > 1000) wait_ms = 1000;
+
+		if (poll(fds, polled + 1, wait_ms) < 0 && errno != EINTR) {
 			applog(LOG_ERR, "API failed (%s)%s", strerror(errno), UNAVAILABLE);
-			CLOSESOCKET(*apisock);
-			free(apisock);
-			free(buffer);
-			return;
+			break;
 		}
 
-		addrok = check_connect(&cli, &connectaddr, &group);
-		if (opt_debug && opt_protocol)
-			applog(LOG_DEBUG, "API: connection from %s - %s",
-				connectaddr, addrok ? "Accepted" : "Ignored");
-
-		if (addrok) {
-			bool fail;
-			char *wskey = NULL;
-			n = recv(c, &buf[0], SOCK_REC_BUFSZ, 0);
-
-			fail = SOCKETFAIL(n);
-			if (fail)
-				buf[0] = '\0';
-			else if (n > 0 && buf[n-1] == '\n') {
-				/* telnet compat \r\n */
-				buf[n-1] = '\0'; n--;
-				if (n > 0 && buf[n-1] == '\r')
-					buf[n-1] = '\0';
-			}
-			if (n >= 0)
-				buf[n] = '\0';
-
-			//if (opt_debug && opt_protocol && n > 0)
-			//	applog(LOG_DEBUG, "API: recv command: (%d) '%s'+char(%x)", n, buf, buf[n-1]);
-
-			if (!fail) {
-				char *msg = NULL;
-				/* Websocket requests compat. */
-				if ((msg = strstr(buf, "GET /")) && strlen(msg) > 5) {
-					char cmd[256] = { 0 };
-					sscanf(&msg[5], "%s\n", cmd);
-					params = strchr(cmd, '/');
-					if (params)
-						*(params++) = '|';
-					params = strchr(cmd, '/');
-					if (params)
-						*(params++) = '\0';
-					wskey = strstr(msg, "Sec-WebSocket-Key");
-					if (wskey) {
-						char *eol = strchr(wskey, '\r');
-						if (eol) *eol = '\0';
-						wskey = strchr(wskey, ':');
-						wskey++;
-						while ((*wskey) == ' ') wskey++; // ltrim
-					}
-					n = sprintf(buf, "%s", cmd);
-				}
+		gettimeofday(&now, NULL);
+		timeval_subtract(&diff, &now, &snap_tv);
+		if (diff.tv_sec >= 1 || diff.tv_sec < 0) {
+			snapshot_update();
+			snap_tv = now;
+		}
 
-				params = strchr(buf, '|');
-				if (params != NULL)
-					*(params++) = '\0';
-
-				if (opt_debug && opt_protocol && n > 0)
-					applog(LOG_DEBUG, "API: exec command %s(%s)", buf, params);
-
-				for (i = 0; i < CMDMAX; i++) {
-					if (strcmp(buf, cmds[i].name) == 0) {
-						if (params && strlen(params)) {
-							// remove possible trailing |
-							if (params[strlen(params) - 1] == '|')
-								params[strlen(params) - 1] = '\0';
-						}
-						result = (cmds[i].func)(params);
-						if (wskey) {
-							websocket_handshake(c, result, wskey);
-							break;
-						}
-						send_result(c, result);
-						break;
-					}
-				}
-				CLOSESOCKET(c);
-			}
+		for (i = 0; i < polled; i++) {
+			struct api_client *cl = &clients[i];
+			short revents = fds[i + 1].revents;
+			bool ok = true;
+			if (revents & POLLIN)
+				ok = client_read(cl, now.tv_sec);
+			else if (revents & (POLLERR | POLLHUP | POLLNVAL))
+				ok = false;
+			if (ok)
+				ok = client_flush(cl);
+			if (ok && cl->closing && cl->outpos == cl->outlen)
+				ok = false;
+			if (ok && now.tv_sec - cl->last > API_IDLE_TIMEOUT * (cl->websocket ? 30 : 1))
+				ok = false;
+			if (!ok)
+				client_close(cl);
+		}
+		for (i = n = 0; i < num_clients; i++) {
+			if (clients[i].fd != INVSOCK)
+				clients[n++] = clients[i];
 		}
+		num_clients = n;
+
+		if ((fds[0].revents & POLLIN) && !api_accept(*apisock, now.tv_sec))
+			break;
 	}
 
+	for (i = 0; i < num_clients; i++)
+		client_close(&clients[i]);
+	num_clients = 0;
 	CLOSESOCKET(*apisock);
 	free(apisock);
 	free(buffer);
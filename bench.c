@@ -0,0 +1,478 @@
+/**
+ * Benchmark suite, see --bench-suite
+ *
+ * Each selected algo scans the --benchmark header with 1, 2, 4.. up to
+ * -t threads: one second of warmup, then --bench-time seconds measured.
+ * The scans are sliced to about 20 ms, the time per hash of each slice
+ * gives the latency percentiles. The report is a JSON document.
+ *
+ * --autotune measures the -a algo with each thread count up to -t, then
+ * the best one with and without the per cpu thread binding, and saves
+ * the winner in the "autotuned" object of the config file, by cpu model
+ * and algo.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+#ifndef WIN32
+#include <unistd.h>
+#endif
+#ifndef _MSC_VER
+/* dirname() linux/mingw, else in compat.h */
+#include <libgen.h>
+#endif
+
+#include "miner.h"
+#include "res/algos.h"
+
+#define BENCH_WARMUP 1
+#define BENCH_SLICE 0.02 /* seconds per scan */
+#define TUNE_GAIN 1.01   /* more threads or no binding must gain 1% */
+
+char *opt_bench_suite = NULL;
+char *opt_bench_algos = NULL;
+int opt_bench_time = 5;
+bool opt_autotune = false;
+
+struct bench_thread {
+	pthread_t pth;
+	int id;
+	int threads;
+	volatile bool stop;
+	bool failed;
+	uint64_t hashes;
+	float *lat;       /* us per hash of the measured slices */
+	uint32_t nlat, alat;
+};
+
+static volatile bool bench_measure = false;
+static bool bench_pin = false; /* bind the threads like the miner does */
+
+static void *bench_worker(void *userdata)
+{
+	struct bench_thread *t = (struct bench_thread*) userdata;
+	unsigned char *scratchbuf = NULL;
+	struct work work;
+	uint64_t span = 16;
+
+	if (bench_pin && t->threads > 1 && num_cpus > 1) {
+		// the binding finds the thread in thr_info, like a miner thread
+		thr_info[t->id].pth = pthread_self();
+		affine_to_cpu_mask(t->id, 1UL << (t->id % num_cpus));
+	}
+	memset(&work, 0, sizeof(work));
+	algo_bench_work(&work);
+	work.data[19] = 0xffffffffU / t->threads * t->id;
+	if (!algo_scratch_alloc(&scratchbuf)) {
+		t->failed = true;
+		return NULL;
+	}
+
+	while (!t->stop) {
+		struct timeval tv_start, tv_end, diff;
+		uint64_t done = 0;
+		uint32_t first = work.data[19];
+		uint32_t max_nonce = first + (uint32_t) span < first ? 0xffffffffU : first + (uint32_t) span;
+		double secs;
+		bool measured = bench_measure;
+
+		gettimeofday(&tv_start, NULL);
+		if (algo_scanhash(t->id, &work, max_nonce, &done, scratchbuf) < 0) {
+			t->failed = true;
+			break;
+		}
+		gettimeofday(&tv_end, NULL);
+		timeval_subtract(&diff, &tv_end, &tv_start);
+		secs = diff.tv_sec + 1e-6 * diff.tv_usec;
+
+		if (measured && bench_measure && done) {
+			t->hashes += done;
+			if (t->nlat == t->alat) {
+				float *lat = (float*) realloc(t->lat, (t->alat ? 2 * t->alat : 1024) * sizeof(float));
+				if (lat) {
+					t->lat = lat;
+					t->alat = t->alat ? 2 * t->alat : 1024;
+				}
+			}
+			if (t->nlat < t->alat)
+				t->lat[t->nlat++] = (float) (1e6 * secs / done);
+		}
+		if (done && secs > 0.)
+			span = (uint64_t) (done * BENCH_SLICE / secs);
+		if (span < 1)
+			span = 1;
+		if (span > 0x1000000)
+			span = 0x1000000;
+		work.data[19]++;
+	}
+	free(scratchbuf);
+	return NULL;
+}
+
+static int cmp_float(const void *a, const void *b)
+{
+	float x = *(const float*) a, y = *(const float*) b;
+	return x < y ? -1 : x > y;
+}
+
+/* compiled kernels, the algos have no runtime dispatch except sha256 */
+void kernel_variant(int algo, char *buf, size_t sz)
+{
+#if defined(HAVE_SHA256_8WAY)
+	if (algo == ALGO_SHA256D && sha256_use_8way()) {
+		snprintf(buf, sz, "sha256 8-way");
+		return;
+	}
+#endif
+#if defined(HAVE_SHA256_4WAY)
+	if (algo == ALGO_SHA256D && sha256_use_4way()) {
+		snprintf(buf, sz, "sha256 4-way");
+		return;
+	}
+#endif
+	snprintf(buf, sz, "%s",
+#if defined(__AVX2__)
+		"avx2"
+#elif defined(__AVX__)
+		"avx"
+#elif defined(__SSE4_1__)
+		"sse4.1"
+#elif defined(__SSE2__) || defined(_M_X64)
+		"sse2"
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+		"neon"
+#else
+		"generic"
+#endif
+	);
+#if defined(__AES__)
+	strncat(buf, "+aes", sz - strlen(buf) - 1);
+#elif defined(__ARM_FEATURE_CRYPTO)
+	strncat(buf, "+crypto", sz - strlen(buf) - 1);
+#endif
+}
+
+/* hashes computed per kernel call */
+int kernel_lanes(int algo)
+{
+#if defined(HAVE_SHA256_8WAY)
+	if (algo == ALGO_SHA256D && sha256_use_8way())
+		return 8;
+#endif
+#if defined(HAVE_SHA256_4WAY)
+	if (algo == ALGO_SHA256D && sha256_use_4way())
+		return 4;
+#endif
+	if (algo == ALGO_SCRYPT)
+		return scrypt_lanes();
+	return 1;
+}
+
+/* one point of the curve, NULL if the algo failed */
+static json_t *bench_run(int threads)
+{
+	struct bench_thread *t = (struct bench_thread*) calloc(threads, sizeof(*t));
+	struct timeval tv_start, tv_end, diff;
+	double virt, rss0, rss1, secs;
+	uint64_t hashes = 0;
+	float *lat = NULL;
+	uint32_t nlat = 0;
+	bool failed = false;
+	json_t *run = NULL;
+	int i, started;
+
+	if (!t)
+		return NULL;
+	proc_memory(&virt, &rss0);
+	bench_measure = false;
+	for (started = 0; started < threads; started++) {
+		t[started].id = started;
+		t[started].threads = threads;
+		work_restart[started].restart = 0;
+		if (pthread_create(&t[started].pth, NULL, bench_worker, &t[started])) {
+			failed = true;
+			break;
+		}
+	}
+
+	if (!failed) {
+		sleep(BENCH_WARMUP);
+		gettimeofday(&tv_start, NULL);
+		bench_measure = true;
+		sleep(opt_bench_time);
+		bench_measure = false;
+		gettimeofday(&tv_end, NULL);
+		proc_memory(&virt, &rss1);
+	}
+	for (i = 0; i < started; i++) {
+		t[i].stop = true;
+		work_restart[i].restart = 1;
+	}
+	for (i = 0; i < started; i++) {
+		pthread_join(t[i].pth, NULL);
+		failed |= t[i].failed;
+		hashes += t[i].hashes;
+		nlat += t[i].nlat;
+	}
+	if (failed || !hashes)
+		goto out;
+
+	lat = (float*) malloc(nlat * sizeof(float));
+	if (!lat)
+		goto out;
+	for (i = 0, nlat = 0; i < threads; i++) {
+		memcpy(lat + nlat, t[i].lat, t[i].nlat * sizeof(float));
+		nlat += t[i].nlat;
+	}
+	qsort(lat, nlat, sizeof(float), cmp_float);
+
+	timeval_subtract(&diff, &tv_end, &tv_start);
+	secs = diff.tv_sec + 1e-6 * diff.tv_usec;
+	run = json_object();
+	json_object_set_new(run, "threads", json_integer(threads));
+	json_object_set_new(run, "hashrate", json_real(hashes / secs));
+	json_object_set_new(run, "hash_us_p50", json_real(lat[nlat / 2]));
+	json_object_set_new(run, "hash_us_p90", json_real(lat[nlat * 9 / 10]));
+	json_object_set_new(run, "hash_us_p99", json_real(lat[nlat * 99 / 100]));
+	json_object_set_new(run, "memory", json_integer(rss1 > rss0 ? (json_int_t) (rss1 - rss0) : 0));
+	json_object_set_new(run, "resident", json_integer((json_int_t) rss1));
+out:
+	for (i = 0; i < threads; i++)
+		free(t[i].lat);
+	free(t);
+	free(lat);
+	return run;
+}
+
+int bench_suite(void)
+{
+	char buf[256];
+	json_t *root, *algos;
+	FILE *f;
+	int algo, threads;
+
+	root = json_object();
+	algos = json_array();
+	json_object_set_new(root, "version", json_string(PACKAGE_VERSION));
+	cpu_getname(buf, sizeof(buf));
+	json_object_set_new(root, "cpu", json_string(buf));
+	cpu_getmodelid(buf, sizeof(buf));
+	json_object_set_new(root, "model", json_string(buf));
+	cpu_bestfeature(buf, sizeof(buf));
+	json_object_set_new(root, "features", json_string(buf));
+	json_object_set_new(root, "cores", json_integer(num_cpus));
+	json_object_set_new(root, "warmup", json_integer(BENCH_WARMUP));
+	json_object_set_new(root, "time", json_integer(opt_bench_time));
+
+	for (algo = 0; algo < ALGO_COUNT; algo++) {
+		json_t *entry, *runs;
+		double single = 0.;
+
+		if (!algo_in_list(opt_bench_algos, algo_names[algo]))
+			continue;
+		algo_select(algo);
+		entry = json_object();
+		runs = json_array();
+		json_object_set_new(entry, "algo", json_string(algo_names[algo]));
+		kernel_variant(algo, buf, sizeof(buf));
+		json_object_set_new(entry, "variant", json_string(buf));
+
+		threads = 1;
+		while (1) {
+			json_t *run = bench_run(threads);
+			double rate;
+			if (!run) {
+				applog(LOG_ERR, "Benchmark of %s failed with %d threads", algo_names[algo], threads);
+				json_object_set_new(entry, "error", json_string("scan failed"));
+				break;
+			}
+			rate = json_real_value(json_object_get(run, "hashrate"));
+			if (threads == 1)
+				single = rate;
+			json_object_set_new(run, "efficiency", json_real(single > 0. ? rate / (single * threads) : 0.));
+			json_array_append_new(runs, run);
+			format_hashrate(rate, buf);
+			applog(LOG_INFO, "%s, %d thread%s: %s", algo_names[algo], threads,
+				threads > 1 ? "s" : "", buf);
+			if (threads >= opt_n_threads)
+				break;
+			threads = threads * 2 > opt_n_threads ? opt_n_threads : threads * 2;
+		}
+		json_object_set_new(entry, "runs", runs);
+		json_array_append_new(algos, entry);
+	}
+	json_object_set_new(root, "algos", algos);
+
+	f = fopen(opt_bench_suite, "w");
+	if (!f) {
+		applog(LOG_ERR, "Unable to write %s", opt_bench_suite);
+		json_decref(root);
+		return 1;
+	}
+	json_dumpf(root, f, JSON_INDENT(2) | JSON_PRESERVE_ORDER);
+	fputc('\n', f);
+	fclose(f);
+	json_decref(root);
+	return 0;
+}
+
+/* the -c config, else the default one, else a new one beside the binary */
+static void autotune_path(char *out, size_t sz, char *argv0)
+{
+	char *cmd;
+
+	if (opt_config) {
+		snprintf(out, sz, "%s", opt_config);
+		return;
+	}
+	get_defconfig_path(out, sz, argv0);
+	if (strlen(out))
+		return;
+	cmd = strdup(argv0);
+	snprintf(out, sz, "%s/cpuminer-conf.json", dirname(cmd));
+	free(cmd);
+}
+
+/* the model id is unknown on arm, the name is better than nothing */
+static void autotune_cpu(char *out, size_t sz)
+{
+	cpu_getmodelid(out, sz);
+	if (!strlen(out))
+		cpu_getname(out, sz);
+	if (!strlen(out))
+		snprintf(out, sz, "unknown");
+}
+
+void autotune_apply(int algo, char *argv0)
+{
+	char path[MAX_PATH], cpu[128];
+	json_error_t err;
+	json_t *config, *entry;
+	int threads;
+
+	autotune_path(path, sizeof(path), argv0);
+	if (strstr(path, "://"))
+		return;
+	config = JSON_LOADF(path, &err);
+	if (!config)
+		return;
+	autotune_cpu(cpu, sizeof(cpu));
+	entry = json_object_get(json_object_get(json_object_get(config, "autotuned"), cpu),
+		algo_names[algo]);
+	threads = (int) json_integer_value(json_object_get(entry, "threads"));
+	if (threads > 0) {
+		opt_n_threads = threads;
+		// all the cpus, the threads are not bound one by one
+		if (json_is_false(json_object_get(entry, "pinned")) && opt_affinity == -1L && num_cpus < 63)
+			opt_affinity = (1LL << num_cpus) - 1;
+		applog(LOG_INFO, "Using %d autotuned threads%s for %s", threads,
+			opt_affinity == -1L ? "" : ", not bound", algo_names[algo]);
+	}
+	json_decref(config);
+}
+
+/* hashes per second, or -1 if the scan failed */
+static double autotune_rate(int algo, int threads, bool pin)
+{
+	json_t *run;
+	double rate;
+	char buf[32];
+
+	bench_pin = pin;
+	run = bench_run(threads);
+	bench_pin = false;
+	if (!run) {
+		applog(LOG_ERR, "Benchmark of %s failed with %d threads", algo_names[algo], threads);
+		return -1.;
+	}
+	rate = json_real_value(json_object_get(run, "hashrate"));
+	json_decref(run);
+	format_hashrate(rate, buf);
+	applog(LOG_INFO, "%s, %d thread%s%s: %s", algo_names[algo], threads,
+		threads > 1 ? "s" : "", pin ? "" : " not bound", buf);
+	return rate;
+}
+
+int autotune(int algo, char *argv0)
+{
+	char path[MAX_PATH], cpu[128], buf[64];
+	json_error_t err;
+	json_t *config, *tuned, *models, *entry;
+	double best = 0., rate;
+	int threads, best_threads = 1;
+	bool pinned = true;
+	FILE *f;
+
+	autotune_cpu(cpu, sizeof(cpu));
+	applog(LOG_INFO, "Autotune of %s on %s, 1 to %d threads", algo_names[algo], cpu, opt_n_threads);
+	for (threads = 1; threads <= opt_n_threads; threads++) {
+		// every count up to 16, then every 4th
+		if (threads > 16 && threads % 4 && threads != opt_n_threads)
+			continue;
+		rate = autotune_rate(algo, threads, true);
+		if (rate < 0.)
+			return 1;
+		// the memory hard algos often peak before the last core
+		if (rate > best * TUNE_GAIN) {
+			best = rate;
+			best_threads = threads;
+		}
+	}
+	if (best_threads > 1 && num_cpus > 1 && num_cpus < 63) {
+		rate = autotune_rate(algo, best_threads, false);
+		if (rate < 0.)
+			return 1;
+		if (rate > best * TUNE_GAIN) {
+			best = rate;
+			pinned = false;
+		}
+	}
+
+	autotune_path(path, sizeof(path), argv0);
+	if (strstr(path, "://")) {
+		applog(LOG_ERR, "Unable to save in the remote config %s", path);
+		return 1;
+	}
+	// never overwrite a config which does not parse
+	config = JSON_LOADF(path, &err);
+	if (!config && (f = fopen(path, "r"))) {
+		fclose(f);
+		applog(LOG_ERR, "%s:%d: %s", path, err.line, err.text);
+		return 1;
+	}
+	if (!json_is_object(config)) {
+		json_decref(config);
+		config = json_object();
+	}
+	tuned = json_object_get(config, "autotuned");
+	if (!json_is_object(tuned)) {
+		tuned = json_object();
+		json_object_set_new(config, "autotuned", tuned);
+	}
+	models = json_object_get(tuned, cpu);
+	if (!json_is_object(models)) {
+		models = json_object();
+		json_object_set_new(tuned, cpu, models);
+	}
+	entry = json_object();
+	json_object_set_new(entry, "threads", json_integer(best_threads));
+	json_object_set_new(entry, "pinned", json_boolean(pinned));
+	json_object_set_new(entry, "hashrate", json_real(best));
+	kernel_variant(algo, buf, sizeof(buf));
+	json_object_set_new(entry, "variant", json_string(buf));
+	json_object_set_new(models, algo_names[algo], entry);
+
+	if (json_dump_file(config, path, JSON_INDENT(2) | JSON_PRESERVE_ORDER)) {
+		applog(LOG_ERR, "Unable to write %s", path);
+		json_decref(config);
+		return 1;
+	}
+	json_decref(config);
+	format_hashrate(best, buf);
+	applog(LOG_NOTICE, "Autotune: %d thread%s%s for %s (%s), saved in %s", best_threads,
+		best_threads > 1 ? "s" : "", pinned ? "" : " not bound", algo_names[algo], buf, path);
+	return 0;
+}
@@ -11,6 +11,9 @@
 #endif
 
 #define sleep(secs) Sleep((secs) * 1000)
+#ifdef _MSC_VER
+#define usleep(usecs) Sleep((usecs) / 1000)
+#endif
 
 enum {
 	PRIO_PROCESS		= 0,
@@ -88,6 +88,8 @@ bool opt_benchmark = false;
 bool opt_redirect = true;
 bool opt_showdiff = true;
 bool opt_extranonce = true;
+static bool opt_version_rolling = true;
+static bool opt_share_check = false;
 bool want_longpoll = true;
 bool have_longpoll = false;
 bool have_gbt = true;
@@ -108,6 +110,8 @@ static int opt_fail_pause = 10;
 static int opt_time_limit = 0;
 int opt_timeout = 86400;
 static int opt_scantime = 5;
+int opt_switch_latency = 50; /* ms, 0 to disable */
+static int opt_submit_threads = 2;
 static enum algos opt_algo = ALGO_SCRYPT;
 static int opt_scrypt_n = 1024;
 static int opt_pluck_n = 128;
@@ -124,6 +128,7 @@ static unsigned char pk_script[25] = { 0 };
 static size_t pk_script_size = 0;
 static char coinbase_sig[101] = { 0 };
 char *opt_cert;
+char *opt_config = NULL; /* the last local -c file */
 char *opt_proxy;
 long opt_proxy_type;
 struct thr_info *thr_info;
@@ -131,9 +136,28 @@ int work_thr_id;
 int longpoll_thr_id = -1;
 int stratum_thr_id = -1;
 int api_thr_id = -1;
+int sensors_thr_id = -1;
+int governor_thr_id = -1;
+int events_thr_id = -1;
 bool stratum_need_reset = false;
 struct work_restart *work_restart = NULL;
 struct stratum_ctx stratum;
+
+/* stratum failover, pool 0 is --url on the ctx above, others are kept
+ * connected and authorized to switch without a new handshake */
+#define MAX_POOLS 5
+struct pool_infos {
+	struct stratum_ctx *sctx;
+	char *url;
+	char *user;
+	char *pass;
+	uint32_t notify_count; // at connect, a new job makes the pool ready
+	volatile bool ready;
+};
+static struct pool_infos pools[MAX_POOLS] = { { &stratum } };
+static int num_pools = 1;
+static volatile int cur_pool = 0;
+static struct thr_info *pool_thr = NULL;
 bool jsonrpc_2 = false;
 char rpc2_id[64] = "";
 char *rpc2_blob = NULL;
@@ -151,7 +175,7 @@ bool use_roots = false;
 uint32_t solved_count = 0L;
 uint32_t accepted_count = 0L;
 uint32_t rejected_count = 0L;
-double *thr_hashrates;
+double *thr_hashrates; /* last scan slice, sizes the next one (stats.c for display) */
 uint64_t global_hashrate = 0;
 double stratum_diff = 0.;
 double net_diff = 0.;
@@ -289,6 +313,29 @@ Options:\n\
   -s, --scantime=N         upper bound on time spent scanning current work when\n\
                            long polling is unavailable, in seconds (default: 5)\n\
       --randomize          Randomize scan range start to reduce duplicates\n\
+      --share-check        hash the shares again before the submit (fast algos)\n\
+      --stage-profile      cycles per hash stage of the chained algos, reported\n\
+                           at exit and by the api (needs --enable-stage-profile)\n\
+      --event-log=FILE     append the share and job events to a binary log\n\
+      --event-read=FILE    print the counts and latencies of an event log, and exit\n\
+      --bench-suite=FILE   benchmark the algos with 1, 2, 4.. -t threads, write\n\
+                           a JSON report to FILE and exit\n\
+      --bench-algos=LIST   comma separated algos of the suite (default: all)\n\
+      --bench-time=N       seconds measured per algo and thread count (default: 5)\n\
+      --selftest[=LIST]    check the hash kernels against known answers and the\n\
+                           reference hashes, all algos or a comma list, and exit\n\
+      --selftest-seed=N    seed of the random headers (default: the time)\n\
+      --autotune           benchmark the algo with 1 to -t threads, save the best\n\
+                           count for this cpu in the config file and exit, later\n\
+                           starts use it unless -t is given\n\
+      --stratum-record=FILE  append the stratum traffic with its timing to FILE\n\
+      --replay=FILE        mine a recorded stratum session from a local port,\n\
+                           without network, report the submits and exit\n\
+      --replay-speed=N     replay N times faster (default: 1, 0 for no waits)\n\
+      --submit-threads=N   parallel share submissions for getwork/gbt (default: 2)\n\
+      --failover-url=URL   backup stratum pool, user:pass@ prefix allowed (repeatable)\n\
+      --switch-latency=N   upper bound of a scan slice in ms with stratum or\n\
+                           long polling (default: 50, 0 to disable)\n\
   -f, --diff-factor        Divide req. difficulty by this factor (std is 1.0)\n\
   -m, --diff-multiplier    Multiply difficulty by this factor (std is 1.0)\n\
   -n, --nfactor            neoscrypt N-Factor\n\
@@ -301,6 +348,7 @@ Options:\n\
       --no-gbt             disable getblocktemplate support\n\
       --no-stratum         disable X-Stratum support\n\
       --no-extranonce      disable Stratum extranonce support\n\
+      --no-version-rolling disable the Stratum version rolling (bip310)\n\
       --no-redirect        ignore requests to change the URL of the mining server\n\
   -q, --quiet              disable per-thread hashmeter output\n\
       --no-color           disable colored output\n\
@@ -315,11 +363,17 @@ Options:\n\
   -B, --background         run the miner in the background\n\
       --benchmark          run in offline benchmark mode\n\
       --cputest            debug hashes from cpu algorithms\n\
+      --hex-bench          measure the hex encoder/decoder speed and exit\n\
       --cpu-affinity       set process affinity to cpu core(s), mask 0x3 for cores 0 and 1\n\
       --cpu-priority       set process priority (default: 0 idle, 2 normal to 5 highest)\n\
   -b, --api-bind           IP/Port for the miner API (default: 127.0.0.1:4048)\n\
       --api-remote         Allow remote control\n\
       --max-temp=N         Only mine if cpu temp is less than specified value (linux)\n\
+      --sensor-interval=N  cpu sensors sampling period in ms (default: 1000)\n\
+      --temp-target=N      adjust active threads and duty cycle to hold the\n\
+                           hottest core at N degrees C\n\
+      --power-target=N     same for a cpu package power of N watts (rapl),\n\
+                           exclusive with --temp-target\n\
       --max-rate=N[KMG]    Only mine if net hashrate is less than specified value\n\
       --max-diff=N         Only mine if net difficulty is less than specified value\n\
   -c, --config=FILE        load a JSON-format configuration file\n\
@@ -360,15 +414,18 @@ static struct option const options[] = {
 	{ "no-redirect", 0, NULL, 1009 },
 	{ "no-stratum", 0, NULL, 1007 },
 	{ "no-extranonce", 0, NULL, 1012 },
+	{ "no-version-rolling", 0, NULL, 1070 },
 	{ "max-temp", 1, NULL, 1060 },
 	{ "max-diff", 1, NULL, 1061 },
 	{ "max-rate", 1, NULL, 1062 },
 	{ "pass", 1, NULL, 'p' },
+	{ "power-target", 1, NULL, 1066 },
 	{ "protocol", 0, NULL, 'P' },
 	{ "protocol-dump", 0, NULL, 'P' },
 	{ "proxy", 1, NULL, 'x' },
 	{ "quiet", 0, NULL, 'q' },
 	{ "retries", 1, NULL, 'r' },
+	{ "sensor-interval", 1, NULL, 1064 },
 	{ "retry-pause", 1, NULL, 'R' },
 	{ "randomize", 0, NULL, 1024 },
 	{ "scantime", 1, NULL, 's' },
@@ -376,9 +433,27 @@ static struct option const options[] = {
 	{ "hide-diff", 0, NULL, 1014 },
 	{ "max-log-rate", 1, NULL, 1019 },
 	{ "show-hash-meter", 0, NULL, 'H' },
+	{ "share-check", 0, NULL, 1071 },
+	{ "stage-profile", 0, NULL, 1072 },
+	{ "event-log", 1, NULL, 1073 },
+	{ "event-read", 1, NULL, 1074 },
+	{ "bench-suite", 1, NULL, 1075 },
+	{ "bench-algos", 1, NULL, 1076 },
+	{ "bench-time", 1, NULL, 1077 },
+	{ "selftest", 2, NULL, 1078 },
+	{ "autotune", 0, NULL, 1079 },
+	{ "stratum-record", 1, NULL, 1080 },
+	{ "replay", 1, NULL, 1081 },
+	{ "replay-speed", 1, NULL, 1082 },
+	{ "selftest-seed", 1, NULL, 1083 },
+	{ "submit-threads", 1, NULL, 1067 },
+	{ "failover-url", 1, NULL, 1068 },
+	{ "hex-bench", 0, NULL, 1069 },
+	{ "switch-latency", 1, NULL, 1063 },
 #ifdef HAVE_SYSLOG_H
 	{ "syslog", 0, NULL, 'S' },
 #endif
+	{ "temp-target", 1, NULL, 1065 },
 	{ "time-limit", 1, NULL, 1008 },
 	{ "threads", 1, NULL, 't' },
 	{ "timeout", 1, NULL, 'T' },
@@ -393,6 +468,21 @@ static struct work g_work = {{ 0 }};
 static time_t g_work_time = 0;
 static pthread_mutex_t g_work_lock;
 static bool submit_old = false;
+
+/* getwork/gbt solutions are sent by a pool of submit threads */
+static struct thread_q *submit_q = NULL;
+static struct thr_info *submit_thr = NULL;
+
+/* stratum shares in flight, matched by request id on the pool answer */
+#define MAX_PENDING_SHARES 64
+struct pending_share {
+	int id;
+	struct timeval sent;
+	double sharediff;
+};
+static struct pending_share pending_shares[MAX_PENDING_SHARES];
+static int pending_share_id = 4; /* lower ids are used by the handshake */
+static pthread_mutex_t pending_lock;
 static char *lp_id;
 
 static void workio_cmd_free(struct workio_cmd *wc);
@@ -417,7 +507,7 @@ static inline void drop_policy(void)
 #define pthread_setaffinity_np(tid,sz,s) {} /* only do process affinity */
 #endif
 
-static void affine_to_cpu_mask(int id, unsigned long mask) {
+void affine_to_cpu_mask(int id, unsigned long mask) {
 	cpu_set_t set;
 	CPU_ZERO(&set);
 	for (uint8_t i = 0; i < num_cpus; i++) {
@@ -435,7 +525,7 @@ static void affine_to_cpu_mask(int id, unsigned long mask) {
 
 #elif defined(WIN32) /* Windows */
 static inline void drop_policy(void) { }
-static void affine_to_cpu_mask(int id, unsigned long mask) {
+void affine_to_cpu_mask(int id, unsigned long mask) {
 	if (id == -1)
 		SetProcessAffinityMask(GetCurrentProcess(), mask);
 	else
@@ -443,7 +533,7 @@ static void affine_to_cpu_mask(int id, unsigned long mask) {
 }
 #else
 static inline void drop_policy(void) { }
-static void affine_to_cpu_mask(int id, unsigned long mask) { }
+void affine_to_cpu_mask(int id, unsigned long mask) { }
 #endif
 
 void get_currentalgo(char* buf, int sz)
@@ -454,8 +544,103 @@ void get_currentalgo(char* buf, int sz)
 		snprintf(buf, sz, "%s", algo_names[opt_algo]);
 }
 
+void get_currentpool(char* buf, int sz)
+{
+	int p = cur_pool;
+	const char *url = p ? pools[p].url : rpc_url;
+	snprintf(buf, sz, "%s", url ? url : "");
+}
+
+/* kernel variant of the algo, returns the hashes per kernel call */
+int get_currentkernel(char* buf, int sz)
+{
+	kernel_variant(opt_algo, buf, sz);
+	return kernel_lanes(opt_algo);
+}
+
+/* scratch buffer allocated per thread, see algo_scratch_alloc() */
+size_t get_currentscratch(void)
+{
+	if (opt_algo == ALGO_SCRYPT)
+		return scrypt_buffer_size(opt_scrypt_n);
+	if (opt_algo == ALGO_PLUCK)
+		return (size_t) opt_pluck_n * 1024;
+	return 0;
+}
+
+/* cpu mask of a miner thread, 0 if not bound */
+uint64_t get_threadaffinity(int thr_id)
+{
+	if (num_cpus <= 1)
+		return 0;
+	if (opt_affinity == -1 && opt_n_threads > 1)
+		return 1ULL << (thr_id % num_cpus);
+	if (opt_affinity != -1L)
+		return (uint64_t) opt_affinity;
+	return 0;
+}
+
+void get_poolstate(struct pool_state *ps)
+{
+	struct stratum_ctx *sctx = pools[cur_pool].sctx;
+	uint32_t endiandata[20];
+	struct timeval now, diff;
+	int k;
+
+	memset(ps, 0, sizeof(*ps));
+	get_currentpool(ps->url, sizeof(ps->url));
+	ps->notify_age_ms = -1;
+	ps->stratum = have_stratum;
+	ps->diff = stratum_diff;
+	if (have_stratum) {
+		pthread_mutex_lock(&sctx->work_lock);
+		ps->connected = sctx->curl != NULL;
+		ps->connected_at = sctx->tm_connected;
+		ps->ping_ms = sctx->ping_ms;
+		ps->xnonce1_size = (int) sctx->xnonce1_size;
+		ps->xnonce2_size = (int) sctx->xnonce2_size;
+		ps->height = sctx->bloc_height;
+		if (sctx->job.job_id) {
+			snprintf(ps->job_id, sizeof(ps->job_id), "%s", sctx->job.job_id);
+			ps->clean = sctx->job.clean;
+			gettimeofday(&now, NULL);
+			timeval_subtract(&diff, &now, &sctx->job.tv_notify);
+			ps->notify_age_ms = diff.tv_sec * 1e3 + diff.tv_usec / 1e3;
+		}
+		pthread_mutex_unlock(&sctx->work_lock);
+	}
+
+	switch (opt_algo) {
+	case ALGO_X16R:
+	case ALGO_X16RV2:
+	case ALGO_X16S:
+	case ALGO_X20R:
+	case ALGO_GR:
+		break;
+	default:
+		return;
+	}
+	pthread_mutex_lock(&g_work_lock);
+	for (k = 0; k < 19; k++)
+		be32enc(&endiandata[k], g_work.data[k]);
+	pthread_mutex_unlock(&g_work_lock);
+	if (!endiandata[17])
+		return; // no work yet (ntime)
+	switch (opt_algo) {
+	case ALGO_X16R:   x16r_hash_order(endiandata, ps->order);   break;
+	case ALGO_X16RV2: x16rv2_hash_order(endiandata, ps->order); break;
+	case ALGO_X16S:   x16s_hash_order(endiandata, ps->order);   break;
+	case ALGO_X20R:   x20r_hash_order(endiandata, ps->order);   break;
+	case ALGO_GR:     gr_hash_order(endiandata, ps->order);     break;
+	default: break;
+	}
+}
+
 void proper_exit(int reason)
 {
+	if (opt_stage_profile)
+		prof_report();
+	events_close();
 #ifdef WIN32
 	if (opt_background) {
 		HWND hcon = GetConsoleWindow();
@@ -671,7 +856,9 @@ static bool gbt_work_decode(const json_t *val, struct work *work)
 	uchar *cbtx = NULL;
 	int tx_count, tx_size;
 	uchar txc_vi[9];
-	uchar(*merkle_tree)[32] = NULL;
+	uchar cbtx_hash[32], merkle_root[32];
+	const char **txs_hex = NULL;
+	char *txs_end;
 	bool coinbase_append = false;
 	bool submit_coinbase = false;
 	bool version_force = false;
@@ -749,6 +936,9 @@ static bool gbt_work_decode(const json_t *val, struct work *work)
 	}
 	tx_count = (int) json_array_size(txa);
 	tx_size = 0;
+	txs_hex = (const char**) malloc((tx_count + 1) * sizeof(char*));
+	if (!txs_hex)
+		goto out;
 	for (i = 0; i < tx_count; i++) {
 		const json_t *tx = json_array_get(txa, i);
 		const char *tx_hex = json_string_value(json_object_get(tx, "data"));
@@ -756,6 +946,7 @@ static bool gbt_work_decode(const json_t *val, struct work *work)
 			applog(LOG_ERR, "JSON invalid transactions");
 			goto out;
 		}
+		txs_hex[i] = tx_hex;
 		tx_size += (int) (strlen(tx_hex) / 2);
 	}
 
@@ -865,32 +1056,18 @@ static bool gbt_work_decode(const json_t *val, struct work *work)
 	bin2hex(work->txs, txc_vi, n);
 	bin2hex(work->txs + 2*n, cbtx, cbtx_size);
 
-	/* generate merkle root */
-	merkle_tree = (uchar(*)[32]) calloc(((1 + tx_count + 1) & ~1), 32);
-	sha256d(merkle_tree[0], cbtx, cbtx_size);
-	for (i = 0; i < tx_count; i++) {
-		tmp = json_array_get(txa, i);
-		const char *tx_hex = json_string_value(json_object_get(tmp, "data"));
-		const int tx_size = tx_hex ? (int) (strlen(tx_hex) / 2) : 0;
-		unsigned char *tx = (uchar*) malloc(tx_size);
-		if (!tx_hex || !hex2bin(tx, tx_hex, tx_size)) {
-			applog(LOG_ERR, "JSON invalid transactions");
-			free(tx);
-			goto out;
-		}
-		sha256d(merkle_tree[1 + i], tx, tx_size);
-		if (!submit_coinbase)
-			strcat(work->txs, tx_hex);
+	txs_end = work->txs + 2 * (n + cbtx_size);
+	for (i = 0; i < tx_count && !submit_coinbase; i++) {
+		size_t len = strlen(txs_hex[i]);
+		memcpy(txs_end, txs_hex[i], len + 1);
+		txs_end += len;
 	}
-	n = 1 + tx_count;
-	while (n > 1) {
-		if (n % 2) {
-			memcpy(merkle_tree[n], merkle_tree[n-1], 32);
-			++n;
-		}
-		n /= 2;
-		for (i = 0; i < n; i++)
-			sha256d(merkle_tree[i], merkle_tree[2*i], 64);
+
+	/* generate merkle root, only the changes since the last template are hashed */
+	sha256d(cbtx_hash, cbtx, cbtx_size);
+	if (!merkle_gbt_root(merkle_root, cbtx_hash, txs_hex, tx_count)) {
+		applog(LOG_ERR, "JSON invalid transactions");
+		goto out;
 	}
 
 	/* assemble block header */
@@ -898,7 +1075,7 @@ static bool gbt_work_decode(const json_t *val, struct work *work)
 	for (i = 0; i < 8; i++)
 		work->data[8 - i] = le32dec(prevhash + i);
 	for (i = 0; i < 8; i++)
-		work->data[9 + i] = be32dec((uint32_t *)merkle_tree[0] + i);
+		work->data[9 + i] = be32dec((uint32_t *)merkle_root + i);
 	work->data[17] = swab32(curtime);
 	work->data[18] = le32dec(&bits);
 	memset(work->data + 19, 0x00, 52);
@@ -938,7 +1115,7 @@ out:
 		}
 	}
 
-	free(merkle_tree);
+	free(txs_hex);
 	free(cbtx);
 	return rc;
 }
@@ -978,7 +1155,7 @@ void scale_hash_for_display ( double* hashrate, char* units )
         }
 }
 
-static int share_result(int result, struct work *work, const char *reason)
+static int share_result(int result, double sharediff, const char *reason, double latency)
 {
 	const char *flag;
 	char suppl[32] = { 0 };
@@ -994,15 +1171,13 @@ static int share_result(int result, struct work *work, const char *reason)
 	uint32_t total_submits;
 	float rate;
 	char rate_s[8] = {0};
-	double sharediff = work ? work->sharediff : stratum.sharediff;
-	int i;
 
-	hashrate = 0.;
+	hashrate = stats_get_speed(-1, STATS_EWMA);
 	pthread_mutex_lock(&stats_lock);
-	for (i = 0; i < opt_n_threads; i++)
-		hashrate += thr_hashrates[i];
 	result ? accepted_count++ : rejected_count++;
 	pthread_mutex_unlock(&stats_lock);
+	if (!result)
+		stats_remember_reject(reason);
 
 	global_hashrate = (uint64_t) hashrate;
 
@@ -1055,6 +1230,12 @@ static int share_result(int result, struct work *work, const char *reason)
 		break;
 	}
 
+	if (latency >= 0.) {
+		stats_remember_submit(latency);
+		if (opt_debug)
+			applog(LOG_DEBUG, "share answered in %.1f ms", latency);
+	}
+
 	if (reason) {
 		applog(LOG_WARNING, "reject reason: %s", reason);
 		if (0 && strncmp(reason, "low difficulty share", 20) == 0) {
@@ -1066,10 +1247,55 @@ static int share_result(int result, struct work *work, const char *reason)
 	return 1;
 }
 
+static int pending_share_add(double sharediff)
+{
+	struct pending_share *ps;
+	int id;
+
+	pthread_mutex_lock(&pending_lock);
+	id = pending_share_id++;
+	if (pending_share_id >= 0x7fffff00)
+		pending_share_id = 4;
+	ps = &pending_shares[id % MAX_PENDING_SHARES];
+	ps->id = id;
+	ps->sharediff = sharediff;
+	gettimeofday(&ps->sent, NULL);
+	pthread_mutex_unlock(&pending_lock);
+	return id;
+}
+
+/* returns the answer delay in ms, or -1 if the share is unknown */
+static double pending_share_del(int id, double *sharediff)
+{
+	struct pending_share *ps = &pending_shares[id % MAX_PENDING_SHARES];
+	struct timeval now, diff;
+	double latency = -1.;
+
+	gettimeofday(&now, NULL);
+	pthread_mutex_lock(&pending_lock);
+	if (id > 0 && ps->id == id) {
+		timeval_subtract(&diff, &now, &ps->sent);
+		latency = diff.tv_sec * 1e3 + diff.tv_usec / 1e3;
+		*sharediff = ps->sharediff;
+		ps->id = 0;
+	}
+	pthread_mutex_unlock(&pending_lock);
+	return latency;
+}
+
+static double elapsed_ms(const struct timeval *start)
+{
+	struct timeval now, diff;
+	gettimeofday(&now, NULL);
+	timeval_subtract(&diff, &now, (struct timeval *) start);
+	return diff.tv_sec * 1e3 + diff.tv_usec / 1e3;
+}
+
 static bool submit_upstream_work(CURL *curl, struct work *work)
 {
 	json_t *val, *res, *reason;
 	char s[JSON_BUF_LEN];
+	struct timeval tv_submit;
 	int i;
 	bool rc = false;
 
@@ -1077,6 +1303,7 @@ static bool submit_upstream_work(CURL *curl, struct work *work)
 	if (opt_algo != ALGO_SIA && !submit_old && memcmp(&work->data[1], &g_work.data[1], 32)) {
 		if (opt_debug)
 			applog(LOG_DEBUG, "DEBUG: stale work detected, discarding");
+		events_share(EV_DROP, -1, work, DROP_STALE);
 		return true;
 	}
 
@@ -1086,13 +1313,23 @@ static bool submit_upstream_work(CURL *curl, struct work *work)
 		if (work->height && work->height <= net_blocks) {
 			if (opt_debug)
 				applog(LOG_WARNING, "block %u was already solved", work->height);
+			events_share(EV_DROP, -1, work, DROP_STALE);
 			return true;
 		}
 	}
 
+	if (have_stratum && work->pool_id != cur_pool) {
+		if (opt_debug)
+			applog(LOG_DEBUG, "DEBUG: work from a previous pool, discarding");
+		events_share(EV_DROP, -1, work, DROP_POOL);
+		return true;
+	}
+
 	if (have_stratum) {
+		struct stratum_ctx *sctx = pools[work->pool_id].sctx;
 		uint32_t ntime, nonce;
-		char ntimestr[9], noncestr[9];
+		char ntimestr[9], noncestr[9], versionstr[13] = { 0 };
+		int id = pending_share_add(work->sharediff);
 
 		if (jsonrpc_2) {
 			uchar hash[32];
@@ -1100,8 +1337,8 @@ static bool submit_upstream_work(CURL *curl, struct work *work)
 			bin2hex(noncestr, (const unsigned char *)work->data + 39, 4);
 			char *hashhex = abin2hex(hash, 32);
 			snprintf(s, JSON_BUF_LEN,
-					"{\"method\": \"submit\", \"params\": {\"id\": \"%s\", \"job_id\": \"%s\", \"nonce\": \"%s\", \"result\": \"%s\"}, \"id\":4}\r\n",
-					rpc2_id, work->job_id, noncestr, hashhex);
+					"{\"method\": \"submit\", \"params\": {\"id\": \"%s\", \"job_id\": \"%s\", \"nonce\": \"%s\", \"result\": \"%s\"}, \"id\":%d}\r\n",
+					rpc2_id, work->job_id, noncestr, hashhex, id);
 			free(hashhex);
 		} else {
 			char *xnonce2str;
@@ -1136,26 +1373,30 @@ static bool submit_upstream_work(CURL *curl, struct work *work)
 			bin2hex(ntimestr, (const unsigned char *)(&ntime), 4);
 			bin2hex(noncestr, (const unsigned char *)(&nonce), 4);
 			if (opt_algo == ALGO_DECRED) {
-				xnonce2str = abin2hex((unsigned char*)(&work->data[36]), stratum.xnonce1_size);
+				xnonce2str = abin2hex((unsigned char*)(&work->data[36]), sctx->xnonce1_size);
 			} else if (opt_algo == ALGO_SIA) {
 				uint16_t high_nonce = swab32(work->data[9]) >> 16;
 				xnonce2str = abin2hex((unsigned char*)(&high_nonce), 2);
 			} else {
 				xnonce2str = abin2hex(work->xnonce2, work->xnonce2_len);
 			}
+			// bip310 rolled version bits
+			if (work->vr_mask)
+				sprintf(versionstr, ", \"%08x\"", swab32(work->data[0]) & work->vr_mask);
 			snprintf(s, JSON_BUF_LEN,
-					"{\"method\": \"mining.submit\", \"params\": [\"%s\", \"%s\", \"%s\", \"%s\", \"%s\"], \"id\":4}",
-					rpc_user, work->job_id, xnonce2str, ntimestr, noncestr);
+					"{\"method\": \"mining.submit\", \"params\": [\"%s\", \"%s\", \"%s\", \"%s\", \"%s\"%s], \"id\":%d}",
+					rpc_user, work->job_id, xnonce2str, ntimestr, noncestr, versionstr, id);
 			free(xnonce2str);
 		}
 
 		// store to keep/display solved blocs (work struct not linked on accept notification)
-		stratum.sharediff = work->sharediff;
+		sctx->sharediff = work->sharediff;
 
-		if (unlikely(!stratum_send_line(&stratum, s))) {
-			applog(LOG_ERR, "submit_upstream_work stratum_send_line failed");
+		if (unlikely(!stratum_queue_line(sctx, s))) {
+			applog(LOG_ERR, "submit_upstream_work stratum_queue_line failed");
 			goto out;
 		}
+		events_share(EV_SUBMIT, -1, work, id);
 
 	} else if (work->txs) { /* gbt */
 
@@ -1183,6 +1424,8 @@ static bool submit_upstream_work(CURL *curl, struct work *work)
 				data_str, work->txs);
 		}
 
+		gettimeofday(&tv_submit, NULL);
+		events_share(EV_SUBMIT, -1, work, 0);
 		val = json_rpc_call(curl, rpc_url, rpc_userpass, req, NULL, 0);
 		free(req);
 		if (unlikely(!val)) {
@@ -1203,10 +1446,13 @@ static bool submit_upstream_work(CURL *curl, struct work *work)
 				iter = json_object_iter_next(res, iter);
 			}
 			res_str = json_dumps(res, 0);
-			share_result(sumres, work, res_str);
+			share_result(sumres, work->sharediff, res_str, elapsed_ms(&tv_submit));
+			events_result(0, 0, sumres, res_str, elapsed_ms(&tv_submit));
 			free(res_str);
-		} else
-			share_result(json_is_null(res), work, json_string_value(res));
+		} else {
+			share_result(json_is_null(res), work->sharediff, json_string_value(res), elapsed_ms(&tv_submit));
+			events_result(0, 0, json_is_null(res), json_string_value(res), elapsed_ms(&tv_submit));
+		}
 
 		json_decref(val);
 
@@ -1232,6 +1478,8 @@ static bool submit_upstream_work(CURL *curl, struct work *work)
 			free(hashhex);
 
 			/* issue JSON-RPC request */
+			gettimeofday(&tv_submit, NULL);
+			events_share(EV_SUBMIT, -1, work, 0);
 			val = json_rpc2_call(curl, rpc_url, rpc_userpass, s, NULL, 0);
 			if (unlikely(!val)) {
 				applog(LOG_ERR, "submit_upstream_work json_rpc_call failed");
@@ -1240,12 +1488,14 @@ static bool submit_upstream_work(CURL *curl, struct work *work)
 			res = json_object_get(val, "result");
 			json_t *status = json_object_get(res, "status");
 			bool valid = !strcmp(status ? json_string_value(status) : "", "OK");
+			events_result(0, 0, valid, json_string_value(json_object_get(json_object_get(res, "error"), "message")),
+				elapsed_ms(&tv_submit));
 			if (valid)
-				share_result(valid, work, NULL);
+				share_result(valid, work->sharediff, NULL, elapsed_ms(&tv_submit));
 			else {
 				json_t *err = json_object_get(res, "error");
 				const char *sreason = json_string_value(json_object_get(err, "message"));
-				share_result(valid, work, sreason);
+				share_result(valid, work->sharediff, sreason, elapsed_ms(&tv_submit));
 				if (!strcasecmp("Invalid job id", sreason)) {
 					work_free(work);
 					work_copy(work, &g_work);
@@ -1288,6 +1538,8 @@ static bool submit_upstream_work(CURL *curl, struct work *work)
 		free(gw_str);
 
 		/* issue JSON-RPC request */
+		gettimeofday(&tv_submit, NULL);
+		events_share(EV_SUBMIT, -1, work, 0);
 		val = json_rpc_call(curl, rpc_url, rpc_userpass, s, NULL, 0);
 		if (unlikely(!val)) {
 			applog(LOG_ERR, "submit_upstream_work json_rpc_call failed");
@@ -1295,7 +1547,10 @@ static bool submit_upstream_work(CURL *curl, struct work *work)
 		}
 		res = json_object_get(val, "result");
 		reason = json_object_get(val, "reject-reason");
-		share_result(json_is_true(res), work, reason ? json_string_value(reason) : NULL);
+		share_result(json_is_true(res), work->sharediff, reason ? json_string_value(reason) : NULL,
+			elapsed_ms(&tv_submit));
+		events_result(0, 0, json_is_true(res), reason ? json_string_value(reason) : NULL,
+			elapsed_ms(&tv_submit));
 
 		json_decref(val);
 	}
@@ -1574,24 +1829,74 @@ static void *workio_thread(void *userdata)
 	return NULL;
 }
 
+static void *submit_thread(void *userdata)
+{
+	struct thr_info *mythr = (struct thr_info *) userdata;
+	CURL *curl;
+
+	curl = curl_easy_init();
+	if (unlikely(!curl)) {
+		applog(LOG_ERR, "CURL initialization failed");
+		return NULL;
+	}
+
+	while (1) {
+		struct workio_cmd *wc = (struct workio_cmd *) tq_pop(submit_q, NULL);
+		bool ok;
+		if (!wc)
+			break;
+		ok = workio_submit_work(wc, curl);
+		workio_cmd_free(wc);
+		if (!ok) {
+			// same as a workio failure, main() exits with it
+			tq_freeze(submit_q);
+			tq_freeze(thr_info[work_thr_id].q);
+			break;
+		}
+	}
+
+	tq_freeze(mythr->q);
+	curl_easy_cleanup(curl);
+
+	return NULL;
+}
+
+/* --bench-suite, with the parameters of a plain -a <algo> */
+void algo_select(int algo)
+{
+	opt_algo = (enum algos) algo;
+	if (opt_algo == ALGO_SCRYPT)
+		opt_scrypt_n = 1024;
+	else if (opt_algo == ALGO_SCRYPTJANE)
+		opt_scrypt_n = 5;
+	else if (opt_algo == ALGO_QUARK)
+		init_quarkhash_contexts();
+}
+
+/* synthetic header of --benchmark */
+void algo_bench_work(struct work *work)
+{
+	uint32_t ts = (uint32_t) time(NULL);
+	for (int n=0; n<74; n++) ((char*)work->data)[n] = n;
+	//memset(work->data, 0x55, 76);
+	work->data[17] = swab32(ts);
+	memset(work->data + 19, 0x00, 52);
+	if (opt_algo == ALGO_DECRED) {
+		memset(&work->data[35], 0x00, 52);
+	} else {
+		work->data[20] = 0x80000000;
+		work->data[31] = 0x00000280;
+	}
+	memset(work->target, 0x00, sizeof(work->target));
+}
+
 static bool get_work(struct thr_info *thr, struct work *work)
 {
 	struct workio_cmd *wc;
 	struct work *work_heap;
 
 	if (opt_benchmark) {
-		uint32_t ts = (uint32_t) time(NULL);
-		for (int n=0; n<74; n++) ((char*)work->data)[n] = n;
-		//memset(work->data, 0x55, 76);
-		work->data[17] = swab32(ts);
-		memset(work->data + 19, 0x00, 52);
-		if (opt_algo == ALGO_DECRED) {
-			memset(&work->data[35], 0x00, 52);
-		} else {
-			work->data[20] = 0x80000000;
-			work->data[31] = 0x00000280;
-		}
-		memset(work->target, 0x00, sizeof(work->target));
+		algo_bench_work(work);
 		return true;
 	}
 
@@ -1638,6 +1943,14 @@ static bool submit_work(struct thr_info *thr, const struct work *work_in)
 	wc->thr = thr;
 	work_copy(wc->u.work, work_in);
 
+	/* stratum only writes a line, http calls wait for the pool answer
+	 * and must not delay the next getwork */
+	if (!have_stratum && submit_q) {
+		if (!tq_push(submit_q, wc))
+			goto err_out;
+		return true;
+	}
+
 	/* send solution to workio thread */
 	if (!tq_push(thr_info[work_thr_id].q, wc))
 		goto err_out;
@@ -1649,6 +1962,67 @@ err_out:
 	return false;
 }
 
+/* algos hashing the standard 80 bytes header, version and ntime can be rolled */
+static bool header_can_roll(void)
+{
+	if (jsonrpc_2)
+		return false;
+	switch (opt_algo) {
+	case ALGO_DECRED:
+	case ALGO_DROP:
+	case ALGO_LBRY:
+	case ALGO_NEOSCRYPT:
+	case ALGO_PHI2:
+	case ALGO_SIA:
+	case ALGO_ZR5:
+		return false;
+	default:
+		return true;
+	}
+}
+
+/* version bits then seconds elapsed since the notify, false when all are used */
+static bool work_can_roll(const struct work *work, uint32_t rolls)
+{
+	int vbits = 0;
+	uint32_t m;
+	time_t now = time(NULL);
+
+	if (!have_stratum || !header_can_roll() || !work->tv_notify.tv_sec)
+		return false;
+	for (m = work->vr_mask; m; m &= m - 1)
+		vbits++;
+	if (vbits < 32 && (rolls >> vbits) > (uint32_t) (now - work->tv_notify.tv_sec))
+		return false;
+	return rolls != 0;
+}
+
+/* put the job version and ntime back, to compare the work with g_work */
+static void work_unroll(struct work *work)
+{
+	if (work->rolls) {
+		work->data[0] = work->roll_base[0];
+		work->data[17] = work->roll_base[1];
+	}
+}
+
+static void work_roll(struct work *work)
+{
+	uint32_t version = 0, m, bit, vbits = 0, r = work->rolls;
+
+	if (!work->rolls)
+		return;
+	// spread the low bits of the counter on the mask bits
+	for (m = work->vr_mask; m; m &= m - 1, vbits++) {
+		bit = m & (~m + 1);
+		if (r & 1)
+			version |= bit;
+		r >>= 1;
+	}
+	work->data[0] = swab32(swab32(work->roll_base[0]) ^ version);
+	work->data[17] = swab32(swab32(work->roll_base[1]) + (vbits < 32 ? work->rolls >> vbits : 0));
+}
+
 static void stratum_gen_work(struct stratum_ctx *sctx, struct work *work)
 {
 	uint32_t extraheader[32] = { 0 };
@@ -1664,6 +2038,10 @@ static void stratum_gen_work(struct stratum_ctx *sctx, struct work *work)
 	} else {
 		free(work->job_id);
 		work->job_id = strdup(sctx->job.job_id);
+		work->pool_id = sctx->pool_id;
+		work->tv_notify = sctx->job.tv_notify;
+		work->vr_mask = header_can_roll() ? sctx->vr_mask : 0;
+		work->rolls = 0;
 		work->xnonce2_len = sctx->xnonce2_size;
 		work->xnonce2 = (uchar*) realloc(work->xnonce2, sctx->xnonce2_size);
 		memcpy(work->xnonce2, sctx->job.xnonce2, sctx->xnonce2_size);
@@ -1691,7 +2069,8 @@ static void stratum_gen_work(struct stratum_ctx *sctx, struct work *work)
 				memcpy(extraheader, &sctx->job.coinbase[32], headersize);
 				break;
 			default:
-				sha256d(merkle_root, sctx->job.coinbase, (int) sctx->job.coinbase_size);
+				sha256d_prefix_final(merkle_root, &sctx->job.coinbase_prefix,
+					sctx->job.coinbase, (int) sctx->job.coinbase_size);
 		}
 
 		if (!headersize)
@@ -1871,7 +2250,10 @@ static bool wanna_mine(int thr_id)
 	bool state = true;
 
 	if (opt_max_temp > 0.0) {
-		float temp = cpu_temp(0);
+		struct sensors_snapshot sensors;
+		float temp;
+		sensors_read(&sensors);
+		temp = sensors.temp;
 		if (temp > opt_max_temp) {
 			if (!thr_id && !conditional_state[thr_id] && !opt_quiet)
 				applog(LOG_INFO, "temperature too high (%.0fC), waiting...", temp);
@@ -1896,6 +2278,316 @@ static bool wanna_mine(int thr_id)
 	return state;
 }
 
+static void sha256d_80(void *output, const void *input)
+{
+	sha256d((uchar*) output, (const uchar*) input, 80);
+}
+
+/* reference hash of the algos scanning a big endian 80 bytes header */
+share_hash_t share_hash_func(void)
+{
+	switch (opt_algo) {
+	case ALGO_ALLIUM:     return allium_hash;
+	case ALGO_AXIOM:      return axiomhash;
+	case ALGO_BASTION:    return bastionhash;
+	case ALGO_BITCORE:    return bitcore_hash;
+	case ALGO_BMW:        return bmwhash;
+	case ALGO_BMW512:     return bmw512_hash;
+	case ALGO_C11:        return c11hash;
+	case ALGO_GEEK:       return geekhash;
+	case ALGO_GROESTL:    return groestlhash;
+	case ALGO_JHA:        return jha_hash;
+	case ALGO_KECCAKC:    return keccakhash;
+	case ALGO_LUFFA:      return luffahash;
+	case ALGO_LYRA2:      return lyra2_hash;
+	case ALGO_LYRA2REV2:  return lyra2rev2_hash;
+	case ALGO_LYRA2V3:    return lyra2v3_hash;
+	case ALGO_MYR_GR:     return myriadhash;
+	case ALGO_NIST5:      return nist5hash;
+	case ALGO_PENTABLAKE: return pentablakehash;
+	case ALGO_PHI1612:    return phi1612_hash;
+	case ALGO_QUARK:      return quarkhash;
+	case ALGO_QUBIT:      return qubithash;
+	case ALGO_S3:         return s3hash;
+	case ALGO_SHA256D:    return sha256d_80;
+	case ALGO_SHAVITE3:   return inkhash;
+	case ALGO_SIB:        return sibhash;
+	case ALGO_SKEIN:      return skeinhash;
+	case ALGO_SKEIN2:     return skein2hash;
+	case ALGO_SONOA:      return sonoa_hash;
+	case ALGO_TIMETRAVEL: return timetravel_hash;
+	case ALGO_TRIBUS:     return tribus_hash;
+	case ALGO_VELTOR:     return veltor_hash;
+	case ALGO_X11EVO:     return x11evo_hash;
+	case ALGO_X11:        return x11hash;
+	case ALGO_X12:        return x12hash;
+	case ALGO_X13:        return x13hash;
+	case ALGO_X14:        return x14hash;
+	case ALGO_X15:        return x15hash;
+	case ALGO_X16R:       return x16r_hash;
+	case ALGO_X16RV2:     return x16rv2_hash;
+	case ALGO_X16S:       return x16s_hash;
+	case ALGO_X17:        return x17hash;
+	case ALGO_X20R:       return x20r_hash;
+	case ALGO_0X10:       return hash0x10;
+	case ALGO_XEVAN:      return xevan_hash;
+	default:              return NULL;
+	}
+}
+
+/* local checks of a found share, false if it must not be submitted */
+static bool share_check(int thr_id, struct work *work)
+{
+	share_hash_t hash = opt_share_check ? share_hash_func() : NULL;
+
+	if (hash) {
+		uint32_t _ALIGN(64) endiandata[20], vhash[16];
+		int k;
+		for (k = 0; k < 20; k++)
+			be32enc(&endiandata[k], work->data[k]);
+		hash(vhash, endiandata);
+		if (!fulltest(vhash, work->target)) {
+			share_invalid();
+			events_share(EV_DROP, thr_id, work, DROP_INVALID);
+			applog(LOG_WARNING, "CPU #%d: share above target, not submitted", thr_id);
+			return false;
+		}
+	}
+	if (share_seen(work)) {
+		events_share(EV_DROP, thr_id, work, DROP_DUPLICATE);
+		if (opt_debug)
+			applog(LOG_DEBUG, "CPU #%d: duplicate share, not submitted", thr_id);
+		return false;
+	}
+	return true;
+}
+
+/* per thread buffer of the scrypt and pluck scans, NULL for the others */
+bool algo_scratch_alloc(unsigned char **scratchbuf)
+{
+	*scratchbuf = NULL;
+	if (opt_algo == ALGO_SCRYPT) {
+		*scratchbuf = scrypt_buffer_alloc(opt_scrypt_n);
+		if (!*scratchbuf) {
+			applog(LOG_ERR, "scrypt buffer allocation failed");
+			return false;
+		}
+	} else if (opt_algo == ALGO_PLUCK) {
+		*scratchbuf = (unsigned char*) malloc(opt_pluck_n * 1024);
+		if (!*scratchbuf) {
+			applog(LOG_ERR, "pluck buffer allocation failed");
+			return false;
+		}
+	}
+	return true;
+}
+
+/* one scan of the current algo, -1 if it has no scanhash */
+int algo_scanhash(int thr_id, struct work *work, uint32_t max_nonce, uint64_t *hashes_done,
+	unsigned char *scratchbuf)
+{
+	switch (opt_algo) {
+
+	case ALGO_ALLIUM:
+		return scanhash_allium(thr_id, work, max_nonce, hashes_done);
+	case ALGO_ANIME:
+		return scanhash_anime(thr_id, work, max_nonce, hashes_done);
+	case ALGO_AXIOM:
+		return scanhash_axiom(thr_id, work, max_nonce, hashes_done);
+	case ALGO_BASTION:
+		return scanhash_bastion(thr_id, work, max_nonce, hashes_done);
+	case ALGO_BLAKE:
+		return scanhash_blake(thr_id, work, max_nonce, hashes_done);
+	case ALGO_BLAKECOIN:
+		return scanhash_blakecoin(thr_id, work, max_nonce, hashes_done);
+	case ALGO_BLAKE2B:
+		return scanhash_blake2b(thr_id, work, max_nonce, hashes_done);
+	case ALGO_BLAKE2S:
+		return scanhash_blake2s(thr_id, work, max_nonce, hashes_done);
+	case ALGO_BMW:
+		return scanhash_bmw(thr_id, work, max_nonce, hashes_done);
+	case ALGO_BMW512:
+		return scanhash_bmw512(thr_id, work, max_nonce, hashes_done);
+	case ALGO_C11:
+		return scanhash_c11(thr_id, work, max_nonce, hashes_done);
+	case ALGO_CPUPOWER:
+		return scanhash_cpupower(thr_id, work, max_nonce, hashes_done);
+	case ALGO_CURVE:
+		return scanhash_curvehash(thr_id, work, max_nonce, hashes_done);
+	case ALGO_DECRED:
+		return scanhash_decred(thr_id, work, max_nonce, hashes_done);
+	case ALGO_DEDAL:
+		return scanhash_dedal(thr_id, work, max_nonce, hashes_done);
+	case ALGO_DROP:
+		return scanhash_drop(thr_id, work, max_nonce, hashes_done);
+	case ALGO_FRESH:
+		return scanhash_fresh(thr_id, work, max_nonce, hashes_done);
+	case ALGO_GEEK:
+		return scanhash_geek(thr_id, work, max_nonce, hashes_done);
+	case ALGO_GR:
+		return scanhash_gr(thr_id, work, max_nonce, hashes_done);
+	case ALGO_DMD_GR:
+	case ALGO_GROESTL:
+		return scanhash_groestl(thr_id, work, max_nonce, hashes_done);
+	case ALGO_KECCAK:
+	case ALGO_KECCAKC:
+		return scanhash_keccak(thr_id, work, max_nonce, hashes_done);
+	case ALGO_HEAVY:
+		return scanhash_heavy(thr_id, work, max_nonce, hashes_done);
+	case ALGO_JHA:
+		return scanhash_jha(thr_id, work, max_nonce, hashes_done);
+	case ALGO_LBRY:
+		return scanhash_lbry(thr_id, work, max_nonce, hashes_done);
+	case ALGO_LUFFA:
+		return scanhash_luffa(thr_id, work, max_nonce, hashes_done);
+	case ALGO_LYRA2:
+		return scanhash_lyra2(thr_id, work, max_nonce, hashes_done);
+	case ALGO_LYRA2REV2:
+		return scanhash_lyra2rev2(thr_id, work, max_nonce, hashes_done);
+	case ALGO_LYRA2V3:
+		return scanhash_lyra2v3(thr_id, work, max_nonce, hashes_done);
+	case ALGO_MEGABTX:
+		return scanhash_megabtx(thr_id, work, max_nonce, hashes_done);
+	case ALGO_MEME:
+		return scanhash_meme(thr_id, work, max_nonce, hashes_done);
+	case ALGO_MIKE:
+		return scanhash_mike(thr_id, work, max_nonce, hashes_done);
+	case ALGO_MINOTAUR:
+		return scanhash_minotaur(thr_id, work, max_nonce, hashes_done, false);
+	case ALGO_MINOTAURX:
+		return scanhash_minotaur(thr_id, work, max_nonce, hashes_done, true);
+	case ALGO_MYR_GR:
+		return scanhash_myriad(thr_id, work, max_nonce, hashes_done);
+	case ALGO_NEOSCRYPT:
+		return scanhash_neoscrypt(thr_id, work, max_nonce, hashes_done,
+			0x80000020 | (opt_nfactor << 8));
+	case ALGO_NIST5:
+		return scanhash_nist5(thr_id, work, max_nonce, hashes_done);
+	case ALGO_PENTABLAKE:
+		return scanhash_pentablake(thr_id, work, max_nonce, hashes_done);
+	case ALGO_PHI1612:
+		return scanhash_phi1612(thr_id, work, max_nonce, hashes_done);
+	case ALGO_PHI2:
+		return scanhash_phi2(thr_id, work, max_nonce, hashes_done);
+	case ALGO_PLUCK:
+		return scanhash_pluck(thr_id,  work, max_nonce, hashes_done, scratchbuf, opt_pluck_n);
+	case ALGO_POWER2B:
+		return scanhash_power2b(thr_id, work, max_nonce, hashes_done);
+	case ALGO_QUARK:
+		return scanhash_quark(thr_id, work, max_nonce, hashes_done);
+	case ALGO_QUBIT:
+		return scanhash_qubit(thr_id, work, max_nonce, hashes_done);
+	case ALGO_RAINFOREST:
+		return scanhash_rf256(thr_id, work, max_nonce, hashes_done);
+	case ALGO_SCRYPT:
+		return scanhash_scrypt(thr_id, work, max_nonce, hashes_done, scratchbuf, opt_scrypt_n);
+	case ALGO_SCRYPTJANE:
+		return scanhash_scryptjane(opt_scrypt_n, thr_id, work, max_nonce, hashes_done);
+	case ALGO_SHAVITE3:
+		return scanhash_ink(thr_id, work, max_nonce, hashes_done);
+	case ALGO_SHA256D:
+		return scanhash_sha256d(thr_id, work, max_nonce, hashes_done);
+	case ALGO_SIA:
+		return scanhash_sia(thr_id, work, max_nonce, hashes_done);
+	case ALGO_SIB:
+		return scanhash_sib(thr_id, work, max_nonce, hashes_done);
+	case ALGO_SKEIN:
+		return scanhash_skein(thr_id, work, max_nonce, hashes_done);
+	case ALGO_SKEIN2:
+		return scanhash_skein2(thr_id, work, max_nonce, hashes_done);
+	case ALGO_SKUNK:
+		return scanhash_skunk(thr_id, work, max_nonce, hashes_done);
+	case ALGO_SONOA:
+		return scanhash_sonoa(thr_id, work, max_nonce, hashes_done);
+	case ALGO_SKYDOGE:
+		return scanhash_skydoge(thr_id, work, max_nonce, hashes_done);
+	case ALGO_S3:
+		return scanhash_s3(thr_id, work, max_nonce, hashes_done);
+	case ALGO_TIMETRAVEL:
+		return scanhash_timetravel(thr_id, work, max_nonce, hashes_done);
+	case ALGO_BITCORE:
+		return scanhash_bitcore(thr_id, work, max_nonce, hashes_done);
+	case ALGO_TRIBUS:
+		return scanhash_tribus(thr_id, work, max_nonce, hashes_done);
+	case ALGO_VANILLA:
+		return scanhash_blakecoin(thr_id, work, max_nonce, hashes_done);
+	case ALGO_VELTOR:
+		return scanhash_veltor(thr_id, work, max_nonce, hashes_done);
+	case ALGO_X11EVO:
+		return scanhash_x11evo(thr_id, work, max_nonce, hashes_done);
+	case ALGO_X11:
+		return scanhash_x11(thr_id, work, max_nonce, hashes_done);
+	case ALGO_X12:
+		return scanhash_x12(thr_id, work, max_nonce, hashes_done);
+	case ALGO_X13:
+		return scanhash_x13(thr_id, work, max_nonce, hashes_done);
+	case ALGO_X14:
+		return scanhash_x14(thr_id, work, max_nonce, hashes_done);
+	case ALGO_X15:
+		return scanhash_x15(thr_id, work, max_nonce, hashes_done);
+	case ALGO_X16R:
+		return scanhash_x16r(thr_id, work, max_nonce, hashes_done);
+	case ALGO_X16RV2:
+		return scanhash_x16rv2(thr_id, work, max_nonce, hashes_done);
+	case ALGO_X20R:
+		return scanhash_x20r(thr_id, work, max_nonce, hashes_done);
+	case ALGO_X16S:
+		return scanhash_x16s(thr_id, work, max_nonce, hashes_done);
+	case ALGO_X17:
+		return scanhash_x17(thr_id, work, max_nonce, hashes_done);
+	case ALGO_0X10:
+		return scanhash_0x10(thr_id, work, max_nonce, hashes_done);
+	case ALGO_XELISV2:
+		return scanhash_xelisv2(thr_id, work, max_nonce, hashes_done);
+	case ALGO_XEVAN:
+		return scanhash_xevan(thr_id, work, max_nonce, hashes_done);
+	case ALGO_YESCRYPT:
+		return scanhash_yescrypt(thr_id, work, max_nonce, hashes_done);
+	case ALGO_YESCRYPTR8:
+		return scanhash_yescryptr8(thr_id, work, max_nonce, hashes_done);
+	case ALGO_YESCRYPTR16:
+		return scanhash_yescryptr16(thr_id, work, max_nonce, hashes_done);
+	case ALGO_YESCRYPTR32:
+		return scanhash_yescryptr32(thr_id, work, max_nonce, hashes_done);
+	case ALGO_YESPOWER:
+		return scanhash_yespower(thr_id, work, max_nonce, hashes_done);
+	case ALGO_YESPOWERR16:
+		return scanhash_yespowerR16(thr_id, work, max_nonce, hashes_done);
+	case ALGO_YESPOWERLITB:
+		return scanhash_yespowerLITB(thr_id, work, max_nonce, hashes_done);
+	case ALGO_YESPOWERLNC:
+		return scanhash_yespowerLNC(thr_id, work, max_nonce, hashes_done);
+	case ALGO_YESPOWER_MGPC:
+		return scanhash_yespowerMGPC(thr_id, work, max_nonce, hashes_done);
+	case ALGO_YESPOWERIC:
+		return scanhash_yespowerIC(thr_id, work, max_nonce, hashes_done);
+	case ALGO_YESPOWERIOTS:
+		return scanhash_yespowerIOTS(thr_id, work, max_nonce, hashes_done);
+	case ALGO_YESPOWERITC:
+		return scanhash_yespowerITC(thr_id, work, max_nonce, hashes_done);
+	case ALGO_YESPOWERSUGAR:
+		return scanhash_yespowerSUGAR(thr_id, work, max_nonce, hashes_done);
+	case ALGO_YESPOWERTIDE:
+		return scanhash_yespowerTIDE(thr_id, work, max_nonce, hashes_done);
+	case ALGO_YESPOWERURX:
+		return scanhash_yespowerURX(thr_id, work, max_nonce, hashes_done);
+	case ALGO_ZR5:
+		return scanhash_zr5(thr_id, work, max_nonce, hashes_done);
+	default:
+		/* should never happen */
+		return -1;
+	}
+}
+
+/* the benchmark total waits for a hashrate of every thread */
+static bool all_threads_reported(void)
+{
+	for (int i = 0; i < opt_n_threads; i++)
+		if (!thr_hashrates[i])
+			return false;
+	return true;
+}
+
 static void *miner_thread(void *userdata)
 {
 	struct thr_info *mythr = (struct thr_info *) userdata;
@@ -1905,10 +2597,11 @@ static void *miner_thread(void *userdata)
 	uint32_t end_nonce = 0xffffffffU / opt_n_threads * (thr_id + 1) - 0x20;
 	time_t tm_rate_log = 0;
 	time_t firstwork_time = 0;
+	struct timeval last_notify = { 0 };
 	unsigned char *scratchbuf = NULL;
 	char s[16];
-	int i;
 
+	log_rate_limit();
 	memset(&work, 0, sizeof(work));
 
 	/* Set worker threads to nice 19 and then preferentially to SCHED_IDLE
@@ -1963,22 +2656,11 @@ static void *miner_thread(void *userdata)
 		}
 	}
 
-	if (opt_algo == ALGO_SCRYPT) {
-		scratchbuf = scrypt_buffer_alloc(opt_scrypt_n);
-		if (!scratchbuf) {
-			applog(LOG_ERR, "scrypt buffer allocation failed");
-			pthread_mutex_lock(&applog_lock);
-			exit(1);
-		}
-	}
+	prof_thread_init(thr_id);
 
-	else if (opt_algo == ALGO_PLUCK) {
-		scratchbuf = malloc(opt_pluck_n * 1024);
-		if (!scratchbuf) {
-			applog(LOG_ERR, "pluck buffer allocation failed");
-			pthread_mutex_lock(&applog_lock);
-			exit(1);
-		}
+	if (!algo_scratch_alloc(&scratchbuf)) {
+		pthread_mutex_lock(&applog_lock);
+		exit(1);
 	}
 
 	while (1) {
@@ -1986,6 +2668,7 @@ static void *miner_thread(void *userdata)
 		struct timeval tv_start, tv_end, diff;
 		int64_t max64;
 		bool regen_work = false;
+		bool roll_work = false;
 		int wkcmp_offset = 0;
 		int nonce_oft = 19*sizeof(uint32_t); // 76
 		int wkcmp_sz = nonce_oft;
@@ -2017,19 +2700,23 @@ static void *miner_thread(void *userdata)
 			while (!jsonrpc_2 && time(NULL) >= g_work_time + 120)
 				sleep(1);
 
-			while (!stratum.job.diff && opt_algo == ALGO_NEOSCRYPT) {
+			while (!pools[cur_pool].sctx->job.diff && opt_algo == ALGO_NEOSCRYPT) {
 				applog(LOG_DEBUG, "Waiting for Stratum to set the job difficulty");
 				sleep(1);
 			}
 
+			// a used nonce range is first extended by the header rolling
+			work_unroll(&work);
+			roll_work = (*nonceptr) >= end_nonce && work_can_roll(&work, work.rolls + 1);
+
 			pthread_mutex_lock(&g_work_lock);
 
 			// to clean: is g_work loaded before the memcmp ?
-			regen_work = regen_work || ( (*nonceptr) >= end_nonce
+			regen_work = regen_work || ( (*nonceptr) >= end_nonce && !roll_work
 				&& !( memcmp(&work.data[wkcmp_offset], &g_work.data[wkcmp_offset], wkcmp_sz) ||
 				 jsonrpc_2 ? memcmp(((uint8_t*) work.data) + 43, ((uint8_t*) g_work.data) + 43, 33) : 0));
 			if (regen_work) {
-				stratum_gen_work(&stratum, &g_work);
+				stratum_gen_work(pools[cur_pool].sctx, &g_work);
 			}
 
 		} else {
@@ -2053,6 +2740,8 @@ static void *miner_thread(void *userdata)
 				continue;
 			}
 		}
+		// cleared before the copy, a job change after it still stops the scan
+		work_restart[thr_id].restart = 0;
 		if (memcmp(&work.data[wkcmp_offset], &g_work.data[wkcmp_offset], wkcmp_sz) ||
 			jsonrpc_2 ? memcmp(((uint8_t*) work.data) + 43, ((uint8_t*) g_work.data) + 43, 33) : 0)
 		{
@@ -2062,19 +2751,26 @@ static void *miner_thread(void *userdata)
 			*nonceptr = 0xffffffffU / opt_n_threads * thr_id;
 			if (opt_randomize)
 				nonceptr[0] += ((rand()*4) & UINT32_MAX) / opt_n_threads;
+		} else if (roll_work) {
+			if (!work.rolls) {
+				work.roll_base[0] = work.data[0];
+				work.roll_base[1] = work.data[17];
+			}
+			work.rolls++;
+			*nonceptr = 0xffffffffU / opt_n_threads * thr_id;
 		} else
 			++(*nonceptr);
 		pthread_mutex_unlock(&g_work_lock);
-		work_restart[thr_id].restart = 0;
+		work_roll(&work);
 
 		if (opt_algo == ALGO_DECRED) {
-			if (have_stratum && strcmp(stratum.job.job_id, work.job_id))
+			if (have_stratum && strcmp(pools[cur_pool].sctx->job.job_id, work.job_id))
 				continue; // need to regen g_work..
 			// extradata: prevent duplicates
 			nonceptr[1] += 1;
 			nonceptr[2] |= thr_id;
 		} else if (opt_algo == ALGO_SIA) {
-			if (have_stratum && strcmp(stratum.job.job_id, work.job_id))
+			if (have_stratum && strcmp(pools[cur_pool].sctx->job.job_id, work.job_id))
 				continue; // need to regen g_work..
 			// extradata: prevent duplicates
 			nonceptr[1] += 0x10;
@@ -2096,6 +2792,12 @@ static void *miner_thread(void *userdata)
 			continue;
 		}
 
+		/* parked by the thermal/power governor */
+		if (governor_parked(thr_id)) {
+			usleep(250 * 1000);
+			continue;
+		}
+
 		/* adjust max_nonce to meet target scan time */
 		if (have_stratum)
 			max64 = LP_SCANTIME;
@@ -2114,6 +2816,8 @@ static void *miner_thread(void *userdata)
 				}
 				if (opt_benchmark) {
 					char rate[32];
+					// average of the whole run
+					global_hashrate = (uint64_t) stats_get_speed(-1, opt_time_limit);
 					format_hashrate((double)global_hashrate, rate);
 					applog(LOG_NOTICE, "Benchmark: %s", rate);
 					fprintf(stderr, "%llu\n", (long long unsigned int) global_hashrate);
@@ -2128,6 +2832,15 @@ static void *miner_thread(void *userdata)
 
 		max64 *= (int64_t) thr_hashrates[thr_id];
 
+		/* bound the slice when the pool pushes jobs, a safety net for the
+		 * restart flag which the scan loops poll every hash or simd batch */
+		if (opt_switch_latency && (have_stratum || have_longpoll) && !opt_benchmark
+				&& thr_hashrates[thr_id] > 0.) {
+			int64_t lat64 = (int64_t) (thr_hashrates[thr_id] * opt_switch_latency / 1000.);
+			if (lat64 < 1) lat64 = 1;
+			if (max64 <= 0 || lat64 < max64) max64 = lat64;
+		}
+
 		if (max64 <= 0) {
 			switch (opt_algo) {
 			case ALGO_SCRYPT:
@@ -2244,6 +2957,7 @@ static void *miner_thread(void *userdata)
 			max_nonce = end_nonce;
 		else
 			max_nonce = (*nonceptr) + (uint32_t) max64;
+		stats_remember_window(thr_id, max_nonce - *nonceptr);
 
 		hashes_done = 0;
 		gettimeofday((struct timeval *) &tv_start, NULL);
@@ -2251,289 +2965,17 @@ static void *miner_thread(void *userdata)
 		if (firstwork_time == 0)
 			firstwork_time = time(NULL);
 
-		/* scan nonces for a proof-of-work hash */
-		switch (opt_algo) {
+		// first scan on a new stratum job
+		if (have_stratum && timercmp(&work.tv_notify, &last_notify, >)) {
+			last_notify = work.tv_notify;
+			stats_remember_job(&work.tv_notify);
+			events_switch(thr_id, &work, elapsed_ms(&work.tv_notify));
+		}
 
-		case ALGO_ALLIUM:
-			rc = scanhash_allium(thr_id, &work, max_nonce, &hashes_done);
-			break;
-		case ALGO_ANIME:
-			rc = scanhash_anime(thr_id, &work, max_nonce, &hashes_done);
-			break;
-		case ALGO_AXIOM:
-			rc = scanhash_axiom(thr_id, &work, max_nonce, &hashes_done);
-			break;
-		case ALGO_BASTION:
-			rc = scanhash_bastion(thr_id, &work, max_nonce, &hashes_done);
-			break;
-		case ALGO_BLAKE:
-			rc = scanhash_blake(thr_id, &work, max_nonce, &hashes_done);
-			break;
-		case ALGO_BLAKECOIN:
-			rc = scanhash_blakecoin(thr_id, &work, max_nonce, &hashes_done);
-			break;
-		case ALGO_BLAKE2B:
-			rc = scanhash_blake2b(thr_id, &work, max_nonce, &hashes_done);
-			break;
-		case ALGO_BLAKE2S:
-			rc = scanhash_blake2s(thr_id, &work, max_nonce, &hashes_done);
-			break;
-		case ALGO_BMW:
-			rc = scanhash_bmw(thr_id, &work, max_nonce, &hashes_done);
-			break;
-		case ALGO_BMW512:
-			rc = scanhash_bmw512(thr_id, &work, max_nonce, &hashes_done);
-                        break;
-		case ALGO_C11:
-			rc = scanhash_c11(thr_id, &work, max_nonce, &hashes_done);
-			break;
-		case ALGO_CPUPOWER:
-			rc = scanhash_cpupower(thr_id, &work, max_nonce, &hashes_done);
-			break;
-		case ALGO_CURVE:
-			rc = scanhash_curvehash(thr_id, &work, max_nonce, &hashes_done);
-                        break;
-		case ALGO_DECRED:
-			rc = scanhash_decred(thr_id, &work, max_nonce, &hashes_done);
-			break;
-		case ALGO_DEDAL:
-			rc = scanhash_dedal(thr_id, &work, max_nonce, &hashes_done);
-			break;
-		case ALGO_DROP:
-			rc = scanhash_drop(thr_id, &work, max_nonce, &hashes_done);
-			break;
-		case ALGO_FRESH:
-			rc = scanhash_fresh(thr_id, &work, max_nonce, &hashes_done);
-			break;
-		case ALGO_GEEK:
-			rc = scanhash_geek(thr_id, &work, max_nonce, &hashes_done);
-			break;
-		case ALGO_GR:
-			rc = scanhash_gr(thr_id, &work, max_nonce, &hashes_done);
-			break;
-		case ALGO_DMD_GR:
-		case ALGO_GROESTL:
-			rc = scanhash_groestl(thr_id, &work, max_nonce, &hashes_done);
-			break;
-		case ALGO_KECCAK:
-		case ALGO_KECCAKC:
-			rc = scanhash_keccak(thr_id, &work, max_nonce, &hashes_done);
-			break;
-		case ALGO_HEAVY:
-			rc = scanhash_heavy(thr_id, &work, max_nonce, &hashes_done);
-			break;
-		case ALGO_JHA:
-			rc = scanhash_jha(thr_id, &work, max_nonce, &hashes_done);
-			break;
-		case ALGO_LBRY:
-			rc = scanhash_lbry(thr_id, &work, max_nonce, &hashes_done);
-			break;
-		case ALGO_LUFFA:
-			rc = scanhash_luffa(thr_id, &work, max_nonce, &hashes_done);
-			break;
-		case ALGO_LYRA2:
-			rc = scanhash_lyra2(thr_id, &work, max_nonce, &hashes_done);
-			break;
-		case ALGO_LYRA2REV2:
-			rc = scanhash_lyra2rev2(thr_id, &work, max_nonce, &hashes_done);
-			break;
-		case ALGO_LYRA2V3:
-			rc = scanhash_lyra2v3(thr_id, &work, max_nonce, &hashes_done);
-			break;
-		case ALGO_MEGABTX:
-			rc = scanhash_megabtx(thr_id, &work, max_nonce, &hashes_done);
-			break;
-		case ALGO_MEME:
-			rc = scanhash_meme(thr_id, &work, max_nonce, &hashes_done);
-			break;
-		case ALGO_MIKE:
-			rc = scanhash_mike(thr_id, &work, max_nonce, &hashes_done);
-			break;
-		case ALGO_MINOTAUR:
-			rc = scanhash_minotaur(thr_id, &work, max_nonce, &hashes_done, false);
-			break;
-		case ALGO_MINOTAURX:
-			rc = scanhash_minotaur(thr_id, &work, max_nonce, &hashes_done, true);
-			break;
-		case ALGO_MYR_GR:
-			rc = scanhash_myriad(thr_id, &work, max_nonce, &hashes_done);
-			break;
-		case ALGO_NEOSCRYPT:
-			rc = scanhash_neoscrypt(thr_id, &work, max_nonce, &hashes_done,
-				0x80000020 | (opt_nfactor << 8));
-			break;
-		case ALGO_NIST5:
-			rc = scanhash_nist5(thr_id, &work, max_nonce, &hashes_done);
-			break;
-		case ALGO_PENTABLAKE:
-			rc = scanhash_pentablake(thr_id, &work, max_nonce, &hashes_done);
-			break;
-		case ALGO_PHI1612:
-			rc = scanhash_phi1612(thr_id, &work, max_nonce, &hashes_done);
-			break;
-		case ALGO_PHI2:
-			rc = scanhash_phi2(thr_id, &work, max_nonce, &hashes_done);
-			break;
-		case ALGO_PLUCK:
-			rc = scanhash_pluck(thr_id,  &work, max_nonce, &hashes_done, scratchbuf, opt_pluck_n);
-			break;
-		case ALGO_POWER2B:
-			rc = scanhash_power2b(thr_id, &work, max_nonce, &hashes_done);
-			break;
-		case ALGO_QUARK:
-			rc = scanhash_quark(thr_id, &work, max_nonce, &hashes_done);
-			break;
-		case ALGO_QUBIT:
-			rc = scanhash_qubit(thr_id, &work, max_nonce, &hashes_done);
-			break;
-		case ALGO_RAINFOREST:
-			rc = scanhash_rf256(thr_id, &work, max_nonce, &hashes_done);
-			break;
-		case ALGO_SCRYPT:
-			rc = scanhash_scrypt(thr_id, &work, max_nonce, &hashes_done, scratchbuf, opt_scrypt_n);
-			break;
-		case ALGO_SCRYPTJANE:
-			rc = scanhash_scryptjane(opt_scrypt_n, thr_id, &work, max_nonce, &hashes_done);
-			break;
-		case ALGO_SHAVITE3:
-			rc = scanhash_ink(thr_id, &work, max_nonce, &hashes_done);
-			break;
-		case ALGO_SHA256D:
-			rc = scanhash_sha256d(thr_id, &work, max_nonce,	&hashes_done);
-			break;
-		case ALGO_SIA:
-			rc = scanhash_sia(thr_id, &work, max_nonce, &hashes_done);
-			break;
-		case ALGO_SIB:
-			rc = scanhash_sib(thr_id, &work, max_nonce, &hashes_done);
-			break;
-		case ALGO_SKEIN:
-			rc = scanhash_skein(thr_id, &work, max_nonce, &hashes_done);
-			break;
-		case ALGO_SKEIN2:
-			rc = scanhash_skein2(thr_id, &work, max_nonce, &hashes_done);
-			break;
-		case ALGO_SKUNK:
-			rc = scanhash_skunk(thr_id, &work, max_nonce, &hashes_done);
-			break;
-		case ALGO_SONOA:
-			rc = scanhash_sonoa(thr_id, &work, max_nonce, &hashes_done);
-			break;
-		case ALGO_SKYDOGE:
-			rc = scanhash_skydoge(thr_id, &work, max_nonce, &hashes_done);
-			break;
-		case ALGO_S3:
-			rc = scanhash_s3(thr_id, &work, max_nonce, &hashes_done);
-			break;
-		case ALGO_TIMETRAVEL:
-			rc = scanhash_timetravel(thr_id, &work, max_nonce, &hashes_done);
-			break;
-		case ALGO_BITCORE:
-			rc = scanhash_bitcore(thr_id, &work, max_nonce, &hashes_done);
-			break;
-		case ALGO_TRIBUS:
-			rc = scanhash_tribus(thr_id, &work, max_nonce, &hashes_done);
-			break;
-		case ALGO_VANILLA:
-			rc = scanhash_blakecoin(thr_id, &work, max_nonce, &hashes_done);
-			break;
-		case ALGO_VELTOR:
-			rc = scanhash_veltor(thr_id, &work, max_nonce, &hashes_done);
-			break;
-		case ALGO_X11EVO:
-			rc = scanhash_x11evo(thr_id, &work, max_nonce, &hashes_done);
-			break;
-		case ALGO_X11:
-			rc = scanhash_x11(thr_id, &work, max_nonce, &hashes_done);
-			break;
-		case ALGO_X12:
-			rc = scanhash_x12(thr_id, &work, max_nonce, &hashes_done);
-			break;
-		case ALGO_X13:
-			rc = scanhash_x13(thr_id, &work, max_nonce, &hashes_done);
-			break;
-		case ALGO_X14:
-			rc = scanhash_x14(thr_id, &work, max_nonce, &hashes_done);
-			break;
-		case ALGO_X15:
-			rc = scanhash_x15(thr_id, &work, max_nonce, &hashes_done);
-			break;
-		case ALGO_X16R:
-			rc = scanhash_x16r(thr_id, &work, max_nonce, &hashes_done);
-			break;
-		case ALGO_X16RV2:
-			rc = scanhash_x16rv2(thr_id, &work, max_nonce, &hashes_done);
-			break;
-		case ALGO_X20R:
-			rc = scanhash_x20r(thr_id, &work, max_nonce, &hashes_done);
-			break;
-		case ALGO_X16S:
-			rc = scanhash_x16s(thr_id, &work, max_nonce, &hashes_done);
-			break;
-		case ALGO_X17:
-			rc = scanhash_x17(thr_id, &work, max_nonce, &hashes_done);
-			break;
-		case ALGO_0X10:
-			rc = scanhash_0x10(thr_id, &work, max_nonce, &hashes_done);
-			break;
-		case ALGO_XELISV2:
-			rc = scanhash_xelisv2(thr_id, &work, max_nonce, &hashes_done);
-			break;
-		case ALGO_XEVAN:
-			rc = scanhash_xevan(thr_id, &work, max_nonce, &hashes_done);
-			break;
-		case ALGO_YESCRYPT:
-			rc = scanhash_yescrypt(thr_id, &work, max_nonce, &hashes_done);
-			break;
-		case ALGO_YESCRYPTR8:
-			rc = scanhash_yescryptr8(thr_id, &work, max_nonce, &hashes_done);
-			break;
-		case ALGO_YESCRYPTR16:
-			rc = scanhash_yescryptr16(thr_id, &work, max_nonce, &hashes_done);
-			break;
-		case ALGO_YESCRYPTR32:
-			rc = scanhash_yescryptr32(thr_id, &work, max_nonce, &hashes_done);
-			break;
-		case ALGO_YESPOWER:
-			rc = scanhash_yespower(thr_id, &work, max_nonce, &hashes_done);
-			break;
-		case ALGO_YESPOWERR16:
-			rc = scanhash_yespowerR16(thr_id, &work, max_nonce, &hashes_done);
-			break;
-		case ALGO_YESPOWERLITB:
-			rc = scanhash_yespowerLITB(thr_id, &work, max_nonce, &hashes_done);
-			break;
-		case ALGO_YESPOWERLNC:
-			rc = scanhash_yespowerLNC(thr_id, &work, max_nonce, &hashes_done);
-			break;
-		case ALGO_YESPOWER_MGPC:
-			rc = scanhash_yespowerMGPC(thr_id, &work, max_nonce, &hashes_done);
-			break;
-		case ALGO_YESPOWERIC:
-			rc = scanhash_yespowerIC(thr_id, &work, max_nonce, &hashes_done);
-			break;
-		case ALGO_YESPOWERIOTS:
-			rc = scanhash_yespowerIOTS(thr_id, &work, max_nonce, &hashes_done);
-			break;
-		case ALGO_YESPOWERITC:
-			rc = scanhash_yespowerITC(thr_id, &work, max_nonce, &hashes_done);
-			break;
-		case ALGO_YESPOWERSUGAR:
-			rc = scanhash_yespowerSUGAR(thr_id, &work, max_nonce, &hashes_done);
-			break;
-		case ALGO_YESPOWERTIDE:
-			rc = scanhash_yespowerTIDE(thr_id, &work, max_nonce, &hashes_done);
-			break;
-		case ALGO_YESPOWERURX:
-			rc = scanhash_yespowerURX(thr_id, &work, max_nonce, &hashes_done);
-			break;
-		case ALGO_ZR5:
-			rc = scanhash_zr5(thr_id, &work, max_nonce, &hashes_done);
-			break;
-		default:
-			/* should never happen */
+		/* scan nonces for a proof-of-work hash */
+		rc = algo_scanhash(thr_id, &work, max_nonce, &hashes_done, scratchbuf);
+		if (rc < 0)
 			goto out;
-		}
 
 		/* record scanhash elapsed time */
 		gettimeofday(&tv_end, NULL);
@@ -2544,42 +2986,53 @@ static void *miner_thread(void *userdata)
 				hashes_done / (diff.tv_sec + diff.tv_usec * 1e-6);
 			pthread_mutex_unlock(&stats_lock);
 		}
-		if (!opt_quiet && (time(NULL) - tm_rate_log) > opt_maxlograte) {
-			switch(opt_algo) {
-			case ALGO_AXIOM:
-			case ALGO_PLUCK:
-			case ALGO_SCRYPTJANE:
-//				applog(LOG_INFO, "CPU #%d: %.2f H/s", thr_id, thr_hashrates[thr_id]);
-				break;
-			default:
-				sprintf(s, thr_hashrates[thr_id] >= 1e6 ? "%.0f" : "%.2f",
-						thr_hashrates[thr_id] / 1e3);
-//				applog(LOG_INFO, "CPU #%d: %s kH/s", thr_id, s);
-				break;
+		stats_remember_speed(thr_id, hashes_done, &tv_start, &tv_end);
+		/* time spent on a job already replaced by restart_threads() */
+		if (work_restart[thr_id].restart && work_restart[thr_id].restart_us) {
+			struct work_restart *wr = &work_restart[thr_id];
+			uint64_t now_us = (uint64_t) tv_end.tv_sec * 1000000 + tv_end.tv_usec;
+			uint64_t stale_us = now_us > wr->restart_us ? now_us - wr->restart_us : 0;
+			uint64_t ms = stale_us / 1000;
+			int slot = 0;
+			while (ms && slot < STALE_HISTO_SLOTS - 1) {
+				ms >>= 1;
+				slot++;
 			}
-			tm_rate_log = time(NULL);
+			wr->stale_histo[slot]++;
+			wr->stale_count++;
+			wr->stale_total_us += stale_us;
+			if (stale_us > wr->stale_max_us)
+				wr->stale_max_us = stale_us;
+			wr->stale_last_us = stale_us;
+			wr->restart_us = 0;
 		}
 
-		if (show_hash_meter) {
-			double hashrate = thr_hashrates[thr_id];
-			if (hashrate < 1e3) {
-				applog(LOG_NOTICE, "CPU #%d: %.2f H/s", thr_id, hashrate);
-			} else if (hashrate < 1e6) {
-				applog(LOG_NOTICE, "CPU #%d: %.2f KH/s", thr_id, hashrate / 1e3);
-			} else if (hashrate < 1e9) {
-				applog(LOG_NOTICE, "CPU #%d: %.2f MH/s", thr_id, hashrate / 1e6);
-			} else if (hashrate < 1e12) {
-				applog(LOG_NOTICE, "CPU #%d: %.2f GH/s", thr_id, hashrate / 1e9);
-			} else {
-				applog(LOG_NOTICE, "CPU #%d: %.2f TH/s", thr_id, hashrate / 1e12);
+		/* duty cycle of the thermal/power governor */
+		governor_throttle(thr_id, &diff);
+		if (!opt_quiet && (time(NULL) - tm_rate_log) > opt_maxlograte) {
+			tm_rate_log = time(NULL);
+
+			// slices are short now, keep the meter at the log rate
+			// and show the smoothed speed of the api
+			if (show_hash_meter) {
+				double hashrate = stats_get_speed(thr_id, STATS_EWMA);
+				if (hashrate < 1e3) {
+					applog(LOG_NOTICE, "CPU #%d: %.2f H/s", thr_id, hashrate);
+				} else if (hashrate < 1e6) {
+					applog(LOG_NOTICE, "CPU #%d: %.2f KH/s", thr_id, hashrate / 1e3);
+				} else if (hashrate < 1e9) {
+					applog(LOG_NOTICE, "CPU #%d: %.2f MH/s", thr_id, hashrate / 1e6);
+				} else if (hashrate < 1e12) {
+					applog(LOG_NOTICE, "CPU #%d: %.2f GH/s", thr_id, hashrate / 1e9);
+				} else {
+					applog(LOG_NOTICE, "CPU #%d: %.2f TH/s", thr_id, hashrate / 1e12);
+				}
 			}
 		}
 
 		if (opt_benchmark && thr_id == opt_n_threads - 1) {
-			double hashrate = 0.;
-			for (i = 0; i < opt_n_threads && thr_hashrates[i]; i++)
-				hashrate += thr_hashrates[i];
-			if (i == opt_n_threads) {
+			double hashrate = stats_get_speed(-1, STATS_EWMA);
+			if (all_threads_reported()) {
 				switch(opt_algo) {
 				case ALGO_AXIOM:
 				case ALGO_SCRYPTJANE:
@@ -2595,6 +3048,12 @@ static void *miner_thread(void *userdata)
 			}
 		}
 
+		/* dropped locally, before any network call */
+		if (rc)
+			events_share(EV_FOUND, thr_id, &work, 0);
+		if (rc && !share_check(thr_id, &work))
+			rc = 0;
+
 		/* if nonce found, submit work */
 		if (rc && !opt_benchmark) {
 			if (!submit_work(mythr, &work))
@@ -2620,10 +3079,18 @@ out:
 
 void restart_threads(void)
 {
+	struct timeval now;
+	uint64_t now_us;
 	int i;
 
-	for (i = 0; i < opt_n_threads; i++)
+	gettimeofday(&now, NULL);
+	now_us = (uint64_t) now.tv_sec * 1000000 + now.tv_usec;
+	for (i = 0; i < opt_n_threads; i++) {
+		// keep the first request if the thread didn't see it yet
+		if (!work_restart[i].restart)
+			work_restart[i].restart_us = now_us;
 		work_restart[i].restart = 1;
+	}
 }
 
 static void *longpoll_thread(void *userdata)
@@ -2763,12 +3230,27 @@ out:
 	return NULL;
 }
 
-static bool stratum_handle_response(char *buf)
+static bool stratum_handle_response(struct stratum_ctx *sctx, char *buf)
 {
 	json_t *val, *err_val, *res_val, *id_val;
 	json_error_t err;
+	double sharediff = sctx->sharediff;
+	double latency;
 	bool ret = false;
 	bool valid = false;
+	char reason[128];
+	int id, result;
+
+	/* usual submit answers are decoded without building a json tree */
+	if (!jsonrpc_2 && stratum_parse_submit_answer(buf, &id, &result, reason, sizeof(reason))
+			&& id >= 4) {
+		latency = pending_share_del(id, &sharediff);
+		if (result < 0)
+			return false;
+		share_result(result, sharediff, *reason ? reason : NULL, latency);
+		events_result(sctx->pool_id, id, result, *reason ? reason : NULL, latency);
+		return true;
+	}
 
 	val = JSON_LOADS(buf, &err);
 	if (!val) {
@@ -2783,6 +3265,15 @@ static bool stratum_handle_response(char *buf)
 	if (!id_val || json_is_null(id_val))
 		goto out;
 
+	/* configure answer received after its wait */
+	if (!jsonrpc_2 && json_is_integer(id_val) && json_integer_value(id_val) == STRATUM_CONFIGURE_ID) {
+		ret = stratum_configure_answer(sctx, val);
+		goto out;
+	}
+
+	/* sharediff of the matching submit, and its round trip time */
+	latency = pending_share_del((int) json_integer_value(id_val), &sharediff);
+
 	if (jsonrpc_2)
 	{
 		if (!res_val && !err_val)
@@ -2795,14 +3286,19 @@ static bool stratum_handle_response(char *buf)
 		} else {
 			valid = json_is_null(err_val);
 		}
-		share_result(valid, NULL, err_val ? json_string_value(err_val) : NULL);
+		share_result(valid, sharediff, err_val ? json_string_value(err_val) : NULL, latency);
+		events_result(sctx->pool_id, (int) json_integer_value(id_val), valid,
+			err_val ? json_string_value(err_val) : NULL, latency);
 
 	} else {
 
 		if (!res_val || json_integer_value(id_val) < 4)
 			goto out;
 		valid = json_is_true(res_val);
-		share_result(valid, NULL, err_val ? json_string_value(json_array_get(err_val, 1)) : NULL);
+		share_result(valid, sharediff, err_val ? json_string_value(json_array_get(err_val, 1)) : NULL,
+			latency);
+		events_result(sctx->pool_id, (int) json_integer_value(id_val), valid,
+			err_val ? json_string_value(json_array_get(err_val, 1)) : NULL, latency);
 	}
 
 	ret = true;
@@ -2814,45 +3310,82 @@ out:
 	return ret;
 }
 
-static void *stratum_thread(void *userdata)
+/* must be called with g_work_lock held */
+static void pool_switch(int p)
 {
-	struct thr_info *mythr = (struct thr_info *) userdata;
-	char *s;
+	struct stratum_ctx *sctx = pools[p].sctx;
 
-	stratum.url = (char*) tq_pop(mythr->q, NULL);
-	if (!stratum.url)
-		goto out;
-	applog(LOG_INFO, CL_CY2 "Starting Stratum on %s", stratum.url);
+	pools[cur_pool].sctx->standby = true;
+	sctx->standby = false;
+	cur_pool = p;
+
+	stratum_gen_work(sctx, &g_work);
+	time(&g_work_time);
+	restart_threads();
+	applog(LOG_BLUE, "Switching to %s pool %s", p ? "failover" : "primary", sctx->url);
+}
+
+/* move the miners to the first ready pool after the lost one p */
+static bool pool_failover(int p)
+{
+	bool rc = false;
+	int i;
+
+	pthread_mutex_lock(&g_work_lock);
+	for (i = 0; i < num_pools && cur_pool == p; i++) {
+		if (i != p && pools[i].ready && pools[i].sctx->curl) {
+			pool_switch(i);
+			rc = true;
+		}
+	}
+	pthread_mutex_unlock(&g_work_lock);
+	return rc;
+}
+
+static void pool_loop(int p)
+{
+	struct pool_infos *pool = &pools[p];
+	struct stratum_ctx *sctx = pool->sctx;
+	char *s;
 
 	while (1) {
 		int failures = 0;
 
-		if (stratum_need_reset) {
+		if (p == 0 && stratum_need_reset) {
 			stratum_need_reset = false;
-			stratum_disconnect(&stratum);
-			if (strcmp(stratum.url, rpc_url)) {
-				free(stratum.url);
-				stratum.url = strdup(rpc_url);
+			stratum_disconnect(sctx);
+			if (strcmp(sctx->url, rpc_url)) {
+				free(sctx->url);
+				sctx->url = strdup(rpc_url);
 				applog(LOG_BLUE, "Connection changed to %s", short_url);
 			} else if (!opt_quiet) {
 				applog(LOG_DEBUG, "Stratum connection reset");
 			}
 		}
 
-		while (!stratum.curl) {
-			pthread_mutex_lock(&g_work_lock);
-			g_work_time = 0;
-			pthread_mutex_unlock(&g_work_lock);
-			restart_threads();
+		while (!sctx->curl) {
+			pool->ready = false;
+			if (p == cur_pool && !pool_failover(p)) {
+				pthread_mutex_lock(&g_work_lock);
+				g_work_time = 0;
+				pthread_mutex_unlock(&g_work_lock);
+				restart_threads();
+			}
 
-			if (!stratum_connect(&stratum, stratum.url)
-					|| !stratum_subscribe(&stratum)
-					|| !stratum_authorize(&stratum, rpc_user, rpc_pass)) {
-				stratum_disconnect(&stratum);
-				if (opt_retries >= 0 && ++failures > opt_retries) {
+			pool->notify_count = sctx->notify_count;
+
+			if (!stratum_connect(sctx, sctx->url)
+					|| (opt_version_rolling && header_can_roll() && !stratum_configure(sctx))
+					|| !stratum_subscribe(sctx)
+					|| !stratum_authorize(sctx, pool->user ? pool->user : rpc_user,
+						pool->pass ? pool->pass : rpc_pass)) {
+				stratum_disconnect(sctx);
+				// keep the backups retrying while another pool is mining
+				if (p == 0 && opt_retries >= 0 && ++failures > opt_retries
+						&& cur_pool == 0) {
 					applog(LOG_ERR, "...terminating workio thread");
 					tq_push(thr_info[work_thr_id].q, NULL);
-					goto out;
+					return;
 				}
 				if (!opt_benchmark)
 					applog(LOG_ERR, "...retry after %d seconds", opt_fail_pause);
@@ -2861,62 +3394,113 @@ static void *stratum_thread(void *userdata)
 
 			if (jsonrpc_2) {
 				work_free(&g_work);
-				work_copy(&g_work, &stratum.work);
+				work_copy(&g_work, &sctx->work);
 			}
 		}
 
-		if (stratum.job.job_id &&
-			(!g_work_time || strcmp(stratum.job.job_id, g_work.job_id)) )
+		if (!pool->ready && sctx->job.job_id && sctx->notify_count != pool->notify_count) {
+			pool->ready = true;
+			if (p && !opt_quiet)
+				applog(LOG_INFO, "Failover pool %s ready", sctx->url);
+			// fail back to a pool of higher priority
+			pthread_mutex_lock(&g_work_lock);
+			if (p < cur_pool)
+				pool_switch(p);
+			pthread_mutex_unlock(&g_work_lock);
+		}
+
+		if (p == cur_pool && sctx->job.job_id &&
+			(!g_work_time || strcmp(sctx->job.job_id, g_work.job_id)) )
 		{
 			pthread_mutex_lock(&g_work_lock);
-			stratum_gen_work(&stratum, &g_work);
+			stratum_gen_work(sctx, &g_work);
 			time(&g_work_time);
 			pthread_mutex_unlock(&g_work_lock);
 
-			if (stratum.job.clean || jsonrpc_2) {
+			if (sctx->job.clean || jsonrpc_2) {
 				static uint32_t last_bloc_height;
-				if (!opt_quiet && last_bloc_height != stratum.bloc_height) {
-					last_bloc_height = stratum.bloc_height;
+				if (!opt_quiet && last_bloc_height != sctx->bloc_height) {
+					last_bloc_height = sctx->bloc_height;
 					if (net_diff > 0.)
 						applog(LOG_BLUE, "%s block %d, diff %.8f", algo_names[opt_algo],
-							stratum.bloc_height, net_diff);
+							sctx->bloc_height, net_diff);
 					else
 						applog(LOG_BLUE, "%s %s block %d", short_url, algo_names[opt_algo],
-							stratum.bloc_height);
+							sctx->bloc_height);
 				}
-				restart_threads();
-					if (opt_showdiff && !opt_quiet) {
-						applog(LOG_INFO, CL_MAG "Got new work job: %s", g_work.job_id);
-						restart_threads();
-					} else if (!opt_showdiff && opt_quiet) {
-						restart_threads();
-					}
-				restart_threads();
+				if (opt_showdiff && !opt_quiet)
+					applog(LOG_INFO, CL_MAG "Got new work job: %s", g_work.job_id);
 			} else if (opt_debug && !opt_quiet) {
 					applog(LOG_BLUE, "%s asks job %lu for block %d", short_url,
-						strtoul(stratum.job.job_id, NULL, 16), stratum.bloc_height);
-						restart_threads();
+						strtoul(sctx->job.job_id, NULL, 16), sctx->bloc_height);
 			}
+			// the new work is ready to hash, stop the miners only now
+			restart_threads();
 		}
 
-		if (!stratum_socket_full(&stratum, opt_timeout)) {
+		if (!stratum_wait(sctx, opt_timeout)) {
 			applog(LOG_ERR, "Stratum connection timeout");
 			s = NULL;
 		} else
-			s = stratum_recv_line(&stratum);
+			s = stratum_recv_line_view(sctx, NULL);
 		if (!s) {
-			stratum_disconnect(&stratum);
-			applog(LOG_ERR, "Stratum connection interrupted");
+			stratum_disconnect(sctx);
+			if (p)
+				applog(LOG_ERR, "Failover pool %s interrupted", sctx->url);
+			else
+				applog(LOG_ERR, "Stratum connection interrupted");
 			continue;
 		}
-		if (!stratum_handle_method(&stratum, s))
-			stratum_handle_response(s);
-		free(s);
+		if (!stratum_handle_method(sctx, s))
+			stratum_handle_response(sctx, s);
 	}
+}
+
+static void *stratum_thread(void *userdata)
+{
+	struct thr_info *mythr = (struct thr_info *) userdata;
+
+	stratum.url = (char*) tq_pop(mythr->q, NULL);
+	if (!stratum.url)
+		goto out;
+	applog(LOG_INFO, CL_CY2 "Starting Stratum on %s", stratum.url);
+
+	pool_loop(0);
 out:
 	return NULL;
 }
 
+/* backup pools, connected in standby once the primary has started */
+static void *pool_thread(void *userdata)
+{
+	struct thr_info *mythr = (struct thr_info *) userdata;
+
+	applog(LOG_INFO, CL_CY2 "Failover %d on %s", mythr->id, pools[mythr->id].url);
+	pool_loop(mythr->id);
+	return NULL;
+}
+
+static void pool_add_url(struct pool_infos *pool, const char *arg)
+{
+	const char *ap = strstr(arg, "://") + 3;
+	const char *hp = strrchr(arg, '@');
+
+	if (hp && hp > ap) {
+		const char *p = (const char*) memchr(ap, ':', hp - ap);
+		if (!p)
+			p = hp;
+		pool->user = (char*) calloc(p - ap + 1, 1);
+		strncpy(pool->user, ap, p - ap);
+		if (p < hp) {
+			pool->pass = (char*) calloc(hp - p, 1);
+			strncpy(pool->pass, p + 1, hp - p - 1);
+		}
+		pool->url = (char*) malloc(strlen(arg) + 1);
+		sprintf(pool->url, "%.*s%s", (int) (ap - arg), arg, hp + 1);
+	} else
+		pool->url = strdup(arg);
+}
+
 static void show_version_and_exit(void)
 {
 	printf(" built "
@@ -3162,6 +3746,10 @@ void parse_arg(int key, char *arg)
 				fprintf(stderr, "%s:%d: %s\n",
 					arg, err.line, err.text);
 		} else {
+			if (!strstr(arg, "://")) {
+				free(opt_config);
+				opt_config = strdup(arg);
+			}
 			parse_config(config, arg);
 			json_decref(config);
 		}
@@ -3324,6 +3912,9 @@ void parse_arg(int key, char *arg)
 	case 1006:
 		print_hash_tests();
 		exit(0);
+	case 1069:
+		hex_benchmark();
+		exit(0);
 	case 1007:
 		want_stratum = false;
 		opt_extranonce = false;
@@ -3343,6 +3934,84 @@ void parse_arg(int key, char *arg)
 	case 1012:
 		opt_extranonce = false;
 		break;
+	case 1070:
+		opt_version_rolling = false;
+		break;
+	case 1071:
+		opt_share_check = true;
+		break;
+	case 1072:
+#ifdef USE_STAGE_PROFILE
+		opt_stage_profile = true;
+#else
+		applog(LOG_WARNING, "Stage profiler not built, configure with --enable-stage-profile");
+#endif
+		break;
+	case 1073:
+		free(opt_event_log);
+		opt_event_log = strdup(arg);
+		break;
+	case 1074:
+		exit(events_read(arg));
+	case 1075:
+		// stdout already holds the banner and the log
+		if (!strcmp(arg, "-")) {
+			applog(LOG_ERR, "--bench-suite needs a file, stdout is used by the log");
+			show_usage_and_exit(1);
+		}
+		free(opt_bench_suite);
+		opt_bench_suite = strdup(arg);
+		opt_benchmark = true;
+		want_longpoll = false;
+		want_stratum = false;
+		have_stratum = false;
+		break;
+	case 1076:
+		free(opt_bench_algos);
+		opt_bench_algos = strdup(arg);
+		break;
+	case 1077:
+		v = atoi(arg);
+		if (v < 1 || v > 3600)
+			show_usage_and_exit(1);
+		opt_bench_time = v;
+		break;
+	case 1078:
+		free(opt_selftest);
+		opt_selftest = arg ? strdup(arg) : strdup("");
+		want_longpoll = false;
+		want_stratum = false;
+		have_stratum = false;
+		opt_benchmark = true;
+		break;
+	case 1079:
+		opt_autotune = true;
+		want_longpoll = false;
+		want_stratum = false;
+		have_stratum = false;
+		opt_benchmark = true;
+		break;
+	case 1080:
+		free(opt_record);
+		opt_record = strdup(arg);
+		break;
+	case 1081:
+		free(opt_replay);
+		opt_replay = strdup(arg);
+		break;
+	case 1082:
+		d = atof(arg);
+		if (d < 0.)
+			show_usage_and_exit(1);
+		opt_replay_speed = d;
+		break;
+	case 1083: {
+		char *ep;
+		opt_selftest_seed = strtoull(arg, &ep, 10);
+		if (!*arg || *ep || !opt_selftest_seed)
+			show_usage_and_exit(1);
+		break;
+	}
 	case 1013:
 		opt_showdiff = true;
 		break;
@@ -3419,6 +4088,56 @@ void parse_arg(int key, char *arg)
 	case 1024:
 		opt_randomize = true;
 		break;
+	case 1065: // temp-target
+		d = atof(arg);
+		if (d < 0. || d > 150.)
+			show_usage_and_exit(1);
+		if (d > 0. && opt_power_target > 0.) {
+			applog(LOG_ERR, "--temp-target and --power-target can't be used together");
+			show_usage_and_exit(1);
+		}
+		opt_temp_target = d;
+		break;
+	case 1066: // power-target
+		d = atof(arg);
+		if (d < 0.)
+			show_usage_and_exit(1);
+		if (d > 0. && opt_temp_target > 0.) {
+			applog(LOG_ERR, "--temp-target and --power-target can't be used together");
+			show_usage_and_exit(1);
+		}
+		opt_power_target = d;
+		break;
+	case 1064: // sensor-interval
+		v = atoi(arg);
+		if (v < 10 || v > 60000)	/* sanity check */
+			show_usage_and_exit(1);
+		opt_sensor_interval = v;
+		break;
+	case 1067: // submit-threads
+		v = atoi(arg);
+		if (v < 1 || v > 32)	/* sanity check */
+			show_usage_and_exit(1);
+		opt_submit_threads = v;
+		break;
+	case 1068: // failover-url
+		if (num_pools >= MAX_POOLS) {
+			fprintf(stderr, "too many failover pools (max %d)\n", MAX_POOLS - 1);
+			show_usage_and_exit(1);
+		}
+		if (strncasecmp(arg, "stratum+tcp://", 14) &&
+		    strncasecmp(arg, "stratum+tcps://", 15)) {
+			fprintf(stderr, "failover requires a stratum url -- '%s'\n", arg);
+			show_usage_and_exit(1);
+		}
+		pool_add_url(&pools[num_pools++], arg);
+		break;
+	case 1063: // switch-latency
+		v = atoi(arg);
+		if (v < 0 || v > 60000)	/* sanity check */
+			show_usage_and_exit(1);
+		opt_switch_latency = v;
+		break;
 	case 'V':
 		show_version_and_exit();
 	case 'h':
@@ -3457,6 +4176,19 @@ void parse_config(json_t *config, char *ref)
 			sprintf(buf, "%f", json_real_value(val));
 			parse_arg(options[i].val, buf);
 		}
+		else if (options[i].has_arg && json_is_array(val)) {
+			// repeatable option, like "failover-url": [ ... ]
+			size_t n;
+			for (n = 0; n < json_array_size(val); n++) {
+				json_t *item = json_array_get(val, n);
+				char *s;
+				if (!json_is_string(item))
+					continue;
+				s = strdup(json_string_value(item));
+				parse_arg(options[i].val, s);
+				free(s);
+			}
+		}
 		else if (!options[i].has_arg) {
 			if (json_is_true(val))
 				parse_arg(options[i].val, "");
@@ -3536,8 +4268,6 @@ static int thread_create(struct thr_info *thr, void* func)
 
 #include "res/banner.h"
 
-void get_defconfig_path(char *out, size_t bufsize, char *argv0);
-
 int main(int argc, char *argv[]) {
 	struct thr_info *thr;
 	long flags;
@@ -3570,7 +4300,7 @@ int main(int argc, char *argv[]) {
 	/* parse command line */
 	parse_cmdline(argc, argv);
 
-	if (!opt_benchmark && !rpc_url) {
+	if (!opt_benchmark && !rpc_url && !opt_replay) {
 		// try default config file in binary folder
 		char defconfig[MAX_PATH] = { 0 };
 		get_defconfig_path(defconfig, MAX_PATH, argv[0]);
@@ -3582,6 +4312,14 @@ int main(int argc, char *argv[]) {
 		}
 	}
 
+	/* the local pool of the replay is the url */
+	if (opt_replay && !replay_start())
+		return 1;
+
+	/* the thread count autotuned on this cpu, unless given */
+	if (!opt_n_threads && !opt_autotune)
+		autotune_apply(opt_algo, argv[0]);
+
 	if (!opt_n_threads)
 		opt_n_threads = num_cpus;
 	if (!opt_n_threads)
@@ -3611,6 +4349,7 @@ int main(int argc, char *argv[]) {
 	pthread_mutex_init(&rpc2_login_lock, NULL);
 	pthread_mutex_init(&stratum.sock_lock, NULL);
 	pthread_mutex_init(&stratum.work_lock, NULL);
+	pthread_mutex_init(&pending_lock, NULL);
 
 	flags = !opt_benchmark && strncmp(rpc_url, "https:", 6)
 	        ? (CURL_GLOBAL_ALL & ~CURL_GLOBAL_SSL)
@@ -3619,6 +4358,8 @@ int main(int argc, char *argv[]) {
 		applog(LOG_ERR, "CURL initialization failed");
 		return 1;
 	}
+	if (!rpc_share_init())
+		applog(LOG_WARNING, "CURL share initialization failed");
 
 #ifndef WIN32
 	if (opt_background) {
@@ -3678,11 +4419,18 @@ int main(int argc, char *argv[]) {
 		openlog("cpuminer", LOG_PID, LOG_USER);
 #endif
 
+	/* after the fork, the miners log without waiting for the terminal */
+	if (!log_init())
+		applog(LOG_WARNING, "Asynchronous logger start failed, logging directly");
+
+	if (opt_record && !record_open(opt_record))
+		return 1;
+
 	work_restart = (struct work_restart*) calloc(opt_n_threads, sizeof(*work_restart));
 	if (!work_restart)
 		return 1;
 
-	thr_info = (struct thr_info*) calloc(opt_n_threads + 4, sizeof(*thr));
+	thr_info = (struct thr_info*) calloc(opt_n_threads + 7, sizeof(*thr));
 	if (!thr_info)
 		return 1;
 
@@ -3690,6 +4438,36 @@ int main(int argc, char *argv[]) {
 	if (!thr_hashrates)
 		return 1;
 
+	if (!stats_init(opt_n_threads))
+		return 1;
+
+	if (!prof_init(opt_n_threads))
+		return 1;
+
+	if (opt_bench_suite)
+		return bench_suite();
+	if (opt_selftest)
+		return selftest();
+	if (opt_autotune)
+		return autotune(opt_algo, argv[0]);
+
+	if (opt_event_log) {
+		/* events thread, started before the first job */
+		if (!events_open(opt_event_log))
+			return 1;
+		events_thr_id = opt_n_threads + 6;
+		thr = &thr_info[events_thr_id];
+		thr->id = events_thr_id;
+		thr->q = tq_new();
+		if (!thr->q)
+			return 1;
+		err = thread_create(thr, events_thread);
+		if (err) {
+			applog(LOG_ERR, "events thread create failed");
+			return 1;
+		}
+	}
+
 	/* init workio thread info */
 	work_thr_id = opt_n_threads;
 	thr = &thr_info[work_thr_id];
@@ -3707,6 +4485,26 @@ int main(int argc, char *argv[]) {
 		return 1;
 	}
 
+	/* submit threads, only used by getwork/gbt, a failover from stratum
+	 * to http submits from the workio thread */
+	if (!opt_benchmark && !have_stratum) {
+		submit_q = tq_new();
+		submit_thr = (struct thr_info*) calloc(opt_submit_threads, sizeof(*thr));
+		if (!submit_q || !submit_thr)
+			return 1;
+		for (i = 0; i < opt_submit_threads; i++) {
+			thr = &submit_thr[i];
+			thr->id = i;
+			thr->q = tq_new();
+			if (!thr->q)
+				return 1;
+			if (thread_create(thr, submit_thread)) {
+				applog(LOG_ERR, "submit thread create failed");
+				return 1;
+			}
+		}
+	}
+
 	/* ESET-NOD32 Detects these 2 thread_create... */
 	if (want_longpoll && !have_stratum) {
 		/* init longpoll thread info */
@@ -3743,6 +4541,35 @@ int main(int argc, char *argv[]) {
 			tq_push(thr_info[stratum_thr_id].q, strdup(rpc_url));
 	}
 
+	if (have_stratum && num_pools > 1 && jsonrpc_2) {
+		applog(LOG_WARNING, "failover pools are not supported with this algo");
+		num_pools = 1;
+	}
+	if (have_stratum && num_pools > 1) {
+		pool_thr = (struct thr_info*) calloc(num_pools, sizeof(*pool_thr));
+		if (!pool_thr)
+			return 1;
+		for (i = 1; i < num_pools; i++) {
+			struct stratum_ctx *sctx = (struct stratum_ctx*) calloc(1, sizeof(*sctx));
+			if (!sctx)
+				return 1;
+			pthread_mutex_init(&sctx->sock_lock, NULL);
+			pthread_mutex_init(&sctx->work_lock, NULL);
+			sctx->url = pools[i].url;
+			sctx->pool_id = i;
+			sctx->standby = true;
+			pools[i].sctx = sctx;
+
+			thr = &pool_thr[i];
+			thr->id = i;
+			err = thread_create(thr, pool_thread);
+			if (err) {
+				applog(LOG_ERR, "failover thread create failed");
+				return 1;
+			}
+		}
+	}
+
 	if (opt_api_listen) {
 		/* api thread */
 		api_thr_id = opt_n_threads + 3;
@@ -3758,6 +4585,36 @@ int main(int argc, char *argv[]) {
 		}
 	}
 
+	/* first sample is done before the miners can read it */
+	sensors_init();
+	if (opt_sensor_interval) {
+		sensors_thr_id = opt_n_threads + 4;
+		thr = &thr_info[sensors_thr_id];
+		thr->id = sensors_thr_id;
+		thr->q = tq_new();
+		if (!thr->q)
+			return 1;
+		err = thread_create(thr, sensors_thread);
+		if (err) {
+			applog(LOG_ERR, "sensors thread create failed");
+			return 1;
+		}
+	}
+
+	if ((opt_temp_target > 0.0 || opt_power_target > 0.0) && governor_init()) {
+		governor_thr_id = opt_n_threads + 5;
+		thr = &thr_info[governor_thr_id];
+		thr->id = governor_thr_id;
+		thr->q = tq_new();
+		if (!thr->q)
+			return 1;
+		err = thread_create(thr, governor_thread);
+		if (err) {
+			applog(LOG_ERR, "governor thread create failed");
+			return 1;
+		}
+	}
+
 	/* start mining threads */
 	for (i = 0; i < opt_n_threads; i++) {
 		thr = &thr_info[i];
@@ -0,0 +1,473 @@
+/**
+ * Binary share and job event log, see --event-log
+ *
+ * Each thread pushes fixed size records in its own single producer ring,
+ * the events thread drains the rings every 100 ms in the log file, mapped
+ * in memory by 1 MB chunks. A full ring drops the record and counts it,
+ * a producer never waits. --event-read prints the counts and latency
+ * distributions of a log.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#ifndef WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include "miner.h"
+
+#define EVENT_MAGIC "CPUMEVT1"
+#define EVENT_RING 1024 /* records per thread, power of 2 */
+#define EVENT_RINGS 64
+#define EVENT_CHUNK (1 << 20)
+
+/* 32 bytes, host endian */
+struct event_rec {
+	uint64_t us;
+	uint8_t type;
+	uint8_t thr;        /* miner thread, 0xff for the network threads */
+	uint8_t pool;
+	uint8_t flags;      /* job: clean, result: bit 0 accepted else reject class + 1 << 1, drop: reason */
+	uint32_t job;       /* fnv-1a of the stratum job id */
+	uint32_t nonce;
+	uint32_t id;        /* submit id, lost records count */
+	float diff;
+	uint32_t latency_us;
+};
+
+struct event_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t rec_size;
+	uint64_t start_us;
+	char algo[32];
+	char padding[8];
+};
+
+struct event_ring {
+	volatile uint32_t head; /* producer */
+	char pad1[60];
+	volatile uint32_t tail; /* events thread */
+	char pad2[60];
+	struct event_rec rec[EVENT_RING];
+};
+
+char *opt_event_log = NULL;
+
+static bool events_on = false;
+static struct event_ring *volatile rings[EVENT_RINGS];
+static volatile int rings_used = 0;
+static __thread struct event_ring *my_ring = NULL;
+static __thread bool my_ring_failed = false;
+static volatile uint32_t events_lost = 0;
+static uint32_t events_lost_logged = 0;
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#ifndef WIN32
+static int ev_fd = -1;
+static uchar *ev_map = NULL;
+static off_t ev_map_off = 0;
+static size_t ev_pos = 0;
+#else
+static FILE *ev_file = NULL;
+#endif
+
+static uint64_t now_us(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/* fnv-1a of the stratum job id, 0 for getwork/gbt */
+static uint32_t job_key(const char *job_id, size_t len)
+{
+	uint32_t h = 0x811c9dc5;
+	size_t i;
+
+	if (!job_id)
+		return 0;
+	for (i = 0; i < len; i++)
+		h = (h ^ (uchar) job_id[i]) * 0x01000193;
+	return h ? h : 1;
+}
+
+#ifndef WIN32
+static bool ev_remap(off_t off)
+{
+	if (ev_map)
+		munmap(ev_map, EVENT_CHUNK);
+	ev_map = NULL;
+	if (ftruncate(ev_fd, off + EVENT_CHUNK))
+		return false;
+	ev_map = (uchar*) mmap(NULL, EVENT_CHUNK, PROT_READ | PROT_WRITE, MAP_SHARED, ev_fd, off);
+	if (ev_map == MAP_FAILED) {
+		ev_map = NULL;
+		return false;
+	}
+	ev_map_off = off;
+	return true;
+}
+#endif
+
+static bool ev_write(const void *data, size_t len)
+{
+#ifndef WIN32
+	if (!ev_map || ev_pos + len > EVENT_CHUNK) {
+		off_t off = ev_map ? ev_map_off + ev_pos : 0;
+		// keep the mapping page aligned, the partial page is mapped again
+		if (!ev_remap(off & ~(off_t) 4095))
+			return false;
+		ev_pos = (size_t) (off & 4095);
+	}
+	memcpy(ev_map + ev_pos, data, len);
+	ev_pos += len;
+	return true;
+#else
+	return fwrite(data, len, 1, ev_file) == 1;
+#endif
+}
+
+bool events_open(const char *path)
+{
+	struct event_header hd;
+	struct stat st;
+
+	memset(&hd, 0, sizeof(hd));
+	if (stat(path, &st) == 0 && st.st_size >= (off_t) sizeof(hd)) {
+		// append after the last record, a crash leaves a zeroed tail
+		FILE *f = fopen(path, "rb");
+		struct event_rec r;
+		bool ok = f && fread(&hd, sizeof(hd), 1, f) == 1 && !memcmp(hd.magic, EVENT_MAGIC, 8)
+			&& hd.rec_size == sizeof(struct event_rec);
+		st.st_size = sizeof(hd);
+		while (ok && fread(&r, sizeof(r), 1, f) == 1 && r.type)
+			st.st_size += sizeof(r);
+		if (f)
+			fclose(f);
+		if (!ok) {
+			applog(LOG_ERR, "%s is not an event log", path);
+			return false;
+		}
+	} else {
+		st.st_size = 0;
+	}
+
+#ifndef WIN32
+	ev_fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (ev_fd < 0) {
+		applog(LOG_ERR, "Unable to open event log %s", path);
+		return false;
+	}
+	if (st.st_size) {
+		if (!ev_remap(st.st_size & ~(off_t) 4095))
+			goto err;
+		ev_pos = (size_t) (st.st_size & 4095);
+		applog(LOG_INFO, "Appending events to %s", path);
+		events_on = true;
+		return true;
+	}
+#else
+	ev_file = fopen(path, st.st_size ? "ab" : "wb");
+	if (!ev_file) {
+		applog(LOG_ERR, "Unable to open event log %s", path);
+		return false;
+	}
+	if (st.st_size) {
+		events_on = true;
+		return true;
+	}
+#endif
+
+	memcpy(hd.magic, EVENT_MAGIC, 8);
+	hd.version = 1;
+	hd.rec_size = sizeof(struct event_rec);
+	hd.start_us = now_us();
+	get_currentalgo(hd.algo, sizeof(hd.algo));
+	if (!ev_write(&hd, sizeof(hd)))
+		goto err;
+	events_on = true;
+	return true;
+err:
+	applog(LOG_ERR, "Unable to map event log %s", path);
+#ifndef WIN32
+	close(ev_fd);
+	ev_fd = -1;
+#endif
+	return false;
+}
+
+static void event_push(struct event_rec *r)
+{
+	struct event_ring *ring = my_ring;
+	uint32_t head;
+
+	if (!ring) {
+		int idx;
+		if (my_ring_failed)
+			goto lost;
+		idx = __sync_fetch_and_add(&rings_used, 1);
+		if (idx >= EVENT_RINGS || !(ring = (struct event_ring*) calloc(1, sizeof(*ring)))) {
+			my_ring_failed = true;
+			goto lost;
+		}
+		rings[idx] = my_ring = ring;
+	}
+
+	r->us = now_us();
+	head = ring->head;
+	if (head - ring->tail >= EVENT_RING)
+		goto lost;
+	memcpy(&ring->rec[head & (EVENT_RING - 1)], r, sizeof(*r));
+	mem_barrier();
+	ring->head = head + 1;
+	return;
+lost:
+	__sync_fetch_and_add(&events_lost, 1);
+}
+
+static void events_drain(void)
+{
+	struct event_rec lost;
+	int i;
+
+	pthread_mutex_lock(&drain_lock);
+	for (i = 0; i < EVENT_RINGS; i++) {
+		struct event_ring *ring = rings[i];
+		uint32_t head, tail;
+		if (!ring)
+			continue;
+		head = ring->head;
+		mem_barrier();
+		for (tail = ring->tail; tail != head; tail++) {
+			if (!ev_write(&ring->rec[tail & (EVENT_RING - 1)], sizeof(struct event_rec)))
+				break;
+		}
+		mem_barrier();
+		ring->tail = tail;
+	}
+	if (events_lost != events_lost_logged) {
+		memset(&lost, 0, sizeof(lost));
+		lost.us = now_us();
+		lost.type = EV_LOST;
+		lost.thr = lost.pool = 0xff;
+		lost.id = events_lost - events_lost_logged;
+		if (ev_write(&lost, sizeof(lost)))
+			events_lost_logged += lost.id;
+	}
+#ifdef WIN32
+	fflush(ev_file);
+#endif
+	pthread_mutex_unlock(&drain_lock);
+}
+
+void *events_thread(void *userdata)
+{
+	struct thr_info *mythr = (struct thr_info*) userdata;
+
+	while (events_on) {
+		usleep(100 * 1000);
+		events_drain();
+	}
+	tq_freeze(mythr->q);
+	return NULL;
+}
+
+/* last drain, the file is cut to its used length */
+void events_close(void)
+{
+	if (!events_on)
+		return;
+	events_drain();
+	pthread_mutex_lock(&drain_lock);
+	events_on = false;
+#ifndef WIN32
+	if (ev_map) {
+		off_t len = ev_map_off + ev_pos;
+		munmap(ev_map, EVENT_CHUNK);
+		ev_map = NULL;
+		if (ftruncate(ev_fd, len))
+			applog(LOG_WARNING, "event log truncate failed");
+	}
+	close(ev_fd);
+	ev_fd = -1;
+#else
+	fclose(ev_file);
+	ev_file = NULL;
+#endif
+	pthread_mutex_unlock(&drain_lock);
+}
+
+static void event_from_work(struct event_rec *r, int type, int thr_id, const struct work *work)
+{
+	memset(r, 0, sizeof(*r));
+	r->type = (uint8_t) type;
+	r->thr = thr_id < 0 ? 0xff : (uint8_t) thr_id;
+	r->pool = (uint8_t) work->pool_id;
+	r->job = work->job_id ? job_key(work->job_id, strlen(work->job_id)) : 0;
+	r->nonce = work->data[19];
+	r->diff = (float) work->sharediff;
+}
+
+void events_job(int pool_id, const char *job_id, size_t len, bool clean)
+{
+	struct event_rec r;
+	if (!events_on)
+		return;
+	memset(&r, 0, sizeof(r));
+	r.type = EV_JOB;
+	r.thr = 0xff;
+	r.pool = (uint8_t) pool_id;
+	r.flags = clean ? 1 : 0;
+	r.job = job_key(job_id, len);
+	event_push(&r);
+}
+
+/* first scan of a thread on a new job, latency from the notify */
+void events_switch(int thr_id, const struct work *work, double latency)
+{
+	struct event_rec r;
+	if (!events_on)
+		return;
+	event_from_work(&r, EV_SWITCH, thr_id, work);
+	r.latency_us = latency > 0. ? (uint32_t) (latency * 1e3) : 0;
+	event_push(&r);
+}
+
+/* EV_FOUND, EV_SUBMIT (arg is the submit id) or EV_DROP (enum event_drop) */
+void events_share(int type, int thr_id, const struct work *work, int arg)
+{
+	struct event_rec r;
+	if (!events_on)
+		return;
+	event_from_work(&r, type, thr_id, work);
+	if (type == EV_DROP)
+		r.flags = (uint8_t) arg;
+	else
+		r.id = (uint32_t) arg;
+	event_push(&r);
+}
+
+void events_result(int pool_id, int id, bool accepted, const char *reason, double latency)
+{
+	struct event_rec r;
+	if (!events_on)
+		return;
+	memset(&r, 0, sizeof(r));
+	r.type = EV_RESULT;
+	r.thr = 0xff;
+	r.pool = (uint8_t) pool_id;
+	r.id = id > 0 ? (uint32_t) id : 0;
+	r.flags = accepted ? 1 : (uint8_t) ((stats_reject_class(reason) + 1) << 1);
+	r.latency_us = latency > 0. ? (uint32_t) (latency * 1e3) : 0;
+	event_push(&r);
+}
+
+/* reader */
+
+static int cmp_float(const void *a, const void *b)
+{
+	float x = *(const float*) a, y = *(const float*) b;
+	return x < y ? -1 : x > y;
+}
+
+static void print_latency(const char *name, float *ms, uint32_t n)
+{
+	if (!n) {
+		printf("%-16s no sample\n", name);
+		return;
+	}
+	qsort(ms, n, sizeof(float), cmp_float);
+	printf("%-16s %8u samples, p50 %.2f ms, p90 %.2f ms, p99 %.2f ms, max %.2f ms\n",
+		name, n, ms[n / 2], ms[n * 9 / 10], ms[n * 99 / 100], ms[n - 1]);
+}
+
+static const char *drop_names[] = { "stale", "duplicate", "invalid", "pool" };
+
+int events_read(const char *path)
+{
+	struct event_header hd;
+	struct event_rec r;
+	uint32_t count[EV_LOST + 1] = { 0 };
+	uint32_t drops[4] = { 0 }, rejects[REJECT_REASONS] = { 0 };
+	uint32_t accepted = 0, lost = 0, nsub = 0, nsw = 0, alloc = 0;
+	float *sub = NULL, *sw = NULL;
+	uint64_t first = 0, last = 0;
+	FILE *f;
+	int i;
+
+	f = fopen(path, "rb");
+	if (!f || fread(&hd, sizeof(hd), 1, f) != 1 || memcmp(hd.magic, EVENT_MAGIC, 8)
+		|| hd.rec_size != sizeof(r)) {
+		fprintf(stderr, "%s is not an event log\n", path);
+		if (f)
+			fclose(f);
+		return 1;
+	}
+
+	while (fread(&r, sizeof(r), 1, f) == 1) {
+		if (!r.type || r.type > EV_LOST)
+			continue;
+		if (!first)
+			first = r.us;
+		last = r.us;
+		count[r.type]++;
+		if (count[EV_SWITCH] + count[EV_RESULT] > alloc) {
+			alloc = alloc ? alloc * 2 : 4096;
+			sub = (float*) realloc(sub, alloc * sizeof(float));
+			sw = (float*) realloc(sw, alloc * sizeof(float));
+			if (!sub || !sw) {
+				fclose(f);
+				return 1;
+			}
+		}
+		switch (r.type) {
+		case EV_SWITCH:
+			sw[nsw++] = r.latency_us / 1e3f;
+			break;
+		case EV_RESULT: {
+			int c = (r.flags >> 1) - 1;
+			if (r.flags & 1)
+				accepted++;
+			else if (c >= 0 && c < REJECT_REASONS)
+				rejects[c]++;
+			if (r.latency_us)
+				sub[nsub++] = r.latency_us / 1e3f;
+			break;
+		}
+		case EV_DROP:
+			if (r.flags < ARRAY_SIZE(drops))
+				drops[r.flags]++;
+			break;
+		case EV_LOST:
+			lost += r.id;
+			break;
+		}
+	}
+	fclose(f);
+
+	printf("%s: %s, %.0f s of events\n", path, hd.algo, last > first ? (last - first) / 1e6 : 0.);
+	printf("jobs %u, switches %u, found %u, submitted %u, answered %u\n",
+		count[EV_JOB], count[EV_SWITCH], count[EV_FOUND], count[EV_SUBMIT], count[EV_RESULT]);
+	printf("accepted %u, rejected", accepted);
+	for (i = 0; i < REJECT_REASONS; i++)
+		printf(" %s %u", stats_reject_names[i], rejects[i]);
+	printf("\ndropped");
+	for (i = 0; i < ARRAY_SIZE(drops); i++)
+		printf(" %s %u", drop_names[i], drops[i]);
+	printf(", unanswered %d, lost records %u\n",
+		(int) count[EV_SUBMIT] - (int) count[EV_RESULT], lost);
+	if (count[EV_FOUND])
+		printf("efficiency %.2f%% of the found shares accepted\n", 100. * accepted / count[EV_FOUND]);
+	print_latency("submit latency", sub, nsub);
+	print_latency("job switch", sw, nsw);
+
+	free(sub);
+	free(sw);
+	return 0;
+}
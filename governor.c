@@ -0,0 +1,146 @@
+/**
+ * Closed loop thermal/power governor
+ *
+ * A PID controller turns the distance to the --temp-target (hottest
+ * core) or --power-target (rapl package watts) setpoint into a mining
+ * level between 0 and 1. The level is spread on the miner threads:
+ * level * threads gives the number of active threads, the remaining
+ * fraction becomes a duty cycle applied to each of them, which keeps
+ * the heat steady instead of the on/off pattern of --max-temp.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+
+#include "miner.h"
+
+double opt_temp_target = 0.0;
+double opt_power_target = 0.0;
+
+struct governor_state governor = { 0 };
+
+/* gains apply to the relative error (setpoint - value) / setpoint */
+#define GOV_KP 2.0
+#define GOV_KI 0.5
+#define GOV_KD 1.0
+#define GOV_MIN_LEVEL 0.02
+#define GOV_MIN_DUTY 50 /* permille */
+
+static void governor_apply(double level)
+{
+	double total = level * opt_n_threads;
+	int threads = (int) ceil(total);
+	int duty;
+
+	if (threads < 1)
+		threads = 1;
+	if (threads > opt_n_threads)
+		threads = opt_n_threads;
+	duty = (int) (1000. * total / threads);
+	if (duty > 1000) duty = 1000;
+	if (duty < GOV_MIN_DUTY) duty = GOV_MIN_DUTY;
+
+	governor.level = level;
+	governor.threads = threads;
+	governor.duty = duty;
+}
+
+bool governor_init(void)
+{
+	struct sensors_snapshot sensors;
+
+	governor.power = (opt_power_target > 0.0);
+	governor.setpoint = governor.power ? opt_power_target : opt_temp_target;
+
+	sensors_read(&sensors);
+	if (governor.power && !sensors_have_power()) {
+		applog(LOG_ERR, "power target requires rapl (%s), check permissions",
+			"/sys/class/powercap");
+		return false;
+	}
+	if (!governor.power && sensors.max_temp <= 0.f) {
+		applog(LOG_ERR, "temperature target set but no cpu sensor was found");
+		return false;
+	}
+
+	governor.i = 1.0; // start at full speed
+	governor_apply(1.0);
+	governor.enabled = true;
+	return true;
+}
+
+void *governor_thread(void *userdata)
+{
+	struct thr_info *mythr = (struct thr_info*) userdata;
+	struct sensors_snapshot sensors;
+	uint32_t last_sample = 0;
+	double prev_value = 0.0;
+
+	while (governor.enabled) {
+		double dt = opt_sensor_interval / 1000.0;
+		double value, err, integral, level;
+
+		usleep(opt_sensor_interval * 1000);
+		sensors_read(&sensors);
+		if (sensors.samples == last_sample)
+			continue;
+		last_sample = sensors.samples;
+
+		value = governor.power ? sensors.power : sensors.max_temp;
+		if (value <= 0.0) // no reading (first rapl sample)
+			continue;
+		if (prev_value == 0.0)
+			prev_value = value;
+
+		err = (governor.setpoint - value) / governor.setpoint;
+		governor.p = GOV_KP * err;
+		// derivative on the measurement, no kick on setpoint changes
+		governor.d = -GOV_KD * (value - prev_value) / governor.setpoint / dt;
+		prev_value = value;
+
+		// conditional integration to prevent windup when saturated
+		integral = governor.i + GOV_KI * err * dt;
+		level = governor.p + integral + governor.d;
+		if ((level < 1.0 || err < 0.0) && (level > GOV_MIN_LEVEL || err > 0.0))
+			governor.i = fmin(1.0, fmax(GOV_MIN_LEVEL, integral));
+		level = governor.p + governor.i + governor.d;
+		level = fmin(1.0, fmax(GOV_MIN_LEVEL, level));
+
+		governor.value = value;
+		governor_apply(level);
+
+		if (opt_debug)
+			applog(LOG_DEBUG, "governor: %.1f%s, level %.2f, %d threads at %d%%",
+				value, governor.power ? "W" : "C", level,
+				governor.threads, governor.duty / 10);
+	}
+
+	tq_freeze(mythr->q);
+	return NULL;
+}
+
+/* thread ids above the active count stay idle */
+bool governor_parked(int thr_id)
+{
+	return governor.enabled && thr_id >= governor.threads;
+}
+
+/* pause after a scan slice for the time needed to respect the duty cycle */
+void governor_throttle(int thr_id, const struct timeval *busy)
+{
+	int duty = governor.duty;
+	uint64_t busy_us, idle_us;
+
+	if (!governor.enabled || duty >= 1000 || duty <= 0)
+		return;
+
+	busy_us = (uint64_t) busy->tv_sec * 1000000 + busy->tv_usec;
+	idle_us = busy_us * (1000 - duty) / duty;
+	if (idle_us > 1000000)
+		idle_us = 1000000;
+	if (idle_us && !work_restart[thr_id].restart)
+		usleep((unsigned int) idle_us);
+}
@@ -0,0 +1,361 @@
+/**
+ * Asynchronous applog()
+ *
+ * Each thread formats its messages in its own single producer ring, the
+ * log thread merges the rings in order every 50 ms and does the terminal
+ * or syslog writes, with one fflush per batch. A producer never waits:
+ * a full ring drops the message. In the miner threads, a message class
+ * (its format string) logged more than LOG_RATE times a second is also
+ * suppressed, errors excepted. Both are counted and reported. Messages
+ * logged before log_init(), too long for a slot or from a thread without
+ * ring are written directly.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include <signal.h>
+#ifndef WIN32
+#include <unistd.h>
+#endif
+
+#include "miner.h"
+
+#define LOG_RING 64     /* messages per thread, power of 2 */
+#define LOG_RINGS 64
+#define LOG_TEXT 232
+#define LOG_CLASSES 16
+#define LOG_RATE 20     /* messages per class, thread and second */
+
+struct log_msg {
+	uint64_t seq;
+	time_t time;
+	int prio;
+	char text[LOG_TEXT];
+};
+
+struct log_class {
+	const char *fmt;
+	time_t sec;
+	uint32_t count;
+	uint32_t suppressed;
+};
+
+struct log_ring {
+	volatile uint32_t head; /* producer */
+	char pad1[60];
+	volatile uint32_t tail; /* log thread */
+	char pad2[60];
+	volatile uint32_t dropped;
+	volatile uint32_t suppressed;
+	uint32_t dropped_seen;  /* log thread */
+	volatile bool in_use;
+	struct log_class classes[LOG_CLASSES];
+	struct log_msg msg[LOG_RING];
+};
+
+static struct log_ring *volatile rings[LOG_RINGS];
+static volatile int rings_used = 0;
+static volatile uint64_t log_seq = 0;
+static volatile bool log_running = false;
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t ring_key;
+static __thread struct log_ring *my_ring = NULL;
+static __thread bool my_ring_failed = false;
+static __thread bool my_rate_limit = false;
+
+static const char *log_color(int prio)
+{
+	if (!use_colors)
+		return "";
+	switch (prio) {
+		case LOG_ERR:     return CL_RED;
+		case LOG_WARNING: return CL_YLW;
+		case LOG_NOTICE:  return CL_WHT;
+		case LOG_DEBUG:   return CL_GRY;
+		case LOG_BLUE:    return CL_CYN;
+	}
+	return "";
+}
+
+static void log_write(int prio, time_t t, const char *text)
+{
+	/* the date is formatted once a second */
+	static __thread time_t last = 0;
+	static __thread char stamp[32];
+
+#ifdef HAVE_SYSLOG_H
+	if (use_syslog) {
+		syslog(prio == LOG_BLUE ? LOG_NOTICE : prio, "%s", text);
+		return;
+	}
+#endif
+	if (t != last) {
+		struct tm tm;
+		localtime_r(&t, &tm);
+		strftime(stamp, sizeof(stamp), "[%Y-%m-%d %H:%M:%S]", &tm);
+		last = t;
+	}
+	fprintf(stdout, "%s%s %s%s\n", stamp, log_color(prio), text, use_colors ? CL_N : "");
+}
+
+/* released at the thread exit, reused once empty */
+static void ring_release(void *ring)
+{
+	((struct log_ring*) ring)->in_use = false;
+}
+
+static struct log_ring *ring_get(void)
+{
+	struct log_ring *ring;
+	int i;
+
+	if (my_ring || my_ring_failed)
+		return my_ring;
+	for (i = 0; i < rings_used && i < LOG_RINGS; i++) {
+		ring = rings[i];
+		if (ring && !ring->in_use && ring->head == ring->tail
+			&& __sync_bool_compare_and_swap(&ring->in_use, false, true))
+			goto claimed;
+	}
+	i = __sync_fetch_and_add(&rings_used, 1);
+	if (i >= LOG_RINGS || !(ring = (struct log_ring*) calloc(1, sizeof(*ring)))) {
+		my_ring_failed = true;
+		return NULL;
+	}
+	ring->in_use = true;
+	rings[i] = ring;
+claimed:
+	memset(ring->classes, 0, sizeof(ring->classes));
+	pthread_setspecific(ring_key, ring);
+	my_ring = ring;
+	return ring;
+}
+
+static void ring_push(struct log_ring *ring, int prio, time_t t, const char *fmt, va_list ap)
+{
+	uint32_t head = ring->head;
+	struct log_msg *m;
+
+	if (head - ring->tail >= LOG_RING) {
+		ring->dropped++;
+		return;
+	}
+	m = &ring->msg[head & (LOG_RING - 1)];
+	m->seq = __sync_fetch_and_add(&log_seq, 1);
+	m->time = t;
+	m->prio = prio;
+	vsnprintf(m->text, LOG_TEXT, fmt, ap);
+	mem_barrier();
+	ring->head = head + 1;
+}
+
+static void ring_printf(struct log_ring *ring, int prio, time_t t, const char *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	ring_push(ring, prio, t, fmt, ap);
+	va_end(ap);
+}
+
+/* the format without its colors nor line breaks */
+static void class_name(char *out, size_t sz, const char *fmt)
+{
+	size_t n = 0;
+
+	while (*fmt && n < sz - 1) {
+		if (*fmt == '\x1B') {
+			while (*fmt && *fmt != 'm')
+				fmt++;
+			if (*fmt)
+				fmt++;
+			continue;
+		}
+		if (*fmt != '\n' && *fmt != '\r')
+			out[n++] = *fmt;
+		fmt++;
+	}
+	out[n] = '\0';
+}
+
+/* false if the class is over its rate, the suppressed count is logged once the next second */
+static bool class_allowed(struct log_ring *ring, int prio, time_t t, const char *fmt)
+{
+	struct log_class *c = &ring->classes[((uintptr_t) fmt >> 3) % LOG_CLASSES];
+
+	if (c->fmt != fmt) {
+		c->fmt = fmt;
+		c->sec = t;
+		c->count = 0;
+		c->suppressed = 0;
+	}
+	if (c->sec != t) {
+		if (c->suppressed) {
+			char name[80];
+			class_name(name, sizeof(name), fmt);
+			ring_printf(ring, prio, t, "%u messages suppressed like: %s", c->suppressed, name);
+		}
+		c->sec = t;
+		c->count = 0;
+		c->suppressed = 0;
+	}
+	if (++c->count <= LOG_RATE)
+		return true;
+	c->suppressed++;
+	ring->suppressed++;
+	return false;
+}
+
+static void log_direct(int prio, time_t t, const char *fmt, va_list ap)
+{
+	char text[1024];
+
+	vsnprintf(text, sizeof(text), fmt, ap);
+	pthread_mutex_lock(&applog_lock);
+	log_write(prio, t, text);
+	fflush(stdout);
+	pthread_mutex_unlock(&applog_lock);
+}
+
+void applog(int prio, const char *fmt, ...)
+{
+	struct log_ring *ring = log_running ? ring_get() : NULL;
+	time_t now = time(NULL);
+	va_list ap;
+
+	va_start(ap, fmt);
+	if (!ring) {
+		log_direct(prio, now, fmt, ap);
+	} else if (!my_rate_limit || prio == LOG_ERR || class_allowed(ring, prio, now, fmt)) {
+		va_list ap2;
+		va_copy(ap2, ap);
+		if (vsnprintf(NULL, 0, fmt, ap2) < LOG_TEXT) {
+			ring_push(ring, prio, now, fmt, ap);
+		} else {
+			// rare long message, after the queued ones
+			log_flush();
+			log_direct(prio, now, fmt, ap);
+		}
+		va_end(ap2);
+	}
+	va_end(ap);
+}
+
+/* writes the queued messages in order, then the drop counts */
+static void log_drain(void)
+{
+	uint32_t heads[LOG_RINGS];
+	int i, n;
+
+	n = rings_used < LOG_RINGS ? rings_used : LOG_RINGS;
+	for (i = 0; i < n; i++)
+		heads[i] = rings[i] ? rings[i]->head : 0;
+	mem_barrier();
+	while (1) {
+		struct log_msg *m = NULL;
+		int best = -1;
+		for (i = 0; i < n; i++) {
+			struct log_ring *ring = rings[i];
+			struct log_msg *c;
+			if (!ring || ring->tail == heads[i])
+				continue;
+			c = &ring->msg[ring->tail & (LOG_RING - 1)];
+			if (!m || c->seq < m->seq) {
+				m = c;
+				best = i;
+			}
+		}
+		if (best < 0)
+			break;
+		log_write(m->prio, m->time, m->text);
+		mem_barrier();
+		rings[best]->tail++;
+	}
+	for (i = 0; i < n; i++) {
+		struct log_ring *ring = rings[i];
+		char text[64];
+		if (!ring || ring->dropped == ring->dropped_seen)
+			continue;
+		snprintf(text, sizeof(text), "%u log messages dropped, the output is too slow",
+			ring->dropped - ring->dropped_seen);
+		log_write(LOG_WARNING, time(NULL), text);
+		ring->dropped_seen = ring->dropped;
+	}
+	fflush(stdout);
+}
+
+void log_flush(void)
+{
+	pthread_mutex_lock(&drain_lock);
+	log_drain();
+	pthread_mutex_unlock(&drain_lock);
+}
+
+/* a signal handler may exit while its thread flushes, do not wait forever */
+static void log_exit(void)
+{
+	int i;
+
+	for (i = 0; pthread_mutex_trylock(&drain_lock); i++) {
+		if (i == 100)
+			return;
+		usleep(2000);
+	}
+	log_drain();
+	pthread_mutex_unlock(&drain_lock);
+}
+
+static void *log_thread(void *arg)
+{
+#ifndef WIN32
+	/* the exit handlers flush the log, they must not run here */
+	sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	sigaddset(&set, SIGHUP);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+#endif
+	while (log_running) {
+		usleep(50 * 1000);
+		log_flush();
+	}
+	return NULL;
+}
+
+bool log_init(void)
+{
+	pthread_t thr;
+
+	if (pthread_key_create(&ring_key, ring_release))
+		return false;
+	log_running = true;
+	if (pthread_create(&thr, NULL, log_thread, NULL)) {
+		log_running = false;
+		return false;
+	}
+	pthread_detach(thr);
+	atexit(log_exit);
+	return true;
+}
+
+/* the hot loop messages of the calling thread are rate limited */
+void log_rate_limit(void)
+{
+	my_rate_limit = true;
+}
+
+void log_get_counts(uint32_t *dropped, uint32_t *suppressed)
+{
+	int i, n = rings_used < LOG_RINGS ? rings_used : LOG_RINGS;
+
+	*dropped = *suppressed = 0;
+	for (i = 0; i < n; i++) {
+		if (!rings[i])
+			continue;
+		*dropped += rings[i]->dropped;
+		*suppressed += rings[i]->suppressed;
+	}
+}
@@ -0,0 +1,213 @@
+/**
+ * Merkle root engine
+ *
+ * getblocktemplate: the tree of the previous template is kept with a
+ * copy of each transaction hex, a transaction found again at the same
+ * position is not decoded nor hashed again, and only the nodes above a
+ * change (plus the coinbase path) are recomputed, four at a time with
+ * the sse2/neon sha256 when available.
+ *
+ * stratum: the sha256 state of the coinbase bytes before the extranonce
+ * is computed once per job, each new extranonce2 only hashes the tail.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "miner.h"
+
+#define MERKLE_MAX_LEVELS 32
+
+/* out[i] = sha256d(in[2i] | in[2i+1]), out must not overlap in */
+void merkle_hash_pairs(uchar (*out)[32], const uchar (*in)[32], int pairs)
+{
+	int i = 0;
+#ifdef HAVE_SHA256_4WAY
+	if (sha256_use_4way()) {
+		uint32_t _ALIGN(16) S[4 * 8], T[4 * 8], B[4 * 16];
+		int w, l;
+		for (; i + 4 <= pairs; i += 4) {
+			for (l = 0; l < 4; l++)
+				for (w = 0; w < 16; w++)
+					B[w * 4 + l] = be32dec((uint32_t*) in[2 * (i + l)] + w);
+			sha256_init_4way(S);
+			sha256_transform_4way(S, B, 0);
+			// padding block of the 64 bytes messages
+			for (w = 0; w < 16; w++)
+				for (l = 0; l < 4; l++)
+					B[w * 4 + l] = w == 0 ? 0x80000000 : w == 15 ? 512 : 0;
+			sha256_transform_4way(S, B, 0);
+			// second pass on the 32 bytes digests
+			memcpy(B, S, sizeof(S));
+			for (w = 8; w < 16; w++)
+				for (l = 0; l < 4; l++)
+					B[w * 4 + l] = w == 8 ? 0x80000000 : w == 15 ? 256 : 0;
+			sha256_init_4way(T);
+			sha256_transform_4way(T, B, 0);
+			for (l = 0; l < 4; l++)
+				for (w = 0; w < 8; w++)
+					be32enc((uint32_t*) out[i + l] + w, T[w * 4 + l]);
+		}
+	}
+#endif
+	for (; i < pairs; i++)
+		sha256d(out[i], in[2 * i], 64);
+}
+
+/* sha256 state of the complete 64 bytes blocks of data[0..len) */
+void sha256d_prefix_init(struct sha256_prefix *p, const uchar *data, int len)
+{
+	uint32_t T[16];
+	int i, b;
+
+	sha256_init(p->state);
+	p->len = len & ~63;
+	for (b = 0; b < p->len; b += 64) {
+		for (i = 0; i < 16; i++)
+			T[i] = be32dec((uint32_t*) (data + b) + i);
+		sha256_transform(p->state, T, 0);
+	}
+}
+
+/* same as sha256d(hash, data, len), the prefix bytes are not hashed again */
+void sha256d_prefix_final(uchar *hash, const struct sha256_prefix *p, const uchar *data, int len)
+{
+	uint32_t S[16], T[16];
+	int i, r;
+
+	if (p->len > len) {
+		sha256d(hash, data, len);
+		return;
+	}
+	memcpy(S, p->state, 32);
+	for (r = len - p->len; r > -9; r -= 64) {
+		if (r < 64)
+			memset(T, 0, 64);
+		memcpy(T, data + len - r, r > 64 ? 64 : (r < 0 ? 0 : r));
+		if (r >= 0 && r < 64)
+			((uchar*) T)[r] = 0x80;
+		for (i = 0; i < 16; i++)
+			T[i] = be32dec(T + i);
+		if (r < 56)
+			T[15] = 8 * len;
+		sha256_transform(S, T, 0);
+	}
+	// second sha256 of the 32 bytes digest
+	S[8] = 0x80000000;
+	memset(S + 9, 0, 6 * sizeof(uint32_t));
+	S[15] = 256;
+	sha256_init(T);
+	sha256_transform(T, S, 0);
+	for (i = 0; i < 8; i++)
+		be32enc((uint32_t*) hash + i, T[i]);
+}
+
+/* gbt tree of the previous template */
+static struct {
+	int levels; // 0 if the tree is not valid
+	int leaves;
+	int alloc[MERKLE_MAX_LEVELS];
+	uchar (*node[MERKLE_MAX_LEVELS])[32];
+	char **txs; // transaction hex, index 0 (coinbase) is unused
+	int txs_alloc;
+} tree;
+
+static pthread_mutex_t tree_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static bool tree_level_reserve(int l, int n)
+{
+	if (n > tree.alloc[l]) {
+		uchar (*node)[32] = (uchar(*)[32]) realloc(tree.node[l], n * 32);
+		if (!node)
+			return false;
+		tree.node[l] = node;
+		tree.alloc[l] = n;
+	}
+	return true;
+}
+
+/**
+ * Merkle root of a getblocktemplate, coinbase hash and hex transactions
+ * (tx_hex[i] NULL is invalid), returns false on a decoding error
+ */
+bool merkle_gbt_root(uchar *root, const uchar *cbtx_hash, const char **tx_hex, int tx_count)
+{
+	uchar *tx = NULL;
+	size_t tx_alloc = 0;
+	int n = tx_count + 1, dirty, hashed = 0;
+	int i, l;
+	bool rc = false;
+
+	pthread_mutex_lock(&tree_lock);
+
+	if (!tree_level_reserve(0, n + 1))
+		goto out;
+	if (n > tree.txs_alloc) {
+		char **txs = (char**) realloc(tree.txs, n * sizeof(char*));
+		if (!txs)
+			goto out;
+		memset(txs + tree.txs_alloc, 0, (n - tree.txs_alloc) * sizeof(char*));
+		tree.txs = txs;
+		tree.txs_alloc = n;
+	}
+
+	// leaves, the unchanged prefix of the template is kept
+	dirty = !tree.levels ? 1 : n < tree.leaves ? n : tree.leaves;
+	tree.levels = 0;
+	memcpy(tree.node[0][0], cbtx_hash, 32);
+	for (i = 1; i < n; i++) {
+		const char *hex = tx_hex[i - 1];
+		size_t len = hex ? strlen(hex) : 0;
+		if (!len || (len & 1))
+			goto out;
+		// the whole hex is compared, a weak hash could be collided on purpose
+		if (i < dirty && tree.txs[i] && !strcmp(hex, tree.txs[i]))
+			continue;
+		if (i < dirty)
+			dirty = i;
+		free(tree.txs[i]);
+		tree.txs[i] = strdup(hex);
+		if (!tree.txs[i])
+			goto out;
+		if (len / 2 > tx_alloc) {
+			uchar *p = (uchar*) realloc(tx, len / 2);
+			if (!p)
+				goto out;
+			tx = p;
+			tx_alloc = len / 2;
+		}
+		if (!hex2bin(tx, hex, len / 2))
+			goto out;
+		sha256d(tree.node[0][i], tx, (int) (len / 2));
+		hashed++;
+	}
+	tree.leaves = n;
+
+	/**
+	 * levels: a parent is kept if both children were kept, so the nodes
+	 * from dirty / 2 on are hashed again, plus node 0 (coinbase path)
+	 */
+	for (l = 0; n > 1; l++) {
+		int parents = (n + 1) / 2;
+		if (l + 1 >= MERKLE_MAX_LEVELS || !tree_level_reserve(l + 1, parents + 1))
+			goto out;
+		if (n & 1)
+			memcpy(tree.node[l][n], tree.node[l][n - 1], 32);
+		dirty = dirty > 3 ? dirty / 2 : 1;
+		merkle_hash_pairs(tree.node[l + 1], tree.node[l], 1);
+		merkle_hash_pairs(tree.node[l + 1] + dirty, tree.node[l] + 2 * dirty, parents - dirty);
+		hashed += parents - dirty + 1;
+		n = parents;
+	}
+	tree.levels = l + 1;
+	memcpy(root, tree.node[l][0], 32);
+	rc = true;
+
+	if (opt_debug)
+		applog(LOG_DEBUG, "merkle: %d transactions, %d hashes", tx_count, hashed);
+out:
+	pthread_mutex_unlock(&tree_lock);
+	free(tx);
+	return rc;
+}
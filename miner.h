@@ -254,6 +254,8 @@ int scanhash_qubit(int thr_id, struct work *work, uint32_t max_nonce, uint64_t *
 int scanhash_rf256(int thr_id, struct work *work, uint32_t max_nonce, uint64_t *hashes_done);
 int scanhash_sha256d(int thr_id, struct work *work, uint32_t max_nonce, uint64_t *hashes_done);
 unsigned char *scrypt_buffer_alloc(int N);
+size_t scrypt_buffer_size(int N);
+int scrypt_lanes(void);
 int scanhash_scrypt(int thr_id, struct work *work, uint32_t max_nonce, uint64_t *hashes_done,
 					unsigned char *scratchbuf, uint32_t N);
 int scanhash_scryptjane(int Nfactor, int thr_id, struct work *work, uint32_t max_nonce, uint64_t *hashes_done);
@@ -330,9 +332,17 @@ struct thr_info {
 	struct cpu_info cpu;
 };
 
+#define STALE_HISTO_SLOTS 12 /* log2 ms buckets, last one is >= 1s */
+
 struct work_restart {
 	volatile uint8_t restart;
-	char padding[128 - sizeof(uint8_t)];
+	uint32_t stale_count;
+	uint32_t stale_histo[STALE_HISTO_SLOTS];
+	volatile uint64_t restart_us; /* set by restart_threads() */
+	uint64_t stale_total_us;
+	uint64_t stale_max_us;
+	uint64_t stale_last_us;
+	char padding[128 - 88]; /* keep one thread per cache line */
 };
 
 extern bool opt_debug;
@@ -360,9 +370,12 @@ extern struct thr_info *thr_info;
 extern int longpoll_thr_id;
 extern int stratum_thr_id;
 extern int api_thr_id;
+extern int sensors_thr_id;
+extern int governor_thr_id;
 extern int opt_n_threads;
 extern int num_cpus;
 extern struct work_restart *work_restart;
+extern int opt_switch_latency;
 extern uint32_t opt_work_size;
 extern double *thr_hashrates;
 extern uint64_t global_hashrate;
@@ -410,12 +423,19 @@ extern double net_hashrate;
 #define CL_WHT  "\x1B[01;37m" /* white */
 
 void applog(int prio, const char *fmt, ...);
+/* logger.c */
+bool log_init(void);
+void log_flush(void);
+void log_rate_limit(void);
+void log_get_counts(uint32_t *dropped, uint32_t *suppressed);
 void restart_threads(void);
+bool rpc_share_init(void);
 extern json_t *json_rpc_call(CURL *curl, const char *url, const char *userpass,
 	const char *rpc_req, int *curl_err, int flags);
 void bin2hex(char *s, const unsigned char *p, size_t len);
 char *abin2hex(const unsigned char *p, size_t len);
 bool hex2bin(unsigned char *p, const char *hexstr, size_t len);
+void hex_benchmark(void);
 bool jobj_binary(const json_t *obj, const char *key, void *buf, size_t buflen);
 int varint_encode(unsigned char *p, uint64_t n);
 size_t address_to_script(unsigned char *out, size_t outsz, const char *addr);
@@ -428,11 +448,238 @@ double hash_target_ratio(uint32_t* hash, uint32_t* target);
 void work_set_target_ratio(struct work* work, uint32_t* hash);
 
 void get_currentalgo(char* buf, int sz);
+void get_currentpool(char* buf, int sz);
+int get_currentkernel(char* buf, int sz);
+size_t get_currentscratch(void);
+uint64_t get_threadaffinity(int thr_id);
+
+/* pool and job of the api, see get_poolstate() */
+struct pool_state {
+	char url[256];
+	bool stratum;
+	bool connected;
+	time_t connected_at;
+	double ping_ms;
+	double notify_age_ms; /* -1 without job */
+	double diff;
+	int xnonce1_size;
+	int xnonce2_size;
+	char job_id[64];
+	int height;
+	bool clean;
+	char order[32]; /* of the x16r and gr like algos */
+};
+void get_poolstate(struct pool_state *ps);
+
+/* cpu-miner.c, scans outside of the miner threads (bench.c, selftest.c) */
+typedef void (*share_hash_t)(void *output, const void *input);
+share_hash_t share_hash_func(void);
+void algo_select(int algo);
+void algo_bench_work(struct work *work);
+bool algo_scratch_alloc(unsigned char **scratchbuf);
+int algo_scanhash(int thr_id, struct work *work, uint32_t max_nonce, uint64_t *hashes_done,
+	unsigned char *scratchbuf);
+
+bool algo_in_list(const char *list, const char *name);
+void get_defconfig_path(char *out, size_t bufsize, char *argv0);
+
+extern char *opt_config;
+extern int64_t opt_affinity;
+void affine_to_cpu_mask(int id, unsigned long mask);
+
+/* bench.c, see --bench-suite and --autotune */
+extern char *opt_bench_suite;
+extern char *opt_bench_algos;
+extern int opt_bench_time;
+extern bool opt_autotune;
+int bench_suite(void);
+void kernel_variant(int algo, char *buf, size_t sz);
+int kernel_lanes(int algo);
+int autotune(int algo, char *argv0);
+void autotune_apply(int algo, char *argv0);
+
+/* selftest.c, see --selftest */
+extern char *opt_selftest;
+extern uint64_t opt_selftest_seed;
+int selftest(void);
+
+/* replay.c, see --stratum-record and --replay */
+extern char *opt_record;
+extern char *opt_replay;
+extern double opt_replay_speed;
+bool record_open(const char *path);
+void record_line(int pool, const char *tag, const char *line);
+bool replay_start(void);
 bool has_aes_ni(void);
 void cpu_bestfeature(char *outbuf, size_t maxsz);
 void cpu_getname(char *outbuf, size_t maxsz);
 void cpu_getmodelid(char *outbuf, size_t maxsz);
 float cpu_temp(int core);
+uint32_t cpu_clock(int core);
+int cpu_fanpercent(void);
+bool proc_memory(double *virt, double *resident);
+
+#ifdef _MSC_VER
+#define mem_barrier() MemoryBarrier()
+#else
+#define mem_barrier() __sync_synchronize()
+#endif
+
+#define MAX_SENSORS 64
+
+/* sampled by sensors_thread(), see --sensor-interval */
+struct sensors_snapshot {
+	float temp;      /* package, or hottest core if unknown */
+	float max_temp;
+	uint32_t clock;  /* kHz */
+	int fan;
+	float power;     /* package watts (rapl), 0 if unknown */
+	uint32_t samples;
+	int sensors;
+	float core_temp[MAX_SENSORS];
+	time_t ts;
+};
+
+extern int opt_sensor_interval;
+void sensors_init(void);
+void sensors_read(struct sensors_snapshot *out);
+float sensors_cpu_temp(const struct sensors_snapshot *s, int cpu);
+void *sensors_thread(void *userdata);
+bool sensors_have_power(void);
+
+/* stats.c */
+#define STATS_EWMA 0
+bool stats_init(int threads);
+void stats_remember_speed(int thr_id, uint64_t hashes, const struct timeval *start,
+	const struct timeval *end);
+double stats_get_speed(int thr_id, int window);
+
+struct scan_stats {
+	double hashes;     /* since start */
+	uint32_t window;   /* nonces of the last scan slice */
+	double slice_ms;
+};
+void stats_remember_window(int thr_id, uint32_t nonces);
+void stats_get_scan(int thr_id, struct scan_stats *out);
+
+#define LATENCY_BUCKETS 12
+extern const double stats_latency_bounds[LATENCY_BUCKETS]; /* ms */
+struct latency_stats {
+	uint32_t count;
+	double total_ms;
+	double last_ms;
+	double max_ms;
+	uint32_t histo[LATENCY_BUCKETS + 1]; /* last one is over the bounds */
+};
+void stats_remember_submit(double latency);
+void stats_get_submit(struct latency_stats *out);
+void stats_remember_job(const struct timeval *notify);
+void stats_get_job(struct latency_stats *out);
+
+enum reject_reason {
+	REJECT_STALE = 0,
+	REJECT_DUPLICATE,
+	REJECT_LOWDIFF,
+	REJECT_OTHER,
+	REJECT_REASONS
+};
+extern const char *stats_reject_names[REJECT_REASONS];
+int stats_reject_class(const char *reason);
+void stats_remember_reject(const char *reason);
+void stats_get_rejects(uint32_t *counts);
+
+/* profile.c, see --enable-stage-profile */
+enum prof_stage {
+	PROF_BLAKE512 = 0, PROF_BMW512, PROF_GROESTL512, PROF_JH512, PROF_KECCAK512,
+	PROF_SKEIN512, PROF_LUFFA512, PROF_CUBEHASH512, PROF_SHAVITE512, PROF_SIMD512,
+	PROF_ECHO512, PROF_HAMSI512, PROF_FUGUE512, PROF_SHABAL512, PROF_WHIRLPOOL,
+	PROF_SHA512, PROF_HAVAL256,
+	PROF_BLAKE256, PROF_KECCAK256, PROF_CUBEHASH256, PROF_SKEIN256, PROF_GROESTL256,
+	PROF_CN_DARK, PROF_CN_DARKLITE, PROF_CN_FAST, PROF_CN_LITE, PROF_CN_TURTLE,
+	PROF_CN_TURTLELITE,
+	PROF_LYRA2, PROF_YESPOWER,
+	PROF_STAGES
+};
+
+struct prof_stats {
+	uint64_t count;
+	uint64_t ticks;
+	double avg;
+	uint64_t p50, p99; /* upper bound of the log2 bucket */
+	double rate;       /* ticks per us */
+};
+
+struct prof_thread;
+extern bool opt_stage_profile;
+extern __thread struct prof_thread *prof_self;
+extern const char *prof_stage_names[PROF_STAGES];
+bool prof_init(int threads);
+void prof_thread_init(int thr_id);
+uint64_t prof_cycles(void);
+uint64_t prof_record(int stage, uint64_t start);
+bool prof_get(int thr_id, int stage, struct prof_stats *out);
+void prof_report(void);
+
+#ifdef USE_STAGE_PROFILE
+#define PROF_START() uint64_t prof_t0 = prof_self ? prof_cycles() : 0
+#define PROF_STAGE(s) do { if (prof_self) prof_t0 = prof_record(s, prof_t0); } while (0)
+#else
+#define PROF_START() do { } while (0)
+#define PROF_STAGE(s) do { } while (0)
+#endif
+
+/* shares.c */
+bool share_seen(const struct work *work);
+void share_invalid(void);
+void shares_get_filtered(uint32_t *dups, uint32_t *invalid);
+
+/* governor.c, see --temp-target and --power-target */
+struct governor_state {
+	bool enabled;
+	bool power;       /* package watts setpoint, else hottest core temp */
+	double setpoint;
+	double value;
+	double level;     /* 0..1, fraction of the full speed */
+	double p, i, d;
+	volatile int threads; /* active miner threads */
+	volatile int duty;    /* permille of time spent hashing */
+};
+
+extern double opt_temp_target;
+extern double opt_power_target;
+extern struct governor_state governor;
+bool governor_init(void);
+void *governor_thread(void *userdata);
+bool governor_parked(int thr_id);
+void governor_throttle(int thr_id, const struct timeval *busy);
+
+/* events.c, see --event-log */
+enum event_type {
+	EV_JOB = 1,   /* stratum notify */
+	EV_SWITCH,    /* first scan of a thread on a job */
+	EV_FOUND,     /* share found by a miner thread */
+	EV_SUBMIT,    /* share queued to the pool */
+	EV_RESULT,    /* pool answer */
+	EV_DROP,      /* share dropped before the submit */
+	EV_LOST       /* records dropped by a full ring */
+};
+
+enum event_drop {
+	DROP_STALE = 0,
+	DROP_DUPLICATE,
+	DROP_INVALID,
+	DROP_POOL
+};
+
+extern char *opt_event_log;
+bool events_open(const char *path);
+void *events_thread(void *userdata);
+void events_close(void);
+void events_job(int pool_id, const char *job_id, size_t len, bool clean);
+void events_switch(int thr_id, const struct work *work, double latency);
+void events_share(int type, int thr_id, const struct work *work, int arg);
+void events_result(int pool_id, int id, bool accepted, const char *reason, double latency);
+int events_read(const char *path);
 
 struct work {
 	uint32_t data[48];
@@ -450,15 +697,35 @@ struct work {
 	char *job_id;
 	size_t xnonce2_len;
 	unsigned char *xnonce2;
+	int pool_id;
+	struct timeval tv_notify;
+
+	uint32_t vr_mask; // version bits the miner may roll (bip310)
+	uint32_t rolls; // local header rolls, version bits then ntime
+	uint32_t roll_base[2]; // version and ntime of the job
 };
 
+/* merkle.c */
+struct sha256_prefix {
+	uint32_t state[8];
+	int len;
+};
+void sha256d_prefix_init(struct sha256_prefix *p, const unsigned char *data, int len);
+void sha256d_prefix_final(unsigned char *hash, const struct sha256_prefix *p,
+	const unsigned char *data, int len);
+void merkle_hash_pairs(unsigned char (*out)[32], const unsigned char (*in)[32], int pairs);
+bool merkle_gbt_root(unsigned char *root, const unsigned char *cbtx_hash,
+	const char **tx_hex, int tx_count);
+
 struct stratum_job {
 	char *job_id;
 	unsigned char prevhash[32];
 	size_t coinbase_size;
+	size_t coinbase_alloc;
 	unsigned char *coinbase;
 	unsigned char *xnonce2;
 	int merkle_count;
+	int merkle_alloc;
 	unsigned char **merkle;
 	unsigned char version[4];
 	unsigned char nbits[4];
@@ -466,6 +733,8 @@ struct stratum_job {
 	unsigned char extra[64]; // like lbry claimtrie
 	bool clean;
 	double diff;
+	struct timeval tv_notify;
+	struct sha256_prefix coinbase_prefix; // bytes before the extranonce
 };
 
 struct stratum_ctx {
@@ -477,8 +746,21 @@ struct stratum_ctx {
 	curl_socket_t sock;
 	size_t sockbuf_size;
 	char *sockbuf;
+	size_t sockbuf_head; // first unread byte
+	size_t sockbuf_tail; // end of received data
+	size_t sockbuf_scan; // bytes after head known to hold no newline
 	pthread_mutex_t sock_lock;
 
+	// event loop of the pool thread, other threads queue their lines (linux)
+	bool evloop;
+	int epoll_fd;
+	int wake_fd;
+	char *outbox;
+	size_t outbox_len;
+	size_t outbox_size;
+	char *outbox_spare;
+	size_t outbox_spare_size;
+
 	double next_diff;
 	double sharediff;
 
@@ -491,16 +773,32 @@ struct stratum_ctx {
 	pthread_mutex_t work_lock;
 
 	int bloc_height;
+
+	int pool_id;
+	uint32_t notify_count;
+	time_t tm_connected;
+	double ping_ms; // subscribe round trip
+	volatile bool standby; // failover session, do not restart the miners
+	uint32_t vr_mask; // version rolling mask granted by the pool
+	char *vr_noanswer; // url which did not answer mining.configure, not asked again
 };
 
 bool stratum_socket_full(struct stratum_ctx *sctx, int timeout);
+bool stratum_wait(struct stratum_ctx *sctx, int timeout);
 bool stratum_send_line(struct stratum_ctx *sctx, char *s);
+bool stratum_queue_line(struct stratum_ctx *sctx, const char *s);
 char *stratum_recv_line(struct stratum_ctx *sctx);
+char *stratum_recv_line_view(struct stratum_ctx *sctx, size_t *len);
 bool stratum_connect(struct stratum_ctx *sctx, const char *url);
 void stratum_disconnect(struct stratum_ctx *sctx);
+#define VERSION_ROLLING_MASK 0x1fffe000 /* bip320 general purpose bits */
+#define STRATUM_CONFIGURE_ID 0 /* handshake ids are below 4, the shares above */
+bool stratum_configure(struct stratum_ctx *sctx);
+bool stratum_configure_answer(struct stratum_ctx *sctx, const json_t *val);
 bool stratum_subscribe(struct stratum_ctx *sctx);
 bool stratum_authorize(struct stratum_ctx *sctx, const char *user, const char *pass);
 bool stratum_handle_method(struct stratum_ctx *sctx, const char *s);
+bool stratum_parse_submit_answer(const char *s, int *id, int *result, char *reason, size_t reason_size);
 
 /* rpc 2.0 (xmr) */
 extern bool jsonrpc_2;
@@ -540,6 +838,7 @@ void print_hash_tests(void);
 
 void sha256d(unsigned char *hash, const unsigned char *data, int len);
 void allium_hash(void *state, const void *input);
+void anime_hash(const char* input, char* output, uint32_t len);
 void axiomhash(void *state, const void *input);
 void bastionhash(void *output, const void *input);
 void blakehash(void *state, const void *input);
@@ -549,13 +848,17 @@ void blake2s_hash(void *output, const void *input);
 void bmwhash(void *output, const void *input);
 void bmw512_hash(void *output, const void *input);
 void c11hash(void *output, const void *input);
+void curvehash(void *output, const void *input);
 void decred_hash(void *output, const void *input);
+void decred_hash_simple(void *output, const void *input);
+void dedal_hash(const char* input, char* output, uint32_t len);
 void droplp_hash(void *output, const void *input);
 void groestlhash(void *output, const void *input);
 void heavyhash(unsigned char* output, const unsigned char* input, int len);
 void quarkhash(void *state, const void *input);
 void freshhash(void* output, const void* input, uint32_t len);
 void geekhash(void *output, const void *input);
+void gr_hash(const char* input, char* output, uint32_t len);
 void keccakhash(void *state, const void *input);
 void inkhash(void *state, const void *input); /* shavite */
 void jha_hash(void *output, const void *input);
@@ -566,6 +869,7 @@ void lyra2rev2_hash(void *state, const void *input);
 void lyra2v3_hash(void *state, const void *input);
 void megabtx_hash(const char* input, char* output, uint32_t len);
 void meme_hash(const char* input, char* output, uint32_t len);
+void mike_hash(const char* input, char* output, uint32_t len);
 void minotaurhash(void *output, const void *input, bool minotaurX);
 void myriadhash(void *output, const void *input);
 void neoscrypt(unsigned char *output, const unsigned char *password, uint32_t profile);
@@ -574,6 +878,7 @@ void phi1612_hash(void *state, const void *input);
 void phi2_hash(void *state, const void *input);
 void pluck_hash(uint32_t *hash, const uint32_t *data, uchar *hashbuffer, const int N);
 void pentablakehash(void *output, const void *input);
+void power2b_hash(const char *input, char *output, uint32_t len);
 void qubithash(void *output, const void *input);
 void rf256_hash(void *out, const void *in, size_t len);
 void scrypthash(void *output, const void *input, uint32_t N);
@@ -581,6 +886,7 @@ void scryptjanehash(void *output, const void *input, uint32_t Nfactor);
 void sibhash(void *output, const void *input);
 void skeinhash(void *state, const void *input);
 void skein2hash(void *state, const void *input);
+void skunk_hash(const char *input, char* output, uint32_t len);
 void sonoa_hash(void *output, const void *input);
 void skydoge_hash(const char* input, char* output, uint32_t len);
 void s3hash(void *output, const void *input);
@@ -588,6 +894,7 @@ void timetravel_hash(void *output, const void *input);
 void bitcore_hash(void *output, const void *input);
 void tribus_hash(void *output, const void *input);
 void veltor_hash(void *output, const void *input);
+void xelisv2hash(void *output, const void *input);
 void xevan_hash(void *output, const void *input);
 void x11evo_hash(void *output, const void *input);
 void x11hash(void *output, const void *input);
@@ -601,8 +908,25 @@ void x16s_hash(void *output, const void *input);
 void x17hash(void *output, const void *input);
 void hash0x10(void *output, const void *input);
 void x20r_hash(void *output, const void *input);
+void x16r_hash_order(const void *input, char *output);
+void x16rv2_hash_order(const void *input, char *output);
+void x16s_hash_order(const void *input, char *output);
+void x20r_hash_order(const void *input, char *output);
+void gr_hash_order(const void *input, char *output);
 void zr5hash(void *output, const void *input);
 void yescrypthash(void *output, const void *input);
+void yespower_hash(const char *input, char *output, uint32_t len);
+void yespowerIC_hash(const char *input, char *output, uint32_t len);
+void yespowerIOTS_hash(const char *input, char *output, uint32_t len);
+void yespowerITC_hash(const char *input, char *output, uint32_t len);
+void yespowerLITB_hash(const char *input, char *output, uint32_t len);
+void yespowerLNC_hash(const char *input, char *output, uint32_t len);
+void yespowerMGPC_hash(const char *input, char *output, uint32_t len);
+void yespowerR16_hash(const char *input, char *output, uint32_t len);
+void yespowerSUGAR_hash(const char *input, char *output, uint32_t len);
+void yespowerTIDE_hash(const char *input, char *output, uint32_t len);
+void yespowerURX_hash(const char *input, char *output, uint32_t len);
+void cpupower_hash(const char *input, char *output, uint32_t len);
 void yescrypt_hash_r8(const char* input, char* output, uint32_t len);
 void yescrypt_hash_r16(const char* input, char* output, uint32_t len);
 void yescrypt_hash_r32(const char* input, char* output, uint32_t len);
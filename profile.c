@@ -0,0 +1,185 @@
+/**
+ * Stage profiler of the chained hashes
+ *
+ * Built with --enable-stage-profile, enabled with --stage-profile. The
+ * hash functions mark the end of each primitive with PROF_STAGE(), the
+ * cycles (rdtsc, cntvct on arm64) spent since the previous mark go in a
+ * log2 histogram owned by the miner thread, no lock nor atomic on the
+ * hot path. The readers only sum the thread slots.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#include "miner.h"
+
+#define PROF_HISTO 40 /* log2 buckets of ticks */
+
+const char *prof_stage_names[PROF_STAGES] = {
+	"blake512", "bmw512", "groestl512", "jh512", "keccak512", "skein512",
+	"luffa512", "cubehash512", "shavite512", "simd512", "echo512", "hamsi512",
+	"fugue512", "shabal512", "whirlpool", "sha512", "haval256",
+	"blake256", "keccak256", "cubehash256", "skein256", "groestl256",
+	"cn-dark", "cn-darklite", "cn-fast", "cn-lite", "cn-turtle", "cn-turtlelite",
+	"lyra2", "yespower"
+};
+
+struct prof_slot {
+	uint64_t count;
+	uint64_t ticks;
+	uint32_t histo[PROF_HISTO];
+};
+
+struct prof_thread {
+	struct prof_slot slot[PROF_STAGES];
+	char padding[64];
+};
+
+bool opt_stage_profile = false;
+__thread struct prof_thread *prof_self = NULL;
+
+static struct prof_thread *prof_threads = NULL;
+static int prof_count = 0;
+static uint64_t prof_ticks0, prof_us0;
+
+uint64_t prof_cycles(void)
+{
+#if defined(_MSC_VER)
+	return __rdtsc();
+#elif defined(__x86_64__) || defined(__i386__)
+	uint32_t lo, hi;
+	__asm__ __volatile__("rdtsc" : "=a" (lo), "=d" (hi));
+	return ((uint64_t) hi << 32) | lo;
+#elif defined(__aarch64__)
+	uint64_t v;
+	__asm__ __volatile__("mrs %0, cntvct_el0" : "=r" (v));
+	return v;
+#else
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+
+static uint64_t now_us(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+bool prof_init(int threads)
+{
+	if (!opt_stage_profile)
+		return true;
+	prof_threads = (struct prof_thread*) calloc(threads, sizeof(struct prof_thread));
+	if (!prof_threads)
+		return false;
+	prof_count = threads;
+	prof_ticks0 = prof_cycles();
+	prof_us0 = now_us();
+	return true;
+}
+
+/* called by each miner thread, the hash functions record in its slot */
+void prof_thread_init(int thr_id)
+{
+	if (prof_threads && thr_id >= 0 && thr_id < prof_count)
+		prof_self = &prof_threads[thr_id];
+}
+
+uint64_t prof_record(int stage, uint64_t start)
+{
+	uint64_t t = prof_cycles();
+	uint64_t d = t - start;
+	struct prof_slot *s = &prof_self->slot[stage];
+	int b = 0;
+
+	while (d >> b && b < PROF_HISTO - 1)
+		b++;
+	s->histo[b]++;
+	s->count++;
+	s->ticks += d;
+	// the next stage does not pay for the accounting above
+	return prof_cycles();
+}
+
+/* ticks per microsecond since prof_init() */
+static double prof_rate(void)
+{
+	uint64_t us = now_us() - prof_us0;
+	return us ? (double) (prof_cycles() - prof_ticks0) / us : 0.;
+}
+
+/* sum of a thread (or all with -1), false if there is nothing */
+bool prof_get(int thr_id, int stage, struct prof_stats *out)
+{
+	uint32_t histo[PROF_HISTO] = { 0 };
+	uint64_t n, half, tail;
+	int i, b;
+
+	memset(out, 0, sizeof(*out));
+	if (!prof_threads || stage < 0 || stage >= PROF_STAGES)
+		return false;
+	for (i = 0; i < prof_count; i++) {
+		struct prof_slot *s = &prof_threads[i].slot[stage];
+		if (thr_id >= 0 && i != thr_id)
+			continue;
+		out->count += s->count;
+		out->ticks += s->ticks;
+		for (b = 0; b < PROF_HISTO; b++)
+			histo[b] += s->histo[b];
+	}
+	if (!out->count)
+		return false;
+
+	// bucket b holds the values below 2^b ticks
+	half = out->count / 2;
+	tail = out->count / 100;
+	for (b = 0, n = 0; b < PROF_HISTO; b++) {
+		n += histo[b];
+		if (!out->p50 && n > half)
+			out->p50 = 1ULL << b;
+		if (n >= out->count - tail) {
+			out->p99 = 1ULL << b;
+			break;
+		}
+	}
+	out->avg = (double) out->ticks / out->count;
+	out->rate = prof_rate();
+	return true;
+}
+
+void prof_report(void)
+{
+	struct prof_stats st[PROF_STAGES];
+	uint64_t total = 0;
+	int i;
+
+	if (!prof_threads)
+		return;
+	for (i = 0; i < PROF_STAGES; i++) {
+		prof_get(-1, i, &st[i]);
+		total += st[i].ticks;
+	}
+	if (!total) {
+		applog(LOG_INFO, "Stage profile: no profiled stage for this algo");
+		return;
+	}
+	applog(LOG_INFO, "Stage profile (%.0f ticks/us), calls, avg ticks, p50, p99, share:",
+		prof_rate());
+	for (i = 0; i < PROF_STAGES; i++) {
+		if (!st[i].count)
+			continue;
+		applog(LOG_INFO, "%-14s %10llu %10.0f %8llu %8llu %5.1f%%", prof_stage_names[i],
+			(unsigned long long) st[i].count, st[i].avg,
+			(unsigned long long) st[i].p50, (unsigned long long) st[i].p99,
+			100. * st[i].ticks / total);
+	}
+}
@@ -0,0 +1,547 @@
+/**
+ * Stratum session recorder and replay, see --stratum-record and --replay
+ *
+ * The recorder writes the stratum traffic shown by --protocol-dump to a
+ * file, a line per message with the milliseconds since the first one and
+ * the pool number (0 is --url, then the --failover-url ones):
+ *
+ *   0 0 connect stratum+tcp://pool:3333
+ *   2 0 > {"id": 1, "method": "mining.subscribe", "params": ["..."]}
+ *   88 0 < {"id":1,"result":[...],"error":null}
+ *   90 0 < {"id":null,"method":"mining.notify","params":[...]}
+ *   61200 0 disconnect
+ *
+ * --replay serves the sessions of pool 0 to the miner on a local port,
+ * without network, the backup pools traffic is skipped. The pool lines
+ * are sent in their recorded order: a response once the miner sent the
+ * request of the same method, with its id, and
+ * a push at its recorded time divided by --replay-speed (0: at once). A
+ * disconnect closes the socket, the miner then reconnects to the next
+ * session of the file. The shares are accepted at once, the submits and
+ * the notify to first submit times are reported at the end of the file.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#ifndef WIN32
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+# define SOCKETTYPE long
+# define SOCKETFAIL(a) ((a) < 0)
+# define INVSOCK -1
+# define CLOSESOCKET close
+#else
+# include <winsock2.h>
+# define SOCKETTYPE SOCKET
+# define SOCKETFAIL(a) ((a) == SOCKET_ERROR)
+# define INVSOCK INVALID_SOCKET
+# define CLOSESOCKET closesocket
+# define poll(fds, n, t) WSAPoll(fds, n, t)
+#endif
+#ifndef MSG_NOSIGNAL
+# define MSG_NOSIGNAL 0
+#endif
+
+#include "miner.h"
+
+#define REPLAY_WAIT 10000  /* ms for a request of the script, else skipped */
+#define REPLAY_PENDING 16
+#define REPLAY_JOBS 64
+
+char *opt_record = NULL;
+char *opt_replay = NULL;
+double opt_replay_speed = 1.;
+
+static FILE *rec_file = NULL;
+static uint64_t rec_start = 0;
+static pthread_mutex_t rec_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t now_us(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+bool record_open(const char *path)
+{
+	rec_file = fopen(path, "a");
+	if (!rec_file) {
+		applog(LOG_ERR, "Unable to open the stratum record %s", path);
+		return false;
+	}
+	rec_start = now_us();
+	return true;
+}
+
+/* tag is ">" sent, "<" received, "connect" or "disconnect" */
+void record_line(int pool, const char *tag, const char *line)
+{
+	if (!rec_file)
+		return;
+	pthread_mutex_lock(&rec_lock);
+	fprintf(rec_file, "%llu %d %s%s%s\n", (unsigned long long) ((now_us() - rec_start) / 1000),
+		pool, tag, line ? " " : "", line ? line : "");
+	fflush(rec_file);
+	pthread_mutex_unlock(&rec_lock);
+}
+
+enum replay_type {
+	STEP_CONNECT,
+	STEP_DISCONNECT,
+	STEP_RESPONSE,   /* to the next request of method */
+	STEP_PUSH,       /* at ms */
+};
+
+struct replay_step {
+	uint64_t ms;
+	enum replay_type type;
+	char *method;
+	json_t *msg;
+};
+
+struct replay_request {
+	char *method;
+	json_t *id;
+};
+
+struct replay_job {
+	char id[64];
+	uint64_t notified;
+	bool submitted;
+};
+
+static struct replay_step *steps = NULL;
+static int nsteps = 0;
+static int replay_port = 0;
+static SOCKETTYPE listen_sock = INVSOCK;
+static SOCKETTYPE client = INVSOCK;
+
+static struct replay_request pending[REPLAY_PENDING];
+static int npending = 0;
+static char inbuf[64 * 1024];
+static size_t inlen = 0;
+
+static struct replay_job jobs[REPLAY_JOBS];
+static int njobs = 0;
+static float *lat = NULL;   /* ms from a notify to its first submit */
+static int nlat = 0, alat = 0;
+static int sessions = 0, notifies = 0, diffs = 0, submits = 0, skipped = 0;
+
+static bool step_add(uint64_t ms, enum replay_type type, const char *method, json_t *msg)
+{
+	// the record started in a session, open one
+	if (!nsteps && type != STEP_CONNECT && !step_add(ms, STEP_CONNECT, NULL, NULL))
+		return false;
+	if (!(nsteps & 255)) {
+		struct replay_step *s = (struct replay_step*) realloc(steps, (nsteps + 256) * sizeof(*s));
+		if (!s)
+			return false;
+		steps = s;
+	}
+	steps[nsteps].ms = ms;
+	steps[nsteps].type = type;
+	steps[nsteps].method = method ? strdup(method) : NULL;
+	steps[nsteps].msg = msg;
+	nsteps++;
+	return true;
+}
+
+/* the script of the pool side, the submit responses are made live */
+static bool replay_load(const char *path)
+{
+	json_t *methods = json_object(); /* request id -> method, per session */
+	char *buf, *line, *next;
+	long size;
+	FILE *f;
+	int n = 0;
+
+	f = fopen(path, "rb");
+	if (!f) {
+		applog(LOG_ERR, "Unable to open the stratum session %s", path);
+		return false;
+	}
+	fseek(f, 0, SEEK_END);
+	size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	buf = (char*) malloc(size + 1);
+	if (!buf || fread(buf, 1, size, f) != (size_t) size) {
+		fclose(f);
+		free(buf);
+		return false;
+	}
+	fclose(f);
+	buf[size] = '\0';
+
+	for (line = buf; line && *line; line = next) {
+		uint64_t ms;
+		char *p;
+		next = strchr(line, '\n');
+		if (next)
+			*next++ = '\0';
+		n++;
+		ms = strtoull(line, &p, 10);
+		if (p == line || *p++ != ' ')
+			continue;
+		if (*p >= '0' && *p <= '9') {
+			// pool number, absent in the older records
+			if (strtol(p, &p, 10) != 0 || *p++ != ' ')
+				continue;
+		}
+		if (!strncmp(p, "connect", 7)) {
+			json_object_clear(methods);
+			step_add(ms, STEP_CONNECT, NULL, NULL);
+		} else if (!strncmp(p, "disconnect", 10)) {
+			step_add(ms, STEP_DISCONNECT, NULL, NULL);
+		} else if (p[0] == '>' || p[0] == '<') {
+			json_error_t err;
+			json_t *val = json_loads(p + 2, 0, &err);
+			json_t *id;
+			const char *method;
+			char key[24];
+			if (!val) {
+				applog(LOG_WARNING, "%s:%d: %s", path, n, err.text);
+				continue;
+			}
+			method = json_string_value(json_object_get(val, "method"));
+			id = json_object_get(val, "id");
+			snprintf(key, sizeof(key), "%lld", (long long) json_integer_value(id));
+			if (p[0] == '>') {
+				if (method && json_is_integer(id))
+					json_object_set_new(methods, key, json_string(method));
+				json_decref(val);
+			} else if (method) {
+				step_add(ms, STEP_PUSH, method, val);
+			} else {
+				method = json_string_value(json_object_get(methods, key));
+				if (method && strcmp(method, "mining.submit"))
+					step_add(ms, STEP_RESPONSE, method, val);
+				else
+					json_decref(val);
+			}
+		}
+	}
+	free(buf);
+	json_decref(methods);
+	return nsteps > 0;
+}
+
+static bool replay_send(json_t *msg)
+{
+	char *s = json_dumps(msg, JSON_COMPACT | JSON_PRESERVE_ORDER);
+	size_t len, sent = 0;
+	bool ok = true;
+
+	if (!s)
+		return false;
+	len = strlen(s);
+	s[len++] = '\n'; /* over the nul */
+	while (sent < len) {
+		int n = send(client, s + sent, (int) (len - sent), MSG_NOSIGNAL);
+		if (n <= 0) {
+			ok = false;
+			break;
+		}
+		sent += n;
+	}
+	free(s);
+	return ok;
+}
+
+static void replay_close(void)
+{
+	int i;
+
+	if (client != INVSOCK)
+		CLOSESOCKET(client);
+	client = INVSOCK;
+	inlen = 0;
+	for (i = 0; i < npending; i++) {
+		free(pending[i].method);
+		json_decref(pending[i].id);
+	}
+	npending = 0;
+}
+
+static void replay_accept(void)
+{
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+
+	replay_close();
+	client = accept(listen_sock, (struct sockaddr*) &addr, &len);
+	if (SOCKETFAIL(client))
+		client = INVSOCK;
+}
+
+/* a step of this session will answer the method */
+static bool scripted(int from, const char *method)
+{
+	int i;
+
+	for (i = from; i < nsteps && steps[i].type != STEP_CONNECT; i++) {
+		if (steps[i].type == STEP_RESPONSE && !strcmp(steps[i].method, method))
+			return true;
+	}
+	return false;
+}
+
+static void answer(json_t *id, bool ok)
+{
+	json_t *res = json_object();
+
+	json_object_set(res, "id", id);
+	json_object_set_new(res, "result", json_boolean(ok));
+	json_object_set_new(res, "error", json_null());
+	replay_send(res);
+	json_decref(res);
+}
+
+static void on_submit(json_t *params)
+{
+	const char *job_id = json_string_value(json_array_get(params, 1));
+	int i;
+
+	submits++;
+	for (i = 0; job_id && i < njobs && i < REPLAY_JOBS; i++) {
+		struct replay_job *j = &jobs[i];
+		if (j->submitted || strcmp(j->id, job_id))
+			continue;
+		j->submitted = true;
+		if (nlat == alat) {
+			float *l = (float*) realloc(lat, (alat + 256) * sizeof(float));
+			if (!l)
+				break;
+			lat = l;
+			alat += 256;
+		}
+		lat[nlat++] = (float) ((now_us() - j->notified) / 1000.);
+		break;
+	}
+}
+
+/* the requests of the miner, queued for the script or answered */
+static void on_line(char *line, int step)
+{
+	json_t *val = json_loads(line, 0, NULL);
+	const char *method;
+	json_t *id;
+
+	if (!val)
+		return;
+	method = json_string_value(json_object_get(val, "method"));
+	id = json_object_get(val, "id");
+	if (!method || json_is_null(id)) {
+		// response to a push like client.get_version
+	} else if (!strcmp(method, "mining.submit")) {
+		on_submit(json_object_get(val, "params"));
+		answer(id, true);
+	} else if (scripted(step, method) && npending < REPLAY_PENDING) {
+		pending[npending].method = strdup(method);
+		pending[npending].id = json_incref(id);
+		npending++;
+	} else {
+		answer(id, true);
+	}
+	json_decref(val);
+}
+
+static int pending_find(const char *method)
+{
+	int k;
+
+	for (k = 0; k < npending; k++) {
+		if (!strcmp(pending[k].method, method))
+			return k;
+	}
+	return -1;
+}
+
+/* reads the miner until the deadline (us) or a queued request, false if it disconnected */
+static bool replay_serve(uint64_t deadline, int step)
+{
+	int queued = npending;
+
+	do {
+		struct pollfd pfd;
+		uint64_t now = now_us();
+		int timeout = deadline > now ? (int) ((deadline - now + 999) / 1000) : 0;
+		char *nl, *line;
+		int n;
+
+		if (client == INVSOCK)
+			return false;
+		pfd.fd = client;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		if (poll(&pfd, 1, timeout) <= 0)
+			continue;
+		n = recv(client, inbuf + inlen, (int) (sizeof(inbuf) - inlen - 1), 0);
+		if (n <= 0) {
+			replay_close();
+			return false;
+		}
+		inlen += n;
+		inbuf[inlen] = '\0';
+		for (line = inbuf; (nl = strchr(line, '\n')); line = nl + 1) {
+			*nl = '\0';
+			on_line(line, step);
+		}
+		inlen -= line - inbuf;
+		memmove(inbuf, line, inlen);
+		if (inlen == sizeof(inbuf) - 1)
+			inlen = 0; // no line break in 64k, drop it
+		if (npending > queued)
+			return true;
+	} while (now_us() < deadline);
+	return true;
+}
+
+static void on_push(struct replay_step *s)
+{
+	if (!strcmp(s->method, "mining.notify")) {
+		struct replay_job *j = &jobs[njobs++ % REPLAY_JOBS];
+		const char *id = json_string_value(json_array_get(json_object_get(s->msg, "params"), 0));
+		snprintf(j->id, sizeof(j->id), "%s", id ? id : "");
+		j->notified = now_us();
+		j->submitted = false;
+		notifies++;
+	} else if (!strcmp(s->method, "mining.set_difficulty")) {
+		diffs++;
+	} else if (!strcmp(s->method, "client.reconnect")) {
+		// back here, not to the recorded pool
+		json_t *params = json_array();
+		json_array_append_new(params, json_string("127.0.0.1"));
+		json_array_append_new(params, json_integer(replay_port));
+		json_object_set_new(s->msg, "params", params);
+	}
+}
+
+static int cmp_float(const void *a, const void *b)
+{
+	float x = *(const float*) a, y = *(const float*) b;
+	return x < y ? -1 : x > y;
+}
+
+static void replay_report(void)
+{
+	applog(LOG_NOTICE, "Replay done: %d sessions, %d notifies, %d difficulty changes, %d submits, %d steps skipped",
+		sessions, notifies, diffs, submits, skipped);
+	if (nlat) {
+		qsort(lat, nlat, sizeof(float), cmp_float);
+		applog(LOG_NOTICE, "Notify to first submit: p50 %.1f ms, p90 %.1f ms, max %.1f ms over %d jobs",
+			lat[nlat / 2], lat[nlat * 9 / 10], lat[nlat - 1], nlat);
+	}
+}
+
+static void *replay_thread(void *arg)
+{
+	uint64_t seg_start = 0, seg_ms = 0;
+	int i, k;
+
+	for (i = 0; i < nsteps; i++) {
+		struct replay_step *s = &steps[i];
+		uint64_t due;
+
+		switch (s->type) {
+		case STEP_CONNECT:
+			replay_accept();
+			if (client == INVSOCK) {
+				applog(LOG_ERR, "Replay accept failed");
+				proper_exit(1);
+			}
+			seg_start = now_us();
+			seg_ms = s->ms;
+			sessions++;
+			break;
+		case STEP_DISCONNECT:
+			replay_serve(now_us(), i);
+			replay_close();
+			break;
+		case STEP_PUSH:
+			due = opt_replay_speed > 0. ? seg_start + (uint64_t)
+				((s->ms - seg_ms) * 1000. / opt_replay_speed) : 0;
+			while (replay_serve(due, i) && now_us() < due)
+				;
+			if (client == INVSOCK)
+				goto lost;
+			on_push(s);
+			replay_send(s->msg);
+			break;
+		case STEP_RESPONSE:
+			due = now_us() + REPLAY_WAIT * 1000ULL;
+			while ((k = pending_find(s->method)) < 0 && now_us() < due && replay_serve(due, i))
+				;
+			if (client == INVSOCK)
+				goto lost;
+			if (k < 0) {
+				applog(LOG_WARNING, "Replay: no %s request, skipped", s->method);
+				skipped++;
+				break;
+			}
+			json_object_set(s->msg, "id", pending[k].id);
+			replay_send(s->msg);
+			free(pending[k].method);
+			json_decref(pending[k].id);
+			pending[k] = pending[--npending];
+			break;
+		}
+		continue;
+lost:
+		// the miner closed the session, go on with the next one
+		applog(LOG_WARNING, "Replay: the miner disconnected, next session");
+		while (i + 1 < nsteps && steps[i + 1].type != STEP_CONNECT) {
+			skipped++;
+			i++;
+		}
+	}
+	// the last shares
+	replay_serve(now_us() + 1000000, nsteps);
+	replay_close();
+	replay_report();
+	proper_exit(0);
+	return NULL;
+}
+
+/* the local pool, set as the url before the stratum thread starts */
+bool replay_start(void)
+{
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	pthread_t thr;
+	char url[64];
+
+	if (!replay_load(opt_replay))
+		return false;
+	listen_sock = socket(AF_INET, SOCK_STREAM, 0);
+	if (listen_sock == INVSOCK)
+		return false;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = 0;
+	if (SOCKETFAIL(bind(listen_sock, (struct sockaddr*) &addr, sizeof(addr)))
+		|| SOCKETFAIL(listen(listen_sock, 4))
+		|| SOCKETFAIL(getsockname(listen_sock, (struct sockaddr*) &addr, &len))) {
+		applog(LOG_ERR, "Replay socket setup failed");
+		CLOSESOCKET(listen_sock);
+		return false;
+	}
+	replay_port = ntohs(addr.sin_port);
+	snprintf(url, sizeof(url), "stratum+tcp://127.0.0.1:%d", replay_port);
+	parse_arg('o', url);
+	applog(LOG_INFO, "Replaying %d steps of %s on %s, speed %g", nsteps, opt_replay,
+		url, opt_replay_speed);
+	if (pthread_create(&thr, NULL, replay_thread, NULL)) {
+		CLOSESOCKET(listen_sock);
+		return false;
+	}
+	pthread_detach(thr);
+	return true;
+}
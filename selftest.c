@@ -0,0 +1,581 @@
+/**
+ * Known answer and differential tests of the hash kernels, see --selftest
+ *
+ * The reference hash of each algo (the single hash function used by
+ * --share-check, or a plain one without the kernel's midstate) is checked
+ * against a vector recorded from the scalar build. Then the scan kernel
+ * (midstate, 4/8-way, per job caches) scans random headers with an easy
+ * target and must find exactly the nonces the reference finds. The
+ * sha256 4/8-way transforms are also checked lane by lane against
+ * sha256_transform(). The seed of the random headers is logged, and
+ * --selftest-seed replays it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "miner.h"
+#include "res/algos.h"
+#include "sha3/sph_blake.h"
+#include "crypto/blake2b.h"
+
+#define SELFTEST_HEADERS 4
+#define SELFTEST_RANGE 64 /* nonces per header */
+#define SELFTEST_RANGE_SLOW 16
+#define SELFTEST_RANGE_TARGET16 0x10000
+
+#define POK_DATA_MASK 0xFFFF0000
+
+char *opt_selftest = NULL;
+uint64_t opt_selftest_seed = 0;
+
+struct selftest_vector {
+	int algo;
+	const char *hash; /* of the header bytes 0, 1, .. */
+	bool native;      /* the kernel hashes the data words without byte swap */
+	bool slow;        /* memory hard, scan a shorter range */
+	int words;        /* header length, 20 if 0 */
+	int nonce;        /* word of the nonce, 19 if 0 */
+	bool swapped;     /* the kernel counts a little endian nonce and reports it swapped */
+	bool target16;    /* the kernel skips hashes above 0xffff in the high word */
+};
+
+/* recorded with the scalar build, hash bytes in memory order */
+static const struct selftest_vector vectors[] = {
+	{ ALGO_ALLIUM,     "446c01d18f906d31eb89919cc1b1db3bdd46a8e0a554582049277e728263732d" },
+	{ ALGO_ANIME,      "17263b57e6e2bb93b78027c88b8cc02d5296c278c7dc9f8a6d3b1d55a7824a21" },
+	{ ALGO_AXIOM,      "d7d262b4da4f40f27d9ca8e1946a7eb428bb1262c1bbb881528918d22112e99f" },
+	{ ALGO_BASTION,    "626a4d038d5b3f1ef1c70c59005a4af42047c4030f654611641b2ed4154300ea" },
+	{ ALGO_BITCORE,    "63d2f805d948a0c15d3e5a3fa57074b4f146973a6ed388c7b2cb7c28945db67c" },
+	{ ALGO_BLAKE,      "0e0825862e20f04262ceac23bd1ed7b954ec1a27eb8a25f9a9dd694f9db5b831" },
+	{ ALGO_BLAKECOIN,  "9fec6acc5a18cff70add910dbe789b0d39a6ca3456aca5ee56f2282d1a8ac664" },
+	{ ALGO_BLAKE2B,    "066de1009daca2b8390a9dc734bce547ac4e3cc4531645bb8b9cbc0070941d88" },
+	{ ALGO_BLAKE2S,    "aff3b75f3f581264d7661662b92f5ad37c1d32bd45ff81a4ed8adc9ef30dd989" },
+	{ ALGO_BMW,        "57044d8df78b85ff8609e27383a8e4c1b29ca9389e20c2f688a8479bcc8b7a4a" },
+	{ ALGO_BMW512,     "c2d90cdec45e5c6ad8a5bcb775f982db1e80903cf7166f10303b2cb2cd4abb5b" },
+	{ ALGO_C11,        "1d779b963a8ad08b51f776862ae7c558e578fb3a3d5ce44b4f1d780b7fc2cd60" },
+	{ ALGO_CPUPOWER,   "eccdc49bdad6732ab7ad53deb66a18ecdad01011ab4c3979d6ad8d3139346873", .slow = true },
+	{ ALGO_CURVE,      "b2645416ce97cf3935592d82eaebf25212008ebf04f62373203a7153fa1e1466", .slow = true },
+	{ ALGO_DECRED,     "084765f66f70fb32d52a91a45bbca25867b9e130cfd1ae428b7803538f0d01be", .native = true, .words = 45, .nonce = 35 },
+	{ ALGO_DEDAL,      "8447e9510b0dab960ac6f5db23e1d9286133d8955844217176e9717746b02376" },
+	{ ALGO_DMD_GR,     "e273974c11312120ced9b3f366ac07f991fc79c87325309de3a28926c48e9165" },
+	{ ALGO_DROP,       "ada0cef4c4b370347f28bd6bfbf7046281721cc574332d4773f15842a8bfb765", .native = true },
+	{ ALGO_FRESH,      "72d9c7a5706c1665feeaf6c07a11b3a16b796cf347b7c1d43c9ff7572d617ad2" },
+	{ ALGO_GEEK,       "0c50fd0e21b43b2efd6c88ff8e8e726dcf14b6c63375f40c19a293ec3f718812" },
+	{ ALGO_GR,         "9dec762130a6ee4ba29f203501d7cfa370ebc85a75a47e29777b38399689ca77", .slow = true },
+	{ ALGO_GROESTL,    "e273974c11312120ced9b3f366ac07f991fc79c87325309de3a28926c48e9165" },
+	{ ALGO_HEAVY,      "c065c5c7f20551e65283fff7c7ab25e1835196759d3e06557ec3120ab5ee8a00", .native = true },
+	{ ALGO_JHA,        "1df9b366aaea1fc19159867b6ef96bccd49e797ed4854a141eb1f26c6d93e52b" },
+	{ ALGO_KECCAK,     "f0fe5c66fa31e6089ce5553a1bee59a71251a9801e1cbcd133353ce8079e085f" },
+	{ ALGO_KECCAKC,    "f0fe5c66fa31e6089ce5553a1bee59a71251a9801e1cbcd133353ce8079e085f" },
+	{ ALGO_LBRY,       "5896632aee5dc847a81deb60ba5a44faaedbee357ad44cf48f3f149809bc2cc3", .words = 28, .nonce = 27 },
+	{ ALGO_LUFFA,      "5224f8bc8335d5ea30e9aaa415eafb14b49f13921b5aaa085b5c9eb2ba4e6805" },
+	{ ALGO_LYRA2,      "dda1487831430df5d5fc1ee3a7bac672a13589dfdcf6a44efdc143a5c0202d10" },
+	{ ALGO_LYRA2REV2,  "2246faafca15a01a35c81a3f801fe8338942565bdb75a505517372aa0c7afdd0" },
+	{ ALGO_LYRA2V3,    "9015a1aa1cc961093e5b5d078ccc5fe527d41a19d9df6e8b12e7e6fdad8c590d" },
+	{ ALGO_MEGABTX,    "f80754fd0cb66de2eeb37c1d729d6149791b1adeeb15dda4688f759e39254448" },
+	{ ALGO_MEME,       "485298e7a6d6c3ced3b2b4f049b7410c94a9c1dea422280653468069c181d208" },
+	{ ALGO_MIKE,       "42398d1358fe5baaefc8de4c02bd47dc0817880683731eb5d54f5619524a7654", .slow = true },
+	{ ALGO_MINOTAUR,   "3e4fd43c1da961bfd7ed1ad5072e97cb6a63a7fa9b2b42f1f3145b1ab4d34aab", .slow = true },
+	{ ALGO_MINOTAURX,  "4880093482d770fa6d2ba0dc7f01d0dc5678d26ee6d4b030e3805e000b38eb8a", .slow = true },
+	{ ALGO_MYR_GR,     "f28596c452bcec2325350f94e909ef885404430394681803ac167499fd717416" },
+	{ ALGO_NEOSCRYPT,  "7258961afb33fd12d00cacb8d63f4f4f52bb6917043865dd24a08f578853122d", true },
+	{ ALGO_NIST5,      "613f61e8346b89ae0429f1d49108b588f3ad050de7f0ad13589bf75840e6e3d3" },
+	{ ALGO_PENTABLAKE, "e5e50ee555902ac9b3e4fab4d7be6b4c49800a7137ab57cf2060951de599f9e1" },
+	{ ALGO_PHI1612,    "fdce78d31dde26e31d8e198420841cb664d79b6fd417b74bbadf72ee0ff4e508" },
+	{ ALGO_PHI2,       "3e07dd62d58b9034e64e9c57274d0803ee410d09e59422e08ab6ba14241fdc34", .words = 36 },
+	{ ALGO_PLUCK,      "dcf7ec329b028ac09321fc8214c9fa0df82577b6460188b1653c62e38db2675c", .swapped = true },
+	{ ALGO_POWER2B,    "e893dbcb5ba5a47b31da405b166ac3975459266ffba533dd89a23091fd374724", .slow = true },
+	{ ALGO_QUARK,      "ae69759081f8ffa2913284f985c25eab7af8aaa39670419b03ac68afb3c75ece" },
+	{ ALGO_QUBIT,      "5f445fc9277a5af9e10c6d580bcec9e801a241e75e9734ce2acd3143db177c15" },
+	{ ALGO_RAINFOREST, "b7c4217ae65adc498f6cc9eab7e9f7886e739f6528d3f612d83873ddf2c4e094", .target16 = true },
+	{ ALGO_S3,         "ff596655d3c6707081968ad81480a26c36f189d01ba7f1bc5b92b0b9a23aebc7" },
+	{ ALGO_SCRYPT,     "674b57f6539541461171d7a3e004175b6e1022e20823b486c2392c8934692164", true },
+	{ ALGO_SCRYPTJANE, "3c1b8c5a545238efebd7c928078c2b79fde86379fabed49664ff526c2e3de6a1" },
+	{ ALGO_SHA256D,    "852c98044fb00507122ff63bda7b529566348fc204f72b00dff1afd7b40501e4" },
+	{ ALGO_SHAVITE3,   "92a5878b42a07983ae944237f9ea2c8661e82e3dd856f2ae0c6c9108a4446add" },
+	{ ALGO_SIA,        "8b55fc396323532b5597824fb13b0fcf3518e661dd1cb4b824d2424c691730b6", .native = true, .nonce = 8 },
+	{ ALGO_SIB,        "efa038c3416e1db6bb5edc728d8b1c2e82d9e3b70da06522199762b996372904" },
+	{ ALGO_SKEIN,      "4de841423eddf5bd7faa05470262cfa33a74caa8081254e412091a657a96bbe8" },
+	{ ALGO_SKEIN2,     "6b0d9d3bf2558dbdb29e2f0c93918c55ca995e899e032b59b9818b9c3629a5d3" },
+	{ ALGO_SKUNK,      "655d492bb7683c36ef0c083c51674224519348e9d7f9eabd3f710bfa707f7abd" },
+	{ ALGO_SKYDOGE,    "bcaaa42710dc9aa38d3e504e0ab594d26db301edb61bdd9b2a7ed983df602def" },
+	{ ALGO_SONOA,      "25aa086f4681c15ae22841d4ad4547f68765e4703334d9c262650ffc28656f00" },
+	{ ALGO_TIMETRAVEL, "eb22f5ce20d9f257bb204b7cf7aa8c944bcdf66bab949d6ba66cd7aa8a1aee65" },
+	{ ALGO_TRIBUS,     "83dd7a543b16df4c3de48c531e7dd4295aef287376caacdae5df8c5d84ff7068" },
+	{ ALGO_VANILLA,    "9fec6acc5a18cff70add910dbe789b0d39a6ca3456aca5ee56f2282d1a8ac664" },
+	{ ALGO_VELTOR,     "db782cc9523b545394975ef8365172b784b9ded235535437b8573e486e9391e6" },
+	{ ALGO_X11EVO,     "412e767aa9a39ee210ea9ce424de4ff5ee35e61a8c27506bc2365ff7d4e3ecce" },
+	{ ALGO_X11,        "412e767aa9a39ee210ea9ce424de4ff5ee35e61a8c27506bc2365ff7d4e3ecce" },
+	{ ALGO_X12,        "2bd1aa7cfa11ab0ee8cb58b2aa03c1f5798dfe7f3a0cd85eb1db9115fdcd330f" },
+	{ ALGO_X13,        "44e39c878aa74badd072b531b2fdf181051431053f486fc36435b347e3986dac" },
+	{ ALGO_X14,        "e499406b72e51e4f36d170c812482e24f3cfdffd1954f19751bcfd7176272410" },
+	{ ALGO_X15,        "3f6a85ad072244e1a7a045cc98541e96e446b4888a6b9d41c95035701489558d" },
+	{ ALGO_X16R,       "f8c4a73b0f1c5f0c39db569e9250dff51a8ba1410d7c6e741d739a534fc32177" },
+	{ ALGO_X16RV2,     "f5940c4f24a935758416bc6cb41b9d60f419151a173e878eb5029273f59f7925" },
+	{ ALGO_X16S,       "42ac438eef56d3b78df4707bd9f62705a6df6acb4dca1b48bb6d193ba9e79929" },
+	{ ALGO_X17,        "356809810d6297274297fd2027d25dc07724dc9de325d4248595cf388be9d646" },
+	{ ALGO_0X10,       "2771a9dab1e0b7f58da8ee0c9e892f750f7e796813092e907454190cd74c4c5d" },
+	{ ALGO_X20R,       "76369b1da540801a8c3e849561cb7c90ed403e34a4ed31ffa7153abad73bd7f0" },
+	{ ALGO_XELISV2,    "3aa28512939fc133eadd75d514ea0ce07df50b49ec82574d0e02ae88eb895b38" },
+	{ ALGO_XEVAN,      "ed78c0fd583a6296315da93ecf42fef37b737915b4f3bc8c457dd4266b2977c8" },
+	{ ALGO_YESCRYPT,   "ae955413ae874374e49bcce4d5476fde4903b10a1402377f8ed70adf5968d9f7" },
+	{ ALGO_YESCRYPTR8, "727148f2c0e778655717a92db8831aa1b241aefd7d1a51b4c7294c264ae82162", .slow = true },
+	{ ALGO_YESCRYPTR16, "03695508103955e53e70aa9914f5635c26e4a7321f25e2d800b3ca6695d7dd68", .slow = true },
+	{ ALGO_YESCRYPTR32, "b9c8ba8527fb47306ff753329a8c25c421450a24cec7df77b470f8ecc31d49ba", .slow = true },
+	{ ALGO_YESPOWER,   "925903a9c3c9e24f710d5b46e2a5efb72b0524d00aaa75af03bae616a1e5e389" },
+	{ ALGO_YESPOWERIC, "9fac7eb9ec542af38894cac6a5b40b7923e7a7d41d36a786cbbf1e3f59d84e0d", .slow = true },
+	{ ALGO_YESPOWERIOTS, "123abd31475e27c826374d937b6b22fcc0c267ed546b2ec82ec4cde4ecbc08cb", .slow = true },
+	{ ALGO_YESPOWERITC, "7784e71bf17909ede17f4ff1c41f70a5f8e323d5ebc3fec415099b7c2b447422", .slow = true },
+	{ ALGO_YESPOWERLITB, "bd08e690e8d965da38348dcca7e8e151a9344159184efc5aeea1b093df9f3d32", .slow = true },
+	{ ALGO_YESPOWERLNC, "d025953168b9e142eee01fa6954b90757621b404792a833ea3f0fd70a582ba0d", .slow = true },
+	{ ALGO_YESPOWER_MGPC, "4bfdc3337b48a50591bd573e1b71081ab5a0b1a0f5b3d2a0cd974d80c0461e3e", .slow = true },
+	{ ALGO_YESPOWERR16, "814dc9c0afb1db4d527125bcc7f6352724b78d11c2ed2a0bb1bddf8d18cef083", .slow = true },
+	{ ALGO_YESPOWERSUGAR, "ff438e2a4675a4d3f44d499aa953077aab87b91e4fb34dca0b1ded2f348f6be1", .slow = true },
+	{ ALGO_YESPOWERTIDE, "66cdd2fa32fd05c3c2bc8fc44744956c1ab17a929615a4062b7d4cbcf6afca6c", .slow = true },
+	{ ALGO_YESPOWERURX, "5b37646dac7f06624f38dc66b06edd50c33dae80cf25cc6bf7ff6b7baa5e3702", .slow = true },
+	{ ALGO_ZR5,        "fd017fb8ebb7a6f560937e7ee08ea22bcae2830552346bcf08360f4347799e97", .native = true },
+};
+
+static void scrypt_1024(void *output, const void *input)
+{
+	scrypthash(output, input, 1024);
+}
+
+static void scryptjane_5(void *output, const void *input)
+{
+	scryptjanehash(output, input, 5);
+}
+
+static void neoscrypt_80(void *output, const void *input)
+{
+	neoscrypt((uchar*) output, (const uchar*) input, 0x80000620);
+}
+
+static void pluck_128(void *output, const void *input)
+{
+	uchar *buf = (uchar*) malloc(128 * 1024);
+
+	if (!buf) {
+		memset(output, 0xff, 32);
+		return;
+	}
+	pluck_hash((uint32_t*) output, (const uint32_t*) input, buf, 128);
+	free(buf);
+}
+
+/* the (input, output, len) hashes over an 80 bytes header */
+#define SELFTEST_HASH_80(name, func) \
+static void name(void *output, const void *input) \
+{ \
+	func((const char*) input, (char*) output, 80); \
+}
+
+SELFTEST_HASH_80(anime_80, anime_hash)
+SELFTEST_HASH_80(cpupower_80, cpupower_hash)
+SELFTEST_HASH_80(dedal_80, dedal_hash)
+SELFTEST_HASH_80(gr_80, gr_hash)
+SELFTEST_HASH_80(megabtx_80, megabtx_hash)
+SELFTEST_HASH_80(meme_80, meme_hash)
+SELFTEST_HASH_80(mike_80, mike_hash)
+SELFTEST_HASH_80(power2b_80, power2b_hash)
+SELFTEST_HASH_80(skunk_80, skunk_hash)
+SELFTEST_HASH_80(skydoge_80, skydoge_hash)
+SELFTEST_HASH_80(yescryptr8_80, yescrypt_hash_r8)
+SELFTEST_HASH_80(yescryptr16_80, yescrypt_hash_r16)
+SELFTEST_HASH_80(yescryptr32_80, yescrypt_hash_r32)
+SELFTEST_HASH_80(yespower_80, yespower_hash)
+SELFTEST_HASH_80(yespowerIC_80, yespowerIC_hash)
+SELFTEST_HASH_80(yespowerIOTS_80, yespowerIOTS_hash)
+SELFTEST_HASH_80(yespowerITC_80, yespowerITC_hash)
+SELFTEST_HASH_80(yespowerLITB_80, yespowerLITB_hash)
+SELFTEST_HASH_80(yespowerLNC_80, yespowerLNC_hash)
+SELFTEST_HASH_80(yespowerMGPC_80, yespowerMGPC_hash)
+SELFTEST_HASH_80(yespowerR16_80, yespowerR16_hash)
+SELFTEST_HASH_80(yespowerSUGAR_80, yespowerSUGAR_hash)
+SELFTEST_HASH_80(yespowerTIDE_80, yespowerTIDE_hash)
+SELFTEST_HASH_80(yespowerURX_80, yespowerURX_hash)
+
+static void fresh_80(void *output, const void *input)
+{
+	freshhash(output, input, 80);
+}
+
+static void heavy_80(void *output, const void *input)
+{
+	heavyhash((uchar*) output, (const uchar*) input, 80);
+}
+
+static void minotaur_80(void *output, const void *input)
+{
+	minotaurhash(output, input, false);
+}
+
+static void minotaurx_80(void *output, const void *input)
+{
+	minotaurhash(output, input, true);
+}
+
+static void rf256_80(void *output, const void *input)
+{
+	rf256_hash(output, input, 80);
+}
+
+/* the kernels of blake, blakecoin and blake2b keep a per thread midstate */
+static void blake_80(void *output, const void *input)
+{
+	sph_blake256_context ctx;
+
+	sph_blake256_init(&ctx);
+	sph_blake256(&ctx, input, 80);
+	sph_blake256_close(&ctx, output);
+}
+
+void blakecoin_init(void *cc);
+void blakecoin(void *cc, const void *data, size_t len);
+void blakecoin_close(void *cc, void *dst);
+
+static void blakecoin_80(void *output, const void *input)
+{
+	sph_blake256_context ctx;
+
+	blakecoin_init(&ctx);
+	blakecoin(&ctx, input, 80);
+	blakecoin_close(&ctx, output);
+}
+
+static void blake2b_80(void *output, const void *input)
+{
+	blake2b_ctx ctx;
+
+	blake2b_init(&ctx, 32, NULL, 0);
+	blake2b_update(&ctx, input, 80);
+	blake2b_final(&ctx, output);
+}
+
+/* nbits is not hashed, the hash is compared byte swapped */
+static void sia_80(void *output, const void *input)
+{
+	uint32_t _ALIGN(64) data[20], hash[8];
+	uint32_t *out = (uint32_t*) output;
+	int i;
+
+	memcpy(data, input, 80);
+	data[11] = 0;
+	blake2b_80(hash, data);
+	for (i = 0; i < 8; i++)
+		out[i] = swab32(hash[7 - i]);
+}
+
+/* proof of knowledge: the high version bits are taken from the first hash */
+static void pok_80(void *output, const void *input, share_hash_t hash)
+{
+	uint32_t _ALIGN(64) data[20], vhash[8];
+	uint32_t pok;
+
+	memcpy(data, input, 80);
+	data[0] &= ~POK_DATA_MASK;
+	hash(vhash, data);
+	pok = data[0] | (vhash[0] & POK_DATA_MASK);
+	if (data[0] != pok) {
+		data[0] = pok;
+		hash(vhash, data);
+	}
+	memcpy(output, vhash, 32);
+}
+
+static void drop_80(void *output, const void *input)
+{
+	pok_80(output, input, droplp_hash);
+}
+
+static void zr5_80(void *output, const void *input)
+{
+	pok_80(output, input, zr5hash);
+}
+
+/* the algo must be selected */
+static share_hash_t selftest_hash(int algo)
+{
+	switch (algo) {
+	case ALGO_ANIME:         return anime_80;
+	case ALGO_BLAKE:         return blake_80;
+	case ALGO_BLAKECOIN:
+	case ALGO_VANILLA:       return blakecoin_80;
+	case ALGO_BLAKE2B:       return blake2b_80;
+	case ALGO_BLAKE2S:       return blake2s_hash;
+	case ALGO_CPUPOWER:      return cpupower_80;
+	case ALGO_CURVE:         return curvehash;
+	case ALGO_DECRED:        return decred_hash_simple;
+	case ALGO_DEDAL:         return dedal_80;
+	case ALGO_DMD_GR:        return groestlhash;
+	case ALGO_DROP:          return drop_80;
+	case ALGO_FRESH:         return fresh_80;
+	case ALGO_GR:            return gr_80;
+	case ALGO_HEAVY:         return heavy_80;
+	case ALGO_KECCAK:        return keccakhash;
+	case ALGO_LBRY:          return lbry_hash;
+	case ALGO_MEGABTX:       return megabtx_80;
+	case ALGO_MEME:          return meme_80;
+	case ALGO_MIKE:          return mike_80;
+	case ALGO_MINOTAUR:      return minotaur_80;
+	case ALGO_MINOTAURX:     return minotaurx_80;
+	case ALGO_NEOSCRYPT:     return neoscrypt_80;
+	case ALGO_PHI2:          return phi2_hash;
+	case ALGO_PLUCK:         return pluck_128;
+	case ALGO_POWER2B:       return power2b_80;
+	case ALGO_RAINFOREST:    return rf256_80;
+	case ALGO_SCRYPT:        return scrypt_1024;
+	case ALGO_SCRYPTJANE:    return scryptjane_5;
+	case ALGO_SIA:           return sia_80;
+	case ALGO_SKUNK:         return skunk_80;
+	case ALGO_SKYDOGE:       return skydoge_80;
+	case ALGO_XELISV2:       return xelisv2hash;
+	case ALGO_YESCRYPT:      return yescrypthash;
+	case ALGO_YESCRYPTR8:    return yescryptr8_80;
+	case ALGO_YESCRYPTR16:   return yescryptr16_80;
+	case ALGO_YESCRYPTR32:   return yescryptr32_80;
+	case ALGO_YESPOWER:      return yespower_80;
+	case ALGO_YESPOWERIC:    return yespowerIC_80;
+	case ALGO_YESPOWERIOTS:  return yespowerIOTS_80;
+	case ALGO_YESPOWERITC:   return yespowerITC_80;
+	case ALGO_YESPOWERLITB:  return yespowerLITB_80;
+	case ALGO_YESPOWERLNC:   return yespowerLNC_80;
+	case ALGO_YESPOWER_MGPC: return yespowerMGPC_80;
+	case ALGO_YESPOWERR16:   return yespowerR16_80;
+	case ALGO_YESPOWERSUGAR: return yespowerSUGAR_80;
+	case ALGO_YESPOWERTIDE:  return yespowerTIDE_80;
+	case ALGO_YESPOWERURX:   return yespowerURX_80;
+	case ALGO_ZR5:           return zr5_80;
+	default:                 return share_hash_func();
+	}
+}
+
+static int vector_words(const struct selftest_vector *v)
+{
+	return v->words ? v->words : 20;
+}
+
+static int vector_nonce(const struct selftest_vector *v)
+{
+	return v->nonce ? v->nonce : 19;
+}
+
+static uint32_t selftest_rand(uint64_t *s)
+{
+	*s ^= *s << 13;
+	*s ^= *s >> 7;
+	*s ^= *s << 17;
+	return (uint32_t) (*s >> 16);
+}
+
+static bool selftest_kat(const struct selftest_vector *v, share_hash_t hash)
+{
+	uchar _ALIGN(64) input[48 * 4];
+	uint32_t _ALIGN(64) out[16];
+	char hex[65];
+	int i;
+
+	memset(input, 0, sizeof(input));
+	for (i = 0; i < vector_words(v) * 4; i++)
+		input[i] = (uchar) i;
+	hash(out, input);
+	bin2hex(hex, (uchar*) out, 32);
+	if (!v->hash) {
+		applog(LOG_WARNING, "%s: no vector, hash is %s", algo_names[v->algo], hex);
+		return true;
+	}
+	if (strcmp(hex, v->hash)) {
+		applog(LOG_ERR, "%s: known answer mismatch, got %s, expected %s",
+			algo_names[v->algo], hex, v->hash);
+		return false;
+	}
+	return true;
+}
+
+/* first nonce of [nonce, max_nonce) under the target, by the reference */
+static bool reference_scan(const struct selftest_vector *v, share_hash_t hash,
+	const struct work *work, uint32_t nonce, uint32_t max_nonce, uint32_t *found)
+{
+	uint32_t _ALIGN(64) endiandata[48], vhash[16];
+	const int nw = vector_nonce(v);
+	int k;
+
+	for (k = 0; k < vector_words(v); k++) {
+		if (v->native)
+			endiandata[k] = work->data[k];
+		else
+			be32enc(&endiandata[k], work->data[k]);
+	}
+	for (; nonce < max_nonce; nonce++) {
+		if (v->native || v->swapped)
+			endiandata[nw] = nonce;
+		else
+			be32enc(&endiandata[nw], nonce);
+		hash(vhash, endiandata);
+		if (fulltest(vhash, work->target)) {
+			*found = nonce;
+			return true;
+		}
+	}
+	return false;
+}
+
+/* the scan kernel must report the nonces the reference finds, in order */
+static bool selftest_scan(const struct selftest_vector *v, share_hash_t hash, uint64_t *seed)
+{
+	unsigned char *scratchbuf = NULL;
+	const uint32_t range = v->target16 ? SELFTEST_RANGE_TARGET16 :
+		v->slow ? SELFTEST_RANGE_SLOW : SELFTEST_RANGE;
+	const int nw = vector_nonce(v);
+	struct work work;
+	int h, k;
+	bool ok = true;
+
+	if (!algo_scratch_alloc(&scratchbuf))
+		return false;
+	for (h = 0; h < SELFTEST_HEADERS && ok; h++) {
+		uint32_t first, end, nonce;
+		memset(&work, 0, sizeof(work));
+		for (k = 0; k < vector_words(v); k++)
+			work.data[k] = selftest_rand(seed);
+		if (vector_words(v) == 20) {
+			work.data[20] = 0x80000000;
+			work.data[31] = 0x00000280;
+		}
+		memset(work.target, 0xff, sizeof(work.target));
+		if (v->target16)
+			work.target[7] = 0xffff; /* about one hit per range */
+		else
+			work.target[7] = 0xffffffffU / range * 4; /* about 4 hits */
+		first = selftest_rand(seed) & 0x7fffffff;
+		end = first + range;
+
+		for (nonce = first; nonce < end; ) {
+			uint64_t done = 0;
+			uint32_t expected, got;
+			bool want;
+			int rc;
+
+			work.data[nw] = nonce;
+			work_restart[0].restart = 0;
+			rc = algo_scanhash(0, &work, end, &done, scratchbuf);
+			got = work.data[nw];
+			if (rc > 0 && v->swapped)
+				got = swab32(got);
+			// after the kernel, the x16r like hashes cache the order of the header
+			want = reference_scan(v, hash, &work, nonce, end, &expected);
+			if (rc < 0) {
+				applog(LOG_ERR, "%s: no scan kernel", algo_names[v->algo]);
+				ok = false;
+				break;
+			}
+			// a kernel may scan a few nonces past the range, ignore those hits
+			if (rc && got >= end)
+				rc = 0;
+			if (!!rc != want || (rc && got != expected)) {
+				char hex[48 * 8 + 1];
+				bin2hex(hex, (uchar*) work.data, vector_words(v) * 4);
+				applog(LOG_ERR, "%s: scan mismatch from nonce %08x, kernel %s %08x, reference %s %08x",
+					algo_names[v->algo], nonce, rc ? "found" : "missed", got,
+					want ? "found" : "found nothing", want ? expected : 0);
+				applog(LOG_ERR, "%s: header %s", algo_names[v->algo], hex);
+				ok = false;
+				break;
+			}
+			if (!rc)
+				break;
+			nonce = got + 1;
+		}
+	}
+	free(scratchbuf);
+	return ok;
+}
+
+/* lanes of the sha256 simd transforms against the scalar one */
+static bool selftest_sha256_ways(int ways, uint64_t *seed)
+{
+	uint32_t _ALIGN(128) state[8 * 8], block[16 * 8];
+	uint32_t ref[8][8], blk[16];
+	int lane, i, round;
+
+	for (round = 0; round < 64; round++) {
+		for (i = 0; i < 8 * ways; i++)
+			state[i] = selftest_rand(seed);
+		for (i = 0; i < 16 * ways; i++)
+			block[i] = selftest_rand(seed);
+		for (lane = 0; lane < ways; lane++) {
+			for (i = 0; i < 8; i++)
+				ref[lane][i] = state[i * ways + lane];
+			for (i = 0; i < 16; i++)
+				blk[i] = block[i * ways + lane];
+			sha256_transform(ref[lane], blk, 0);
+		}
+#ifdef HAVE_SHA256_4WAY
+		if (ways == 4)
+			sha256_transform_4way(state, block, 0);
+#endif
+#ifdef HAVE_SHA256_8WAY
+		if (ways == 8)
+			sha256_transform_8way(state, block, 0);
+#endif
+		for (lane = 0; lane < ways; lane++) {
+			for (i = 0; i < 8; i++) {
+				if (state[i * ways + lane] != ref[lane][i]) {
+					applog(LOG_ERR, "sha256 %d-way: lane %d mismatch", ways, lane);
+					return false;
+				}
+			}
+		}
+	}
+	applog(LOG_INFO, "sha256 %d-way: ok", ways);
+	return true;
+}
+
+static bool selftest_sha256(uint64_t *seed)
+{
+	bool ok = true;
+#ifdef HAVE_SHA256_4WAY
+	if (sha256_use_4way())
+		ok &= selftest_sha256_ways(4, seed);
+#endif
+#ifdef HAVE_SHA256_8WAY
+	if (sha256_use_8way())
+		ok &= selftest_sha256_ways(8, seed);
+#endif
+	return ok;
+}
+
+int selftest(void)
+{
+	// a fixed seed reproduces a failure
+	uint64_t seed = (opt_selftest_seed ? opt_selftest_seed : (uint64_t) time(NULL)) | 1;
+	int i, failed = 0, tested = 0;
+
+	// many kernels force an easy target in benchmark mode
+	opt_benchmark = false;
+	applog(LOG_INFO, "Self test, random seed %llu", (unsigned long long) seed);
+	if (!selftest_sha256(&seed))
+		failed++;
+	for (i = 0; i < ARRAY_SIZE(vectors); i++) {
+		const struct selftest_vector *v = &vectors[i];
+		share_hash_t hash;
+		bool ok;
+
+		if (!algo_in_list(opt_selftest, algo_names[v->algo]))
+			continue;
+		algo_select(v->algo);
+		hash = selftest_hash(v->algo);
+		if (!hash)
+			continue;
+		ok = selftest_kat(v, hash) && selftest_scan(v, hash, &seed);
+		if (ok)
+			applog(LOG_INFO, "%s: ok", algo_names[v->algo]);
+		failed += !ok;
+		tested++;
+	}
+	applog(failed ? LOG_ERR : LOG_NOTICE, "Self test: %d algos, %d failed", tested, failed);
+	return failed ? 1 : 0;
+}
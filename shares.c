@@ -0,0 +1,97 @@
+/**
+ * Local share filter
+ *
+ * The shares found by the miner threads are checked before any network
+ * call. A small open addressing set keeps the keys of the shares of the
+ * current job, a share found twice (two threads, or a race on g_work after
+ * a work regeneration) is dropped instead of costing a pool reject.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "miner.h"
+
+#define SHARES_SLOTS 4096 /* power of 2, the set is cleared when half full */
+
+static struct {
+	uint64_t job;
+	uint64_t keys[SHARES_SLOTS]; // 0 is an empty slot
+	int count;
+} seen;
+
+static pthread_mutex_t shares_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t dup_count = 0;
+static uint32_t invalid_count = 0;
+
+static uint64_t key_mix(uint64_t h, const void *data, size_t len)
+{
+	const uchar *p = (const uchar*) data;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		h = (h ^ p[i]) * 0x100000001b3ULL;
+	}
+	h ^= h >> 29;
+	h *= 0xff51afd7ed558ccdULL;
+	return h ^ (h >> 32);
+}
+
+/* true if the same share was already found, else it is remembered */
+bool share_seen(const struct work *work)
+{
+	uint64_t job, key;
+	uint32_t slot;
+	bool dup = false;
+
+	// the stratum job, or the block header base for getwork/gbt
+	if (work->job_id) {
+		job = key_mix(work->pool_id, work->job_id, strlen(work->job_id));
+	} else {
+		job = key_mix(0, &work->data[1], 8 * sizeof(uint32_t));
+	}
+	key = key_mix(job, work->data, sizeof(work->data));
+	if (work->xnonce2)
+		key = key_mix(key, work->xnonce2, work->xnonce2_len);
+	if (!key)
+		key = 1;
+
+	pthread_mutex_lock(&shares_lock);
+	if (job != seen.job || seen.count >= SHARES_SLOTS / 2) {
+		memset(seen.keys, 0, sizeof(seen.keys));
+		seen.count = 0;
+		seen.job = job;
+	}
+	for (slot = (uint32_t) key & (SHARES_SLOTS - 1); seen.keys[slot];
+			slot = (slot + 1) & (SHARES_SLOTS - 1)) {
+		if (seen.keys[slot] == key) {
+			dup = true;
+			dup_count++;
+			break;
+		}
+	}
+	if (!dup) {
+		seen.keys[slot] = key;
+		seen.count++;
+	}
+	pthread_mutex_unlock(&shares_lock);
+
+	return dup;
+}
+
+/* a share which failed the reference hash check */
+void share_invalid(void)
+{
+	pthread_mutex_lock(&shares_lock);
+	invalid_count++;
+	pthread_mutex_unlock(&shares_lock);
+}
+
+void shares_get_filtered(uint32_t *dups, uint32_t *invalid)
+{
+	pthread_mutex_lock(&shares_lock);
+	*dups = dup_count;
+	*invalid = invalid_count;
+	pthread_mutex_unlock(&shares_lock);
+}
@@ -0,0 +1,320 @@
+/**
+ * Hashrate statistics
+ *
+ * Each miner thread owns a ring of one second buckets filled at the end
+ * of its scan slices, plus an exponentially weighted average of its
+ * effective speed (idle time included). The thread is the only writer,
+ * readers (console, api, benchmark) retry on a sequence counter change
+ * so the mining loop never waits on them.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "miner.h"
+
+#define STATS_SLOTS 1024 /* seconds, enough for the 15mn window */
+#define STATS_EWMA_TAU 10.0
+
+struct stats_bucket {
+	uint32_t sec;
+	double hashes;
+};
+
+struct thr_stats {
+	volatile uint32_t seq;
+	uint64_t first_us;
+	uint64_t last_us;
+	uint64_t last_dur_us;
+	double ewma;
+	double total;
+	uint32_t window;
+	struct stats_bucket ring[STATS_SLOTS];
+	char padding[64];
+};
+
+static struct thr_stats *thr_stats = NULL;
+static int stats_threads = 0;
+
+static inline uint64_t tv_to_us(const struct timeval *tv)
+{
+	return (uint64_t) tv->tv_sec * 1000000 + tv->tv_usec;
+}
+
+bool stats_init(int threads)
+{
+	thr_stats = (struct thr_stats*) calloc(threads, sizeof(struct thr_stats));
+	if (!thr_stats)
+		return false;
+	stats_threads = threads;
+	return true;
+}
+
+/* called by the miner thread after each scanhash */
+void stats_remember_speed(int thr_id, uint64_t hashes, const struct timeval *start,
+	const struct timeval *end)
+{
+	struct thr_stats *st;
+	uint64_t s_us, e_us, dur, dt;
+	uint32_t sec;
+	double rate, alpha;
+
+	if (!thr_stats || thr_id < 0 || thr_id >= stats_threads)
+		return;
+
+	st = &thr_stats[thr_id];
+	s_us = tv_to_us(start);
+	e_us = tv_to_us(end);
+	if (e_us <= s_us)
+		return;
+	dur = e_us - s_us;
+
+	st->seq++;
+	mem_barrier();
+
+	// spread the slice hashes on the seconds it covers
+	for (sec = (uint32_t) (s_us / 1000000); sec <= (uint32_t) (e_us / 1000000); sec++) {
+		struct stats_bucket *b = &st->ring[sec % STATS_SLOTS];
+		uint64_t lo = (uint64_t) sec * 1000000, hi = lo + 1000000;
+		if (lo < s_us) lo = s_us;
+		if (hi > e_us) hi = e_us;
+		if (b->sec != sec) {
+			b->sec = sec;
+			b->hashes = 0.;
+		}
+		b->hashes += (double) hashes * (hi - lo) / dur;
+	}
+
+	// effective speed since the previous slice, pauses included
+	dt = st->last_us && e_us > st->last_us ? e_us - st->last_us : dur;
+	rate = hashes / (dt * 1e-6);
+	if (!st->first_us) {
+		st->first_us = s_us;
+		st->ewma = hashes / (dur * 1e-6);
+	} else {
+		alpha = 1.0 - exp(-(dt * 1e-6) / STATS_EWMA_TAU);
+		st->ewma += alpha * (rate - st->ewma);
+	}
+	st->last_us = e_us;
+	st->last_dur_us = dur;
+	st->total += hashes;
+
+	mem_barrier();
+	st->seq++;
+}
+
+static double thread_speed(struct thr_stats *st, int window, uint64_t now_us)
+{
+	uint64_t start_us, end_us;
+	uint32_t sec, last_sec;
+	double hashes = 0.;
+
+	if (!st->first_us)
+		return 0.;
+
+	if (window == STATS_EWMA) {
+		// decay if the thread stopped reporting (parked, waiting for work)
+		double idle = now_us > st->last_us ? (now_us - st->last_us) * 1e-6 : 0.;
+		if (idle > 2.0 * st->last_dur_us * 1e-6 + 1.0)
+			return st->ewma * exp(-idle / STATS_EWMA_TAU);
+		return st->ewma;
+	}
+
+	// a busy thread is measured up to its last slice
+	end_us = now_us;
+	if (now_us - st->last_us <= 2 * st->last_dur_us)
+		end_us = st->last_us;
+	start_us = end_us - (uint64_t) window * 1000000;
+	if (start_us < st->first_us)
+		start_us = st->first_us;
+	if (end_us <= start_us)
+		return 0.;
+
+	last_sec = (uint32_t) (end_us / 1000000);
+	for (sec = (uint32_t) (start_us / 1000000); sec <= last_sec; sec++) {
+		struct stats_bucket *b = &st->ring[sec % STATS_SLOTS];
+		if (b->sec != sec)
+			continue;
+		if (sec == (uint32_t) (start_us / 1000000) && start_us > st->first_us) {
+			// only the part of the first second inside the window
+			uint64_t in_us = (uint64_t) (sec + 1) * 1000000 - start_us;
+			if (in_us > end_us - start_us)
+				in_us = end_us - start_us;
+			hashes += b->hashes * in_us / 1e6;
+		} else
+			hashes += b->hashes;
+	}
+	return hashes / ((end_us - start_us) * 1e-6);
+}
+
+/**
+ * Speed of a thread (or all with thr_id -1) over the last window seconds,
+ * STATS_EWMA (0) returns the smoothed current speed
+ */
+double stats_get_speed(int thr_id, int window)
+{
+	struct timeval now;
+	uint64_t now_us;
+	double speed = 0.;
+	int i;
+
+	if (!thr_stats)
+		return 0.;
+	if (window > STATS_SLOTS - 2)
+		window = STATS_SLOTS - 2;
+
+	gettimeofday(&now, NULL);
+	now_us = tv_to_us(&now);
+
+	for (i = 0; i < stats_threads; i++) {
+		struct thr_stats *st = &thr_stats[i];
+		uint32_t seq;
+		double s;
+		if (thr_id >= 0 && i != thr_id)
+			continue;
+		do {
+			seq = st->seq;
+			mem_barrier();
+			s = thread_speed(st, window, now_us);
+			mem_barrier();
+		} while ((seq & 1) || seq != st->seq);
+		speed += s;
+	}
+	return speed;
+}
+
+/* nonce range given to the next scanhash call */
+void stats_remember_window(int thr_id, uint32_t nonces)
+{
+	if (thr_stats && thr_id >= 0 && thr_id < stats_threads)
+		thr_stats[thr_id].window = nonces;
+}
+
+void stats_get_scan(int thr_id, struct scan_stats *out)
+{
+	struct thr_stats *st;
+	uint32_t seq;
+
+	memset(out, 0, sizeof(*out));
+	if (!thr_stats || thr_id < 0 || thr_id >= stats_threads)
+		return;
+	st = &thr_stats[thr_id];
+	do {
+		seq = st->seq;
+		mem_barrier();
+		out->hashes = st->total;
+		out->slice_ms = st->last_dur_us / 1e3;
+		out->window = st->window;
+		mem_barrier();
+	} while ((seq & 1) || seq != st->seq);
+}
+
+static pthread_mutex_t latency_lock = PTHREAD_MUTEX_INITIALIZER;
+
+const double stats_latency_bounds[LATENCY_BUCKETS] = {
+	1, 2, 5, 10, 25, 50, 100, 250, 500, 1000, 2500, 5000
+};
+
+static void latency_add(struct latency_stats *ls, double latency)
+{
+	int b = 0;
+	while (b < LATENCY_BUCKETS && latency > stats_latency_bounds[b])
+		b++;
+	ls->histo[b]++;
+	ls->count++;
+	ls->total_ms += latency;
+	ls->last_ms = latency;
+	if (latency > ls->max_ms)
+		ls->max_ms = latency;
+}
+
+/* share submit round trips, in ms */
+static struct latency_stats submit_stats = { 0 };
+
+void stats_remember_submit(double latency)
+{
+	pthread_mutex_lock(&latency_lock);
+	latency_add(&submit_stats, latency);
+	pthread_mutex_unlock(&latency_lock);
+}
+
+void stats_get_submit(struct latency_stats *out)
+{
+	pthread_mutex_lock(&latency_lock);
+	memcpy(out, &submit_stats, sizeof(*out));
+	pthread_mutex_unlock(&latency_lock);
+}
+
+/* delay between a stratum notify and the first hash on its work */
+static struct latency_stats job_stats = { 0 };
+static struct timeval job_last = { 0 };
+
+void stats_remember_job(const struct timeval *notify)
+{
+	struct timeval now, diff, tv = *notify;
+
+	gettimeofday(&now, NULL);
+	pthread_mutex_lock(&latency_lock);
+	// only the first thread starting on the job counts
+	if (timercmp(notify, &job_last, >)) {
+		job_last = *notify;
+		timeval_subtract(&diff, &now, &tv);
+		latency_add(&job_stats, diff.tv_sec * 1e3 + diff.tv_usec / 1e3);
+	}
+	pthread_mutex_unlock(&latency_lock);
+}
+
+void stats_get_job(struct latency_stats *out)
+{
+	pthread_mutex_lock(&latency_lock);
+	memcpy(out, &job_stats, sizeof(*out));
+	pthread_mutex_unlock(&latency_lock);
+}
+
+/* pool rejects, sorted on the reason string */
+const char *stats_reject_names[REJECT_REASONS] = {
+	"stale", "duplicate", "lowdiff", "other"
+};
+static uint32_t reject_counts[REJECT_REASONS] = { 0 };
+
+static bool reason_has(const char *reason, const char *word)
+{
+	size_t len = strlen(word);
+	for (; *reason; reason++)
+		if (!strncasecmp(reason, word, len))
+			return true;
+	return false;
+}
+
+int stats_reject_class(const char *reason)
+{
+	if (!reason)
+		return REJECT_OTHER;
+	if (reason_has(reason, "stale") || reason_has(reason, "job not found")
+		|| reason_has(reason, "obsolete"))
+		return REJECT_STALE;
+	if (reason_has(reason, "duplicate"))
+		return REJECT_DUPLICATE;
+	if (reason_has(reason, "low diff") || reason_has(reason, "above target")
+		|| reason_has(reason, "high-hash"))
+		return REJECT_LOWDIFF;
+	return REJECT_OTHER;
+}
+
+void stats_remember_reject(const char *reason)
+{
+	int r = stats_reject_class(reason);
+
+	pthread_mutex_lock(&latency_lock);
+	reject_counts[r]++;
+	pthread_mutex_unlock(&latency_lock);
+}
+
+void stats_get_rejects(uint32_t *counts)
+{
+	pthread_mutex_lock(&latency_lock);
+	memcpy(counts, reject_counts, sizeof(reject_counts));
+	pthread_mutex_unlock(&latency_lock);
+}
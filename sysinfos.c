@@ -8,6 +8,8 @@
 #include <ctype.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include "miner.h"
 
@@ -59,21 +61,149 @@ static float linux_cputemp(int core)
 
 #define CPUFREQ_PATH \
  "/sys/devices/system/cpu/cpu0/cpufreq/cpuinfo_cur_freq"
+#define CPUFREQ_ALT \
+ "/sys/devices/system/cpu/cpu0/cpufreq/scaling_cur_freq"
 static uint32_t linux_cpufreq(int core)
 {
 	FILE *fd = fopen(CPUFREQ_PATH, "r");
 	uint32_t freq = 0;
 
+	// cpuinfo_cur_freq is root only on most distros
 	if (!fd)
-		return freq;
+		fd = fopen(CPUFREQ_ALT, "r");
 
-	if (!fscanf(fd, "%d", &freq))
+	if (!fd)
 		return freq;
 
+	if (!fscanf(fd, "%u", &freq))
+		freq = 0;
+
 	fclose(fd);
 	return freq;
 }
 
+/* per core sensors, opened once and re-read with pread() */
+static int sensor_fd[MAX_SENSORS];
+static int sensor_core[MAX_SENSORS]; /* core id from the label, or -1 */
+static int sensor_count = 0;
+
+static int read_sysfs_int(int fd, long long *val)
+{
+	char buf[32];
+	ssize_t n = pread(fd, buf, sizeof(buf) - 1, 0);
+	if (n <= 0)
+		return 0;
+	buf[n] = '\0';
+	*val = strtoll(buf, NULL, 10);
+	return 1;
+}
+
+static int read_sysfs_str(const char *path, char *buf, size_t sz)
+{
+	FILE *fd = fopen(path, "r");
+	if (!fd)
+		return 0;
+	if (!fgets(buf, (int) sz, fd))
+		*buf = '\0';
+	fclose(fd);
+	buf[strcspn(buf, "\n")] = '\0';
+	return 1;
+}
+
+static void linux_sensors_probe(void)
+{
+	char path[128], name[64];
+	int h, t, h_found;
+
+	// x86 coretemp/k10temp hwmon, "Core N" labels give the core id
+	for (h = 0; h < 16 && !sensor_count; h++) {
+		sprintf(path, "/sys/class/hwmon/hwmon%d/name", h);
+		if (!read_sysfs_str(path, name, sizeof(name)))
+			continue;
+		if (strcmp(name, "coretemp") && strcmp(name, "k10temp") &&
+		    strcmp(name, "zenpower") && strcmp(name, "cpu_thermal"))
+			continue;
+		for (t = 1; t < 64 && sensor_count < MAX_SENSORS; t++) {
+			int fd, core = -1;
+			sprintf(path, "/sys/class/hwmon/hwmon%d/temp%d_input", h, t);
+			fd = open(path, O_RDONLY);
+			if (fd < 0)
+				continue;
+			sprintf(path, "/sys/class/hwmon/hwmon%d/temp%d_label", h, t);
+			if (read_sysfs_str(path, name, sizeof(name)) && !strncmp(name, "Core ", 5))
+				core = atoi(&name[5]);
+			sensor_core[sensor_count] = core;
+			sensor_fd[sensor_count++] = fd;
+		}
+	}
+
+	h_found = sensor_count;
+
+	// android/arm thermal zones (cpu0-thermal, cpu-1-0-usr, ...)
+	for (t = 0; t < 64 && !h_found && sensor_count < MAX_SENSORS; t++) {
+		int fd;
+		sprintf(path, "/sys/class/thermal/thermal_zone%d/type", t);
+		if (!read_sysfs_str(path, name, sizeof(name)))
+			continue;
+		if (!strstr(name, "cpu") && !strstr(name, "CPU"))
+			continue;
+		sprintf(path, "/sys/class/thermal/thermal_zone%d/temp", t);
+		fd = open(path, O_RDONLY);
+		if (fd < 0)
+			continue;
+		sensor_core[sensor_count] = -1;
+		sensor_fd[sensor_count++] = fd;
+	}
+}
+
+/* intel/amd RAPL package energy counter, usually root only */
+#define RAPL_PATH "/sys/class/powercap/intel-rapl:0"
+static int rapl_fd = -1;
+static long long rapl_range = 0;
+static long long rapl_last = -1;
+static struct timeval rapl_tv;
+
+static void linux_rapl_probe(void)
+{
+	char buf[32];
+	rapl_fd = open(RAPL_PATH "/energy_uj", O_RDONLY);
+	if (rapl_fd >= 0 && read_sysfs_str(RAPL_PATH "/max_energy_range_uj", buf, sizeof(buf)))
+		rapl_range = atoll(buf);
+}
+
+/* average package power since the previous call, in watts */
+static float linux_rapl_power(void)
+{
+	struct timeval now, diff;
+	long long uj = 0, delta;
+	float watts = 0.f;
+
+	if (rapl_fd < 0 || !read_sysfs_int(rapl_fd, &uj))
+		return 0.f;
+	gettimeofday(&now, NULL);
+	if (rapl_last >= 0) {
+		delta = uj - rapl_last;
+		if (delta < 0) // counter wrap
+			delta += rapl_range;
+		timeval_subtract(&diff, &now, &rapl_tv);
+		if (diff.tv_sec || diff.tv_usec)
+			watts = (float) (delta / (diff.tv_sec * 1e6 + diff.tv_usec));
+	}
+	rapl_last = uj;
+	rapl_tv = now;
+	return watts;
+}
+
+/* map logical cpus to the sensor of their physical core */
+static int linux_cpu_core_id(int cpu)
+{
+	char path[96], buf[16];
+	sprintf(path, "/sys/devices/system/cpu/cpu%d/topology/core_id", cpu);
+	if (!read_sysfs_str(path, buf, sizeof(buf)))
+		return -1;
+	return atoi(buf);
+}
+
 #else /* WIN32 */
 
 static float win32_cputemp(int core)
@@ -111,6 +241,117 @@ int cpu_fanpercent()
 	return 0;
 }
 
+/*
+ * Sensor sampler, the snapshot is published with a sequence counter
+ * so the miner threads and the api read it without lock or syscall
+ */
+
+static struct sensors_snapshot snap;
+static volatile uint32_t snap_seq = 0;
+#define SENSOR_CPUS 256
+static int cpu_sensor[SENSOR_CPUS];
+int opt_sensor_interval = 1000; /* ms */
+
+static void sensors_sample(void)
+{
+	struct sensors_snapshot s = { 0 };
+	int i;
+
+	s.temp = cpu_temp(0);
+	s.clock = cpu_clock(0);
+	s.fan = cpu_fanpercent();
+#ifndef WIN32
+	s.power = linux_rapl_power();
+	for (i = 0; i < sensor_count; i++) {
+		long long val = 0;
+		if (read_sysfs_int(sensor_fd[i], &val))
+			s.core_temp[i] = val / 1000.0f;
+		if (s.core_temp[i] > s.max_temp)
+			s.max_temp = s.core_temp[i];
+	}
+	s.sensors = sensor_count;
+#endif
+	if (s.temp > s.max_temp)
+		s.max_temp = s.temp;
+	else if (s.temp == 0.0f)
+		s.temp = s.max_temp;
+	s.ts = time(NULL);
+	s.samples = snap.samples + 1;
+
+	snap_seq++;
+	mem_barrier();
+	memcpy(&snap, &s, sizeof(s));
+	mem_barrier();
+	snap_seq++;
+}
+
+void sensors_init(void)
+{
+	int i, n;
+
+	for (i = 0; i < SENSOR_CPUS; i++)
+		cpu_sensor[i] = -1;
+#ifndef WIN32
+	linux_sensors_probe();
+	linux_rapl_probe();
+	n = num_cpus < SENSOR_CPUS ? num_cpus : SENSOR_CPUS;
+	for (i = 0; i < n; i++) {
+		int s, core = linux_cpu_core_id(i);
+		for (s = 0; core >= 0 && s < sensor_count; s++) {
+			if (sensor_core[s] == core) {
+				cpu_sensor[i] = s;
+				break;
+			}
+		}
+	}
+	if (opt_debug)
+		applog(LOG_DEBUG, "%d cpu temperature sensors found, rapl %s", sensor_count,
+			rapl_fd >= 0 ? "available" : "not available");
+#endif
+	sensors_sample();
+}
+
+void sensors_read(struct sensors_snapshot *out)
+{
+	uint32_t seq;
+	do {
+		seq = snap_seq;
+		mem_barrier();
+		memcpy(out, &snap, sizeof(*out));
+		mem_barrier();
+	} while ((seq & 1) || seq != snap_seq);
+}
+
+bool sensors_have_power(void)
+{
+#ifndef WIN32
+	return rapl_fd >= 0;
+#else
+	return false;
+#endif
+}
+
+/* temperature of the core running this logical cpu, or the package one */
+float sensors_cpu_temp(const struct sensors_snapshot *s, int cpu)
+{
+	if (cpu >= 0 && cpu < SENSOR_CPUS && cpu_sensor[cpu] >= 0)
+		return s->core_temp[cpu_sensor[cpu]];
+	return s->temp;
+}
+
+void *sensors_thread(void *userdata)
+{
+	struct thr_info *mythr = (struct thr_info*) userdata;
+
+	while (opt_sensor_interval > 0) {
+		usleep(opt_sensor_interval * 1000);
+		sensors_sample();
+	}
+
+	tq_freeze(mythr->q);
+	return NULL;
+}
+
 #if !defined(__arm__) && !defined(__aarch64__)
 static inline void cpuid(int functionnumber, int output[4]) {
 #ifdef _MSC_VER
@@ -283,3 +524,24 @@ void cpu_bestfeature(char *outbuf, size_t maxsz)
 		*outbuf = '\0';
 #endif
 }
+
+/* virtual and resident bytes of the process, false if unknown */
+bool proc_memory(double *virt, double *resident)
+{
+	*virt = *resident = 0.;
+#ifdef __linux__
+	FILE *f = fopen("/proc/self/statm", "r");
+	if (f) {
+		unsigned long size, res;
+		long page = sysconf(_SC_PAGESIZE);
+		bool ok = fscanf(f, "%lu %lu", &size, &res) == 2;
+		fclose(f);
+		if (ok) {
+			*virt = (double) size * page;
+			*resident = (double) res * page;
+			return true;
+		}
+	}
+#endif
+	return false;
+}
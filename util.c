@@ -35,6 +35,10 @@
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #endif
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
 
 #ifndef _MSC_VER
 /* dirname() linux/mingw, else in compat.h */
@@ -44,11 +48,18 @@
 #include "miner.h"
 #include "elist.h"
 
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 extern pthread_mutex_t stats_lock;
 
 struct data_buffer {
 	void		*buf;
 	size_t		len;
+	size_t		size;
 };
 
 struct upload_buffer {
@@ -77,79 +88,21 @@ struct thread_q {
 	pthread_cond_t		cond;
 };
 
-void applog(int prio, const char *fmt, ...)
+/* comma separated algo names, an empty or missing list has them all */
+bool algo_in_list(const char *list, const char *name)
 {
-	va_list ap;
-
-	va_start(ap, fmt);
-
-#ifdef HAVE_SYSLOG_H
-	if (use_syslog) {
-		va_list ap2;
-		char *buf;
-		int len;
+	size_t len = strlen(name);
 
-		/* custom colors to syslog prio */
-		if (prio > LOG_DEBUG) {
-			switch (prio) {
-				case LOG_BLUE: prio = LOG_NOTICE; break;
-			}
-		}
-
-		va_copy(ap2, ap);
-		len = vsnprintf(NULL, 0, fmt, ap2) + 1;
-		va_end(ap2);
-		buf = alloca(len);
-		if (vsnprintf(buf, len, fmt, ap) >= 0)
-			syslog(prio, "%s", buf);
+	if (!list || !*list)
+		return true;
+	while (list) {
+		if (!strncasecmp(list, name, len) && (list[len] == ',' || list[len] == '\0'))
+			return true;
+		list = strchr(list, ',');
+		if (list)
+			list++;
 	}
-#else
-	if (0) {}
-#endif
-	else {
-		const char* color = "";
-		char *f;
-		int len;
-		struct tm tm;
-		time_t now = time(NULL);
-
-		localtime_r(&now, &tm);
-
-		switch (prio) {
-			case LOG_ERR:     color = CL_RED; break;
-			case LOG_WARNING: color = CL_YLW; break;
-			case LOG_NOTICE:  color = CL_WHT; break;
-			case LOG_INFO:    color = ""; break;
-			case LOG_DEBUG:   color = CL_GRY; break;
-
-			case LOG_BLUE:
-				prio = LOG_NOTICE;
-				color = CL_CYN;
-				break;
-		}
-		if (!use_colors)
-			color = "";
-
-		len = 64 + (int) strlen(fmt) + 2;
-		f = (char*) malloc(len);
-		sprintf(f, "[%d-%02d-%02d %02d:%02d:%02d]%s %s%s\n",
-			tm.tm_year + 1900,
-			tm.tm_mon + 1,
-			tm.tm_mday,
-			tm.tm_hour,
-			tm.tm_min,
-			tm.tm_sec,
-			color,
-			fmt,
-			use_colors ? CL_N : ""
-		);
-		pthread_mutex_lock(&applog_lock);
-		vfprintf(stdout, f, ap);	/* atomic write to stdout */
-		fflush(stdout);
-		free(f);
-		pthread_mutex_unlock(&applog_lock);
-	}
-	va_end(ap);
+	return false;
 }
 
 /* Get default config.json path (will be system specific) */
@@ -274,24 +227,42 @@ static size_t all_data_cb(const void *ptr, size_t size, size_t nmemb,
 	struct data_buffer *db = (struct data_buffer *) user_data;
 	size_t len = size * nmemb;
 	size_t oldlen, newlen;
-	void *newmem;
-	static const unsigned char zero = 0;
 
 	oldlen = db->len;
 	newlen = oldlen + len;
 
-	newmem = realloc(db->buf, newlen + 1);
-	if (!newmem)
-		return 0;
+	if (newlen + 1 > db->size) {
+		size_t newsize = db->size * 2;
+		void *newmem;
+		if (newsize < newlen + 1)
+			newsize = newlen + 1;
+		newmem = realloc(db->buf, newsize);
+		if (!newmem)
+			return 0;
+		db->buf = newmem;
+		db->size = newsize;
+	}
 
-	db->buf = newmem;
 	db->len = newlen;
 	memcpy((uchar*) db->buf + oldlen, ptr, len);
-	memcpy((uchar*) db->buf + newlen, &zero, 1);	/* null terminate */
+	((uchar*) db->buf)[newlen] = 0;	/* null terminate */
 
 	return len;
 }
 
+/* rpc response buffer of the thread, sized from its previous responses */
+static __thread struct data_buffer rpc_data = { 0 };
+
+static void rpc_data_keep(struct data_buffer *db)
+{
+	// release the memory of an old getblocktemplate answer
+	if (db->size > 65536 && db->len < db->size / 4) {
+		databuf_free(db);
+	}
+	db->len = 0;
+	rpc_data = *db;
+}
+
 static size_t upload_data_cb(void *ptr, size_t size, size_t nmemb,
 			     void *user_data)
 {
@@ -432,6 +403,41 @@ static int sockopt_keepalive_cb(void *userdata, curl_socket_t fd,
 }
 #endif
 
+/* connections, dns and tls sessions shared by the rpc threads */
+static CURLSH *curl_share = NULL;
+static pthread_mutex_t curl_share_locks[CURL_LOCK_DATA_LAST];
+
+static void curl_share_lock(CURL *curl, curl_lock_data data,
+	curl_lock_access access, void *userptr)
+{
+	pthread_mutex_lock(&curl_share_locks[data]);
+}
+
+static void curl_share_unlock(CURL *curl, curl_lock_data data, void *userptr)
+{
+	pthread_mutex_unlock(&curl_share_locks[data]);
+}
+
+bool rpc_share_init(void)
+{
+	int i;
+
+	curl_share = curl_share_init();
+	if (!curl_share)
+		return false;
+	for (i = 0; i < CURL_LOCK_DATA_LAST; i++)
+		pthread_mutex_init(&curl_share_locks[i], NULL);
+	curl_share_setopt(curl_share, CURLSHOPT_LOCKFUNC, curl_share_lock);
+	curl_share_setopt(curl_share, CURLSHOPT_UNLOCKFUNC, curl_share_unlock);
+	curl_share_setopt(curl_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+	curl_share_setopt(curl_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+#if LIBCURL_VERSION_NUM >= 0x073900
+	/* a submit can reuse the socket left idle by another thread */
+	curl_share_setopt(curl_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+#endif
+	return true;
+}
+
 json_t *json_rpc_call(CURL *curl, const char *url,
 		      const char *userpass, const char *rpc_req,
 		      int *curl_err, int flags)
@@ -439,7 +445,7 @@ json_t *json_rpc_call(CURL *curl, const char *url,
 	json_t *val, *err_val, *res_val;
 	int rc;
 	long http_rc;
-	struct data_buffer all_data = {0};
+	struct data_buffer all_data = rpc_data;
 	struct upload_buffer upload_data;
 	char *json_buf;
 	json_error_t err;
@@ -454,6 +460,8 @@ json_t *json_rpc_call(CURL *curl, const char *url,
 	if (opt_protocol)
 		curl_easy_setopt(curl, CURLOPT_VERBOSE, 1);
 	curl_easy_setopt(curl, CURLOPT_URL, url);
+	if (curl_share)
+		curl_easy_setopt(curl, CURLOPT_SHARE, curl_share);
 	if (opt_cert)
 		curl_easy_setopt(curl, CURLOPT_CAINFO, opt_cert);
 	curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, false);
@@ -484,8 +492,8 @@ json_t *json_rpc_call(CURL *curl, const char *url,
 		curl_easy_setopt(curl, CURLOPT_HTTPAUTH, CURLAUTH_BASIC);
 	}
 #if LIBCURL_VERSION_NUM >= 0x070f06
-	if (flags & JSON_RPC_LONGPOLL)
-		curl_easy_setopt(curl, CURLOPT_SOCKOPTFUNCTION, sockopt_keepalive_cb);
+	/* the connections are kept open between the calls */
+	curl_easy_setopt(curl, CURLOPT_SOCKOPTFUNCTION, sockopt_keepalive_cb);
 #endif
 	curl_easy_setopt(curl, CURLOPT_POST, 1);
 
@@ -536,7 +544,7 @@ json_t *json_rpc_call(CURL *curl, const char *url,
 		hi.lp_path = NULL;
 	}
 
-	if (!all_data.buf) {
+	if (!all_data.len) {
 		applog(LOG_ERR, "Empty data received in json_rpc_call.");
 		goto err_out;
 	}
@@ -597,7 +605,7 @@ json_t *json_rpc_call(CURL *curl, const char *url,
 	if (hi.reason)
 		json_object_set_new(val, "reject-reason", json_string(hi.reason));
 
-	databuf_free(&all_data);
+	rpc_data_keep(&all_data);
 	curl_slist_free_all(headers);
 	curl_easy_reset(curl);
 	return val;
@@ -606,7 +614,7 @@ err_out:
 	free(hi.lp_path);
 	free(hi.reason);
 	free(hi.stratum_url);
-	databuf_free(&all_data);
+	rpc_data_keep(&all_data);
 	curl_slist_free_all(headers);
 	curl_easy_reset(curl);
 	return NULL;
@@ -658,10 +666,101 @@ err_out:
 	return cfg;
 }
 
+/* hex codec, 16 bytes per vector step (ssse3 or aarch64 neon) with a lut tail */
+static const char hexdigits[] = "0123456789abcdef";
+
+static const int8_t hexvalues[256] = {
+	-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1, -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+	-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,  0, 1, 2, 3, 4, 5, 6, 7, 8, 9,-1,-1,-1,-1,-1,-1,
+	-1,10,11,12,13,14,15,-1,-1,-1,-1,-1,-1,-1,-1,-1, -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+	-1,10,11,12,13,14,15,-1,-1,-1,-1,-1,-1,-1,-1,-1, -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+	-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1, -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+	-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1, -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+	-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1, -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+	-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1, -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+};
+
+/* returns the number of bytes done, the caller finishes with the lut */
+static size_t bin2hex_simd(char *s, const unsigned char *p, size_t len)
+{
+	size_t i = 0;
+#if defined(__SSSE3__)
+	const __m128i digits = _mm_loadu_si128((const __m128i*) hexdigits);
+	const __m128i mask = _mm_set1_epi8(0x0f);
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i*) (p + i));
+		__m128i hi = _mm_shuffle_epi8(digits, _mm_and_si128(_mm_srli_epi16(v, 4), mask));
+		__m128i lo = _mm_shuffle_epi8(digits, _mm_and_si128(v, mask));
+		_mm_storeu_si128((__m128i*) (s + 2*i), _mm_unpacklo_epi8(hi, lo));
+		_mm_storeu_si128((__m128i*) (s + 2*i + 16), _mm_unpackhi_epi8(hi, lo));
+	}
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+	const uint8x16_t digits = vld1q_u8((const uint8_t*) hexdigits);
+	for (; i + 16 <= len; i += 16) {
+		uint8x16_t v = vld1q_u8(p + i);
+		uint8x16x2_t out;
+		out.val[0] = vqtbl1q_u8(digits, vshrq_n_u8(v, 4));
+		out.val[1] = vqtbl1q_u8(digits, vandq_u8(v, vdupq_n_u8(0x0f)));
+		vst2q_u8((uint8_t*) (s + 2*i), out); // interleaved
+	}
+#endif
+	return i;
+}
+
+/* decodes while the chars are valid, returns the number of bytes done */
+static size_t hex2bin_simd(unsigned char *p, const char *hexstr, size_t len)
+{
+	size_t i = 0;
+#if defined(__SSSE3__)
+	const __m128i c0 = _mm_set1_epi8('0'), ca = _mm_set1_epi8('a');
+	const __m128i case_bit = _mm_set1_epi8(0x20), minus1 = _mm_set1_epi8(-1);
+	const __m128i ten = _mm_set1_epi8(10), six = _mm_set1_epi8(6);
+	const __m128i weights = _mm_set1_epi16(0x0110); // high nibble * 16 + low
+	for (; i + 16 <= len; i += 16) {
+		__m128i val[2];
+		int k;
+		for (k = 0; k < 2; k++) {
+			__m128i v = _mm_loadu_si128((const __m128i*) (hexstr + 2*i + 16*k));
+			__m128i d = _mm_sub_epi8(v, c0);
+			__m128i a = _mm_sub_epi8(_mm_or_si128(v, case_bit), ca);
+			__m128i is_d = _mm_and_si128(_mm_cmpgt_epi8(d, minus1), _mm_cmpgt_epi8(ten, d));
+			__m128i is_a = _mm_and_si128(_mm_cmpgt_epi8(a, minus1), _mm_cmpgt_epi8(six, a));
+			if (_mm_movemask_epi8(_mm_or_si128(is_d, is_a)) != 0xffff)
+				return i;
+			v = _mm_or_si128(_mm_and_si128(is_d, d), _mm_and_si128(is_a, _mm_add_epi8(a, ten)));
+			val[k] = _mm_maddubs_epi16(v, weights);
+		}
+		_mm_storeu_si128((__m128i*) (p + i), _mm_packus_epi16(val[0], val[1]));
+	}
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+	const uint8x16_t c0 = vdupq_n_u8('0'), ca = vdupq_n_u8('a'), case_bit = vdupq_n_u8(0x20);
+	const uint8x16_t ten = vdupq_n_u8(10), six = vdupq_n_u8(6);
+	for (; i + 16 <= len; i += 16) {
+		uint8x16x2_t v = vld2q_u8((const uint8_t*) (hexstr + 2*i)); // high, low chars
+		uint8x16_t n[2];
+		int k;
+		for (k = 0; k < 2; k++) {
+			uint8x16_t d = vsubq_u8(v.val[k], c0);
+			uint8x16_t a = vsubq_u8(vorrq_u8(v.val[k], case_bit), ca);
+			uint8x16_t is_d = vcltq_u8(d, ten), is_a = vcltq_u8(a, six);
+			if (vminvq_u8(vorrq_u8(is_d, is_a)) != 0xff)
+				return i;
+			n[k] = vbslq_u8(is_d, d, vaddq_u8(a, ten));
+		}
+		vst1q_u8(p + i, vorrq_u8(vshlq_n_u8(n[0], 4), n[1]));
+	}
+#endif
+	return i;
+}
+
 void bin2hex(char *s, const unsigned char *p, size_t len)
 {
-	for (size_t i = 0; i < len; i++)
-		sprintf(s + (i * 2), "%02x", (unsigned int) p[i]);
+	size_t i = bin2hex_simd(s, p, len);
+	for (; i < len; i++) {
+		s[2*i] = hexdigits[p[i] >> 4];
+		s[2*i + 1] = hexdigits[p[i] & 0xf];
+	}
+	s[2*len] = '\0';
 }
 
 char *abin2hex(const unsigned char *p, size_t len)
@@ -675,30 +774,81 @@ char *abin2hex(const unsigned char *p, size_t len)
 
 bool hex2bin(unsigned char *p, const char *hexstr, size_t len)
 {
-	char hex_byte[3];
-	char *ep;
-
-	hex_byte[2] = '\0';
+	// the vector loads must stay inside the string
+	size_t avail = strnlen(hexstr, len * 2);
+	size_t i = hex2bin_simd(p, hexstr, avail / 2);
 
-	while (*hexstr && len) {
-		if (!hexstr[1]) {
+	for (; i < len; i++) {
+		const char *h = hexstr + 2*i;
+		int hi, lo;
+		if (!h[0])
+			return false;
+		if (!h[1]) {
 			applog(LOG_ERR, "hex2bin str truncated");
 			return false;
 		}
-		hex_byte[0] = hexstr[0];
-		hex_byte[1] = hexstr[1];
-		*p = (unsigned char) strtol(hex_byte, &ep, 16);
-		if (*ep) {
-			applog(LOG_ERR, "hex2bin failed on '%s'", hex_byte);
+		hi = hexvalues[(uint8_t) h[0]];
+		lo = hexvalues[(uint8_t) h[1]];
+		if ((hi | lo) < 0) {
+			applog(LOG_ERR, "hex2bin failed on '%.2s'", h);
 			return false;
 		}
-		p++;
-		hexstr += 2;
-		len--;
+		p[i] = (unsigned char) (hi << 4 | lo);
 	}
 
-	return(!len) ? true : false;
-/*	return (len == 0 && *hexstr == 0) ? true : false; */
+	return true;
+}
+
+/* --hex-bench, codec speed on a block of the size of a big gbt template */
+void hex_benchmark(void)
+{
+	const size_t len = 1 << 20;
+	unsigned char *bin = (unsigned char*) malloc(len), *out = (unsigned char*) malloc(len);
+	char *hex = (char*) malloc(2 * len + 1);
+	struct timeval tv_start, tv_end, diff;
+	double enc, dec;
+	size_t i;
+	int r, rounds = 64;
+
+	if (!bin || !out || !hex)
+		goto out;
+	for (i = 0; i < len; i++)
+		bin[i] = (unsigned char) (i * 2654435761U >> 13);
+
+	gettimeofday(&tv_start, NULL);
+	for (r = 0; r < rounds; r++)
+		bin2hex(hex, bin, len);
+	gettimeofday(&tv_end, NULL);
+	timeval_subtract(&diff, &tv_end, &tv_start);
+	enc = (double) len * rounds / (diff.tv_sec + 1e-6 * diff.tv_usec) / 1e6;
+
+	gettimeofday(&tv_start, NULL);
+	for (r = 0; r < rounds; r++)
+		hex2bin(out, hex, len);
+	gettimeofday(&tv_end, NULL);
+	timeval_subtract(&diff, &tv_end, &tv_start);
+	dec = (double) len * rounds / (diff.tv_sec + 1e-6 * diff.tv_usec) / 1e6;
+
+	// check the vector path against printf, and the round trip
+	for (i = 0; i < 4096; i++) {
+		char ref[3];
+		sprintf(ref, "%02x", (unsigned int) bin[i]);
+		if (memcmp(ref, hex + 2*i, 2))
+			break;
+	}
+	applog(LOG_INFO, "hex codec (%s): encode %.0f MB/s, decode %.0f MB/s, %s",
+#if defined(__SSSE3__)
+		"ssse3",
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+		"neon",
+#else
+		"lut",
+#endif
+		enc, dec, (i == 4096 && !memcmp(bin, out, len)) ? "verified" : "MISMATCH");
+out:
+	free(bin);
+	free(out);
+	free(hex);
 }
 
 int varint_encode(unsigned char *p, uint64_t n)
@@ -969,16 +1119,12 @@ double target_to_diff(uint32_t* target)
 #define socket_blocks() (errno == EAGAIN || errno == EWOULDBLOCK)
 #endif
 
-static bool send_line(curl_socket_t sock, char *s)
+static bool send_data(curl_socket_t sock, const char *s, size_t len)
 {
 	size_t sent = 0;
-	int len;
-
-	len = (int) strlen(s);
-	s[len++] = '\n';
 
 	while (len > 0) {
-		struct timeval timeout = {0, 0};
+		struct timeval timeout = {1, 0};
 		int n;
 		fd_set wd;
 
@@ -986,7 +1132,7 @@ static bool send_line(curl_socket_t sock, char *s)
 		FD_SET(sock, &wd);
 		if (select((int) (sock + 1), NULL, &wd, NULL, &timeout) < 1)
 			return false;
-		n = send(sock, s + sent, len, 0);
+		n = send(sock, s + sent, (int) len, 0);
 		if (n < 0) {
 			if (!socket_blocks())
 				return false;
@@ -999,12 +1145,21 @@ static bool send_line(curl_socket_t sock, char *s)
 	return true;
 }
 
+static bool send_line(curl_socket_t sock, char *s)
+{
+	size_t len = strlen(s);
+
+	s[len++] = '\n';
+	return send_data(sock, s, len);
+}
+
 bool stratum_send_line(struct stratum_ctx *sctx, char *s)
 {
 	bool ret = false;
 
 	if (opt_protocol)
 		applog(LOG_DEBUG, "> %s", s);
+	record_line(sctx->pool_id, ">", s);
 
 	pthread_mutex_lock(&sctx->sock_lock);
 	ret = send_line(sctx->sock, s);
@@ -1029,82 +1184,261 @@ static bool socket_full(curl_socket_t sock, int timeout)
 
 bool stratum_socket_full(struct stratum_ctx *sctx, int timeout)
 {
-	return strlen(sctx->sockbuf) || socket_full(sctx->sock, timeout);
+	return sctx->sockbuf_tail > sctx->sockbuf_head || socket_full(sctx->sock, timeout);
+}
+
+#ifdef __linux__
+/* epoll set of the pool thread: its socket and the queued lines wakeup */
+static void stratum_evloop_init(struct stratum_ctx *sctx)
+{
+	struct epoll_event ev = { 0 };
+
+	sctx->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	sctx->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (sctx->epoll_fd < 0 || sctx->wake_fd < 0) {
+		applog(LOG_WARNING, "stratum event loop unavailable: %s", strerror(errno));
+		if (sctx->epoll_fd >= 0) close(sctx->epoll_fd);
+		if (sctx->wake_fd >= 0) close(sctx->wake_fd);
+		return;
+	}
+	ev.events = EPOLLIN;
+	ev.data.fd = sctx->wake_fd;
+	epoll_ctl(sctx->epoll_fd, EPOLL_CTL_ADD, sctx->wake_fd, &ev);
+	sctx->evloop = true;
+}
+
+/* a new connection, the previous socket left the set when closed */
+static void stratum_evloop_add(struct stratum_ctx *sctx)
+{
+	struct epoll_event ev = { 0 };
+
+	if (!sctx->evloop)
+		return;
+	ev.events = EPOLLIN | EPOLLRDHUP;
+	ev.data.fd = (int) sctx->sock;
+	if (epoll_ctl(sctx->epoll_fd, EPOLL_CTL_ADD, (int) sctx->sock, &ev) && errno == EEXIST)
+		epoll_ctl(sctx->epoll_fd, EPOLL_CTL_MOD, (int) sctx->sock, &ev);
+}
+
+/* send the lines queued by the other threads, only called by the pool thread */
+static bool stratum_flush(struct stratum_ctx *sctx)
+{
+	char *buf;
+	size_t len, size;
+	bool ret;
+
+	pthread_mutex_lock(&sctx->sock_lock);
+	buf = sctx->outbox;
+	len = sctx->outbox_len;
+	size = sctx->outbox_size;
+	if (len) {
+		// swap the buffers, the submitters never wait on the socket
+		sctx->outbox = sctx->outbox_spare;
+		sctx->outbox_size = sctx->outbox_spare_size;
+		sctx->outbox_len = 0;
+	}
+	pthread_mutex_unlock(&sctx->sock_lock);
+	if (!len)
+		return true;
+
+	ret = send_data(sctx->sock, buf, len);
+	if (!ret)
+		applog(LOG_ERR, "stratum_flush send failed");
+	sctx->outbox_spare = buf;
+	sctx->outbox_spare_size = size;
+	return ret;
+}
+#endif
+
+/**
+ * Wait up to timeout seconds for pool data, the pool thread sends the
+ * queued lines meanwhile. Returns false on timeout or socket error.
+ */
+bool stratum_wait(struct stratum_ctx *sctx, int timeout)
+{
+#ifdef __linux__
+	time_t end = time(NULL) + timeout;
+
+	while (sctx->evloop) {
+		struct epoll_event ev[2];
+		bool readable = false;
+		int i, n, wait_ms;
+
+		if (!stratum_flush(sctx))
+			return false;
+		if (sctx->sockbuf_tail > sctx->sockbuf_head)
+			return true;
+		wait_ms = (int) (end - time(NULL)) * 1000;
+		if (wait_ms <= 0)
+			return false;
+		n = epoll_wait(sctx->epoll_fd, ev, 2, wait_ms);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		for (i = 0; i < n; i++) {
+			if (ev[i].data.fd == sctx->wake_fd) {
+				uint64_t count;
+				if (read(sctx->wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+					return false;
+			} else
+				readable = true;
+		}
+		if (readable)
+			return stratum_flush(sctx);
+	}
+#endif
+	return stratum_socket_full(sctx, timeout);
+}
+
+/* line sent by the pool thread, used by the threads submitting shares */
+bool stratum_queue_line(struct stratum_ctx *sctx, const char *s)
+{
+#ifdef __linux__
+	size_t len = strlen(s);
+	bool wake;
+
+	if (!sctx->evloop)
+		return stratum_send_line(sctx, (char*) s);
+
+	if (opt_protocol)
+		applog(LOG_DEBUG, "> %s", s);
+	record_line(sctx->pool_id, ">", s);
+
+	pthread_mutex_lock(&sctx->sock_lock);
+	if (!sctx->curl) {
+		pthread_mutex_unlock(&sctx->sock_lock);
+		return false;
+	}
+	if (sctx->outbox_len + len + 1 > sctx->outbox_size) {
+		size_t size = sctx->outbox_size ? sctx->outbox_size : 1024;
+		char *buf;
+		while (size < sctx->outbox_len + len + 1)
+			size *= 2;
+		buf = (char*) realloc(sctx->outbox, size);
+		if (!buf) {
+			pthread_mutex_unlock(&sctx->sock_lock);
+			return false;
+		}
+		sctx->outbox = buf;
+		sctx->outbox_size = size;
+	}
+	wake = !sctx->outbox_len;
+	memcpy(sctx->outbox + sctx->outbox_len, s, len);
+	sctx->outbox[sctx->outbox_len + len] = '\n';
+	sctx->outbox_len += len + 1;
+	pthread_mutex_unlock(&sctx->sock_lock);
+
+	if (wake) {
+		uint64_t one = 1;
+		if (write(sctx->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+			return false;
+	}
+	return true;
+#else
+	return stratum_send_line(sctx, (char*) s);
+#endif
 }
 
 #define RBUFSIZE 2048
 #define RECVSIZE (RBUFSIZE - 4)
 
-static void stratum_buffer_append(struct stratum_ctx *sctx, const char *s)
+static inline void stratum_buffer_reset(struct stratum_ctx *sctx)
 {
-	size_t old, n;
+	sctx->sockbuf_head = sctx->sockbuf_tail = sctx->sockbuf_scan = 0;
+}
 
-	old = strlen(sctx->sockbuf);
-	n = old + strlen(s) + 1;
-	if (n >= sctx->sockbuf_size) {
-		sctx->sockbuf_size = n + (RBUFSIZE - (n % RBUFSIZE));
-		sctx->sockbuf = (char*) realloc(sctx->sockbuf, sctx->sockbuf_size);
-	}
-	strcpy(sctx->sockbuf + old, s);
+/* make room for a recv of at least RECVSIZE bytes after the data */
+static bool stratum_buffer_reserve(struct stratum_ctx *sctx)
+{
+	size_t used = sctx->sockbuf_tail - sctx->sockbuf_head;
+	char *buf;
+
+	if (sctx->sockbuf_size - sctx->sockbuf_tail > RECVSIZE)
+		return true;
+	if (sctx->sockbuf_head) {
+		// drop the consumed lines, only the partial one is moved
+		memmove(sctx->sockbuf, sctx->sockbuf + sctx->sockbuf_head, used);
+		sctx->sockbuf_head = 0;
+		sctx->sockbuf_tail = used;
+		if (sctx->sockbuf_size - used > RECVSIZE)
+			return true;
+	}
+	// a single line larger than the buffer (big coinbase or merkle)
+	buf = (char*) realloc(sctx->sockbuf, sctx->sockbuf_size * 2);
+	if (!buf)
+		return false;
+	sctx->sockbuf = buf;
+	sctx->sockbuf_size *= 2;
+	return true;
 }
 
-char *stratum_recv_line(struct stratum_ctx *sctx)
+/**
+ * Next line of the socket buffer, NUL terminated in place (no copy).
+ * The pointer is valid until the next call on this ctx.
+ */
+char *stratum_recv_line_view(struct stratum_ctx *sctx, size_t *len)
 {
-	ssize_t len, buflen;
-	char *tok, *sret = NULL;
+	char *line, *nl;
+	size_t scan;
+	time_t rstart;
 
-	if (!strstr(sctx->sockbuf, "\n")) {
-		bool ret = true;
-		time_t rstart;
+	time(&rstart);
+next:
+	scan = sctx->sockbuf_head + sctx->sockbuf_scan;
+	// only the bytes received since the previous scan are searched
+	while (!(nl = (char*) memchr(sctx->sockbuf + scan, '\n', sctx->sockbuf_tail - scan))) {
+		ssize_t n;
 
-		time(&rstart);
-		if (!socket_full(sctx->sock, 60)) {
+		if (time(NULL) - rstart >= 60 || !socket_full(sctx->sock, 60)) {
 			applog(LOG_ERR, "stratum_recv_line timed out");
 			goto out;
 		}
-		do {
-			char s[RBUFSIZE];
-			ssize_t n;
-
-			memset(s, 0, RBUFSIZE);
-			n = recv(sctx->sock, s, RECVSIZE, 0);
-			if (!n) {
-				ret = false;
-				break;
-			}
-			if (n < 0) {
-				if (!socket_blocks() || !socket_full(sctx->sock, 1)) {
-					ret = false;
-					break;
-				}
-			} else
-				stratum_buffer_append(sctx, s);
-		} while (time(NULL) - rstart < 60 && !strstr(sctx->sockbuf, "\n"));
-
-		if (!ret) {
+		if (!stratum_buffer_reserve(sctx))
+			goto out;
+		scan = sctx->sockbuf_tail;
+		// take everything the kernel has, a burst of notify comes in one call
+		n = recv(sctx->sock, sctx->sockbuf + sctx->sockbuf_tail,
+			sctx->sockbuf_size - sctx->sockbuf_tail, 0);
+		if (!n || (n < 0 && (!socket_blocks() || !socket_full(sctx->sock, 1)))) {
 			applog(LOG_ERR, "stratum_recv_line failed");
 			goto out;
 		}
-	}
+		if (n > 0)
+			sctx->sockbuf_tail += n;
+	}
+
+	line = sctx->sockbuf + sctx->sockbuf_head;
+	sctx->sockbuf_head = (nl - sctx->sockbuf) + 1;
+	sctx->sockbuf_scan = 0;
+	// trailing keep-alive blank lines, not seen as pending data
+	while (sctx->sockbuf_head < sctx->sockbuf_tail &&
+			(sctx->sockbuf[sctx->sockbuf_head] == '\n' || sctx->sockbuf[sctx->sockbuf_head] == '\r'))
+		sctx->sockbuf_head++;
+	if (sctx->sockbuf_head == sctx->sockbuf_tail)
+		stratum_buffer_reset(sctx);
+	if (nl > line && nl[-1] == '\r')
+		nl--;
+	*nl = '\0';
+	if (nl == line)
+		goto next; // keep-alive blank line
+	if (len)
+		*len = nl - line;
 
-	buflen = (ssize_t) strlen(sctx->sockbuf);
-	tok = strtok(sctx->sockbuf, "\n");
-	if (!tok) {
-		applog(LOG_ERR, "stratum_recv_line failed to parse a newline-terminated string");
-		goto out;
-	}
-	sret = strdup(tok);
-	len = (ssize_t) strlen(sret);
-
-	if (buflen > len + 1)
-		memmove(sctx->sockbuf, sctx->sockbuf + len + 1, buflen - len + 1);
-	else
-		sctx->sockbuf[0] = '\0';
+	if (opt_protocol)
+		applog(LOG_DEBUG, "< %s", line);
+	record_line(sctx->pool_id, "<", line);
+	return line;
 
 out:
-	if (sret && opt_protocol)
-		applog(LOG_DEBUG, "< %s", sret);
-	return sret;
+	sctx->sockbuf_scan = sctx->sockbuf_tail - sctx->sockbuf_head;
+	return NULL;
+}
+
+char *stratum_recv_line(struct stratum_ctx *sctx)
+{
+	char *line = stratum_recv_line_view(sctx, NULL);
+	return line ? strdup(line) : NULL;
 }
 
 #if LIBCURL_VERSION_NUM >= 0x071101
@@ -1136,8 +1470,12 @@ bool stratum_connect(struct stratum_ctx *sctx, const char *url)
 		sctx->sockbuf = (char*) calloc(RBUFSIZE, 1);
 		sctx->sockbuf_size = RBUFSIZE;
 	}
-	sctx->sockbuf[0] = '\0';
+	stratum_buffer_reset(sctx);
 	pthread_mutex_unlock(&sctx->sock_lock);
+#ifdef __linux__
+	if (!sctx->evloop)
+		stratum_evloop_init(sctx);
+#endif
 
 	if (url != sctx->url) {
 		free(sctx->url);
@@ -1181,6 +1519,11 @@ bool stratum_connect(struct stratum_ctx *sctx, const char *url)
 	/* CURLINFO_LASTSOCKET is broken on Win64; only use it as a last resort */
 	curl_easy_getinfo(curl, CURLINFO_LASTSOCKET, (long *)&sctx->sock);
 #endif
+#ifdef __linux__
+	stratum_evloop_add(sctx);
+#endif
+	sctx->tm_connected = time(NULL);
+	record_line(sctx->pool_id, "connect", url);
 
 	return true;
 }
@@ -1191,8 +1534,11 @@ void stratum_disconnect(struct stratum_ctx *sctx)
 	if (sctx->curl) {
 		curl_easy_cleanup(sctx->curl);
 		sctx->curl = NULL;
-		sctx->sockbuf[0] = '\0';
+		stratum_buffer_reset(sctx);
+		record_line(sctx->pool_id, "disconnect", NULL);
 	}
+	// the shares of a closed session are lost
+	sctx->outbox_len = 0;
 	pthread_mutex_unlock(&sctx->sock_lock);
 }
 
@@ -1220,55 +1566,132 @@ static const char *get_stratum_session_id(json_t *val)
 	return NULL;
 }
 
-static bool stratum_parse_extranonce(struct stratum_ctx *sctx, json_t *params, int pndx)
+static bool stratum_set_extranonce(struct stratum_ctx *sctx, const char *xnonce1, size_t len,
+	int xn2_size, int pndx)
 {
-	const char* xnonce1;
-	int xn2_size;
-
-	xnonce1 = json_string_value(json_array_get(params, pndx));
-	if (!xnonce1) {
-		applog(LOG_ERR, "Failed to get extranonce1");
-		goto out;
-	}
-	xn2_size = (int) json_integer_value(json_array_get(params, pndx+1));
 	if (!xn2_size) {
 		applog(LOG_ERR, "Failed to get extranonce2_size");
-		goto out;
+		return false;
 	}
 	if (xn2_size < 2 || xn2_size > 16) {
 		applog(LOG_INFO, "Failed to get valid n2size in parse_extranonce");
-		goto out;
+		return false;
 	}
 
 	pthread_mutex_lock(&sctx->work_lock);
 	if (sctx->xnonce1)
 		free(sctx->xnonce1);
-	sctx->xnonce1_size = strlen(xnonce1) / 2;
+	sctx->xnonce1_size = len / 2;
 	sctx->xnonce1 = (uchar*) calloc(1, sctx->xnonce1_size);
 	if (unlikely(!sctx->xnonce1)) {
 		applog(LOG_ERR, "Failed to alloc xnonce1");
 		pthread_mutex_unlock(&sctx->work_lock);
-		goto out;
+		return false;
 	}
 	hex2bin(sctx->xnonce1, xnonce1, sctx->xnonce1_size);
 	sctx->xnonce2_size = xn2_size;
 	pthread_mutex_unlock(&sctx->work_lock);
 
 	if (pndx == 0 && opt_debug) /* pool dynamic change */
-		applog(LOG_DEBUG, "Stratum set nonce %s with extranonce2 size=%d",
-			xnonce1, xn2_size);
+		applog(LOG_DEBUG, "Stratum set nonce %.*s with extranonce2 size=%d",
+			(int) len, xnonce1, xn2_size);
 
 	return true;
-out:
-	return false;
+}
+
+static bool stratum_parse_extranonce(struct stratum_ctx *sctx, json_t *params, int pndx)
+{
+	const char* xnonce1;
+
+	xnonce1 = json_string_value(json_array_get(params, pndx));
+	if (!xnonce1) {
+		applog(LOG_ERR, "Failed to get extranonce1");
+		return false;
+	}
+	return stratum_set_extranonce(sctx, xnonce1, strlen(xnonce1),
+		(int) json_integer_value(json_array_get(params, pndx+1)), pndx);
+}
+
+/* bip310 version rolling, the pool may answer with a narrower mask */
+/* mining.configure result, also when it comes after the handshake */
+bool stratum_configure_answer(struct stratum_ctx *sctx, const json_t *val)
+{
+	json_t *res_val, *vr;
+	const char *smask;
+
+	res_val = json_object_get(val, "result");
+	vr = json_object_get(res_val, "version-rolling");
+	smask = json_string_value(json_object_get(res_val, "version-rolling.mask"));
+	if (json_is_true(vr) && smask)
+		sctx->vr_mask = VERSION_ROLLING_MASK & (uint32_t) strtoul(smask, NULL, 16);
+	if (opt_debug)
+		applog(LOG_DEBUG, "Stratum version rolling mask %08x", sctx->vr_mask);
+	// answered late, asked again on the next connection
+	free(sctx->vr_noanswer);
+	sctx->vr_noanswer = NULL;
+	return true;
+}
+
+bool stratum_configure(struct stratum_ctx *sctx)
+{
+	json_t *val, *id;
+	json_error_t err;
+	char s[192], *sret;
+	time_t deadline;
+	int left;
+
+	sctx->vr_mask = 0;
+	if (jsonrpc_2)
+		return true;
+	if (sctx->vr_noanswer && !strcmp(sctx->vr_noanswer, sctx->url))
+		return true;
+
+	sprintf(s, "{\"id\": %d, \"method\": \"mining.configure\", \"params\": "
+		"[[\"version-rolling\"], {\"version-rolling.mask\": \"%08x\", "
+		"\"version-rolling.min-bit-count\": 2}]}", STRATUM_CONFIGURE_ID, VERSION_ROLLING_MASK);
+	if (!stratum_send_line(sctx, s))
+		return false;
+
+	// the methods sent before the answer are handled while waiting
+	deadline = time(NULL) + 3;
+	while ((left = (int) (deadline - time(NULL))) > 0 && stratum_socket_full(sctx, left)) {
+		sret = stratum_recv_line(sctx);
+		if (!sret)
+			return false;
+		val = JSON_LOADS(sret, &err);
+		if (!val) {
+			applog(LOG_WARNING, "JSON decode failed(%d): %s", err.line, err.text);
+			free(sret);
+			continue;
+		}
+		id = json_object_get(val, "id");
+		if (json_is_integer(id) && json_integer_value(id) == STRATUM_CONFIGURE_ID) {
+			stratum_configure_answer(sctx, val);
+			json_decref(val);
+			free(sret);
+			return true;
+		}
+		if (!stratum_handle_method(sctx, sret) && opt_debug)
+			applog(LOG_DEBUG, "stratum configure, unexpected line %s", sret);
+		json_decref(val);
+		free(sret);
+	}
+
+	// not answered by the pools without the extension, a late answer is still applied
+	if (opt_debug)
+		applog(LOG_DEBUG, "stratum configure timed out");
+	free(sctx->vr_noanswer);
+	sctx->vr_noanswer = strdup(sctx->url);
+	return true;
 }
 
 bool stratum_subscribe(struct stratum_ctx *sctx)
 {
 	char *s, *sret = NULL;
 	const char *sid;
-	json_t *val = NULL, *res_val, *err_val;
+	json_t *val = NULL, *res_val, *err_val, *id_val;
 	json_error_t err;
+	struct timeval tv_sent, tv_recv, diff;
 	bool ret = false, retry = false;
 
 	if (jsonrpc_2)
@@ -1283,12 +1706,14 @@ start:
 	else
 		sprintf(s, "{\"id\": 1, \"method\": \"mining.subscribe\", \"params\": [\"" USER_AGENT "\"]}");
 
+	gettimeofday(&tv_sent, NULL);
 	if (!stratum_send_line(sctx, s)) {
 		applog(LOG_ERR, "stratum_subscribe send failed");
 		goto out;
 	}
 
-	if (!socket_full(sctx->sock, 30)) {
+recv:
+	if (!stratum_socket_full(sctx, 30)) {
 		applog(LOG_ERR, "stratum_subscribe timed out");
 		goto out;
 	}
@@ -1296,6 +1721,7 @@ start:
 	sret = stratum_recv_line(sctx);
 	if (!sret)
 		goto out;
+	gettimeofday(&tv_recv, NULL);
 
 	val = JSON_LOADS(sret, &err);
 	free(sret);
@@ -1304,6 +1730,15 @@ start:
 		goto out;
 	}
 
+	// configure answer sent after its wait, before this one
+	id_val = json_object_get(val, "id");
+	if (json_is_integer(id_val) && json_integer_value(id_val) == STRATUM_CONFIGURE_ID) {
+		stratum_configure_answer(sctx, val);
+		json_decref(val);
+		val = NULL;
+		goto recv;
+	}
+
 	res_val = json_object_get(val, "result");
 	err_val = json_object_get(val, "error");
 
@@ -1325,6 +1760,8 @@ start:
 		applog(LOG_DEBUG, "Stratum session id: %s", sid);
 
 	pthread_mutex_lock(&sctx->work_lock);
+	timeval_subtract(&diff, &tv_recv, &tv_sent);
+	sctx->ping_ms = diff.tv_sec * 1e3 + diff.tv_usec / 1e3;
 	if (sctx->session_id)
 		free(sctx->session_id);
 	sctx->session_id = sid ? strdup(sid) : NULL;
@@ -1422,7 +1859,7 @@ bool stratum_authorize(struct stratum_ctx *sctx, const char *user, const char *p
 	if (!stratum_send_line(sctx, s))
 		goto out;
 
-	if (!socket_full(sctx->sock, 3)) {
+	if (!stratum_socket_full(sctx, 3)) {
 		if (opt_debug)
 			applog(LOG_DEBUG, "stratum extranonce subscribe timed out");
 		goto out;
@@ -1679,118 +2116,157 @@ static uint32_t getblocheight(struct stratum_ctx *sctx)
 	return height;
 }
 
-static bool stratum_notify(struct stratum_ctx *sctx, json_t *params)
-{
-	char algo[64] = { 0 };
-	const char *job_id, *prevhash, *coinb1, *coinb2, *version, *nbits, *ntime;
-	const char *extradata = NULL;
-	size_t coinb1_size, coinb2_size;
-	bool clean, ret = false;
-	int merkle_count, i, p=0;
-	bool has_claim, has_roots;
-	json_t *merkle_arr;
-	uchar **merkle;
+#define STRATUM_MAX_MERKLE 32
+
+/* mining.notify fields, hex strings not always NUL terminated */
+struct stratum_notify_args {
+	const char *job_id;
+	size_t job_id_len;
+	const char *prevhash;
+	const char *extradata;
+	const char *coinb1;
+	size_t coinb1_len;
+	const char *coinb2;
+	size_t coinb2_len;
+	const char *merkle[STRATUM_MAX_MERKLE];
+	int merkle_count;
+	const char *version;
+	const char *nbits;
+	const char *ntime;
+	bool clean;
+	struct timeval tv_notify;
+};
 
-	get_currentalgo(algo, sizeof(algo));
-	has_claim = strcmp(algo, "lbry") == 0 && json_array_size(params) == 10;
-	has_roots = strcmp(algo, "phi2") == 0 && json_array_size(params) == 10;
-
-	job_id = json_string_value(json_array_get(params, p++));
-	prevhash = json_string_value(json_array_get(params, p++));
-	if (has_claim) {
-		extradata = json_string_value(json_array_get(params, p++));
-		if (!extradata || strlen(extradata) != 64) {
-			applog(LOG_ERR, "Stratum notify: invalid claim parameter");
-			goto out;
-		}
-	}
-	else if (has_roots) {
-		extradata = json_string_value(json_array_get(params, p++));
-		if (!extradata || strlen(extradata) != 128) {
-			applog(LOG_ERR, "Stratum notify: invalid UTXO root parameter");
-			goto out;
-		}
-	}
-	coinb1 = json_string_value(json_array_get(params, p++));
-	coinb2 = json_string_value(json_array_get(params, p++));
-	merkle_arr = json_array_get(params, p++);
-	if (!merkle_arr || !json_is_array(merkle_arr))
-		goto out;
-	merkle_count = (int) json_array_size(merkle_arr);
-	version = json_string_value(json_array_get(params, p++));
-	nbits = json_string_value(json_array_get(params, p++));
-	ntime = json_string_value(json_array_get(params, p++));
-	clean = json_is_true(json_array_get(params, p));
-
-	if (!job_id || !prevhash || !coinb1 || !coinb2 || !version || !nbits || !ntime ||
-	    strlen(prevhash) != 64 || strlen(version) != 8 ||
-	    strlen(nbits) != 8 || strlen(ntime) != 8) {
-		applog(LOG_ERR, "Stratum notify: invalid parameters");
-		goto out;
-	}
-	merkle = (uchar**) malloc(merkle_count * sizeof(char *));
-	for (i = 0; i < merkle_count; i++) {
-		const char *s = json_string_value(json_array_get(merkle_arr, i));
-		if (!s || strlen(s) != 64) {
-			while (i--)
-				free(merkle[i]);
-			free(merkle);
-			applog(LOG_ERR, "Stratum notify: invalid Merkle branch");
-			goto out;
-		}
-		merkle[i] = (uchar*) malloc(32);
-		hex2bin(merkle[i], s, 32);
+/* size of the lbry claim or phi2 utxo roots parameter, in hex chars */
+static size_t stratum_extradata_len(void)
+{
+	static int len = -1;
+	if (len < 0) {
+		char algo[64] = { 0 };
+		get_currentalgo(algo, sizeof(algo));
+		len = !strcmp(algo, "lbry") ? 64 : !strcmp(algo, "phi2") ? 128 : 0;
 	}
+	return (size_t) len;
+}
+
+/* decode a validated notify into the job, the buffers are kept between jobs */
+static void stratum_job_update(struct stratum_ctx *sctx, const struct stratum_notify_args *n)
+{
+	size_t coinb1_size = n->coinb1_len / 2;
+	size_t coinb2_size = n->coinb2_len / 2;
+	bool new_job;
+	int i;
 
 	pthread_mutex_lock(&sctx->work_lock);
 
-	coinb1_size = strlen(coinb1) / 2;
-	coinb2_size = strlen(coinb2) / 2;
 	sctx->job.coinbase_size = coinb1_size + sctx->xnonce1_size +
 	                          sctx->xnonce2_size + coinb2_size;
-	sctx->job.coinbase = (uchar*) realloc(sctx->job.coinbase, sctx->job.coinbase_size);
+	if (sctx->job.coinbase_size > sctx->job.coinbase_alloc) {
+		sctx->job.coinbase = (uchar*) realloc(sctx->job.coinbase, sctx->job.coinbase_size);
+		sctx->job.coinbase_alloc = sctx->job.coinbase_size;
+	}
 	sctx->job.xnonce2 = sctx->job.coinbase + coinb1_size + sctx->xnonce1_size;
-	hex2bin(sctx->job.coinbase, coinb1, coinb1_size);
+	hex2bin(sctx->job.coinbase, n->coinb1, coinb1_size);
 	memcpy(sctx->job.coinbase + coinb1_size, sctx->xnonce1, sctx->xnonce1_size);
-	if (!sctx->job.job_id || strcmp(sctx->job.job_id, job_id))
+	sha256d_prefix_init(&sctx->job.coinbase_prefix, sctx->job.coinbase,
+		(int) (coinb1_size + sctx->xnonce1_size));
+	new_job = !sctx->job.job_id || strlen(sctx->job.job_id) != n->job_id_len ||
+		memcmp(sctx->job.job_id, n->job_id, n->job_id_len);
+	if (new_job)
 		memset(sctx->job.xnonce2, 0, sctx->xnonce2_size);
-	hex2bin(sctx->job.xnonce2 + sctx->xnonce2_size, coinb2, coinb2_size);
+	hex2bin(sctx->job.xnonce2 + sctx->xnonce2_size, n->coinb2, coinb2_size);
 
-	free(sctx->job.job_id);
-	sctx->job.job_id = strdup(job_id);
-	hex2bin(sctx->job.prevhash, prevhash, 32);
+	if (!sctx->job.job_id || strlen(sctx->job.job_id) < n->job_id_len)
+		sctx->job.job_id = (char*) realloc(sctx->job.job_id, n->job_id_len + 1);
+	memcpy(sctx->job.job_id, n->job_id, n->job_id_len);
+	sctx->job.job_id[n->job_id_len] = '\0';
+	hex2bin(sctx->job.prevhash, n->prevhash, 32);
 
-	if (has_claim) hex2bin(sctx->job.extra, extradata, 32);
-	if (has_roots) hex2bin(sctx->job.extra, extradata, 64);
+	if (n->extradata) hex2bin(sctx->job.extra, n->extradata, stratum_extradata_len() / 2);
 
 	sctx->bloc_height = getblocheight(sctx);
 
-	for (i = 0; i < sctx->job.merkle_count; i++)
-		free(sctx->job.merkle[i]);
-	free(sctx->job.merkle);
-	sctx->job.merkle = merkle;
-	sctx->job.merkle_count = merkle_count;
+	if (n->merkle_count > sctx->job.merkle_alloc) {
+		sctx->job.merkle = (uchar**) realloc(sctx->job.merkle, n->merkle_count * sizeof(uchar*));
+		for (i = sctx->job.merkle_alloc; i < n->merkle_count; i++)
+			sctx->job.merkle[i] = (uchar*) malloc(32);
+		sctx->job.merkle_alloc = n->merkle_count;
+	}
+	for (i = 0; i < n->merkle_count; i++)
+		hex2bin(sctx->job.merkle[i], n->merkle[i], 32);
+	sctx->job.merkle_count = n->merkle_count;
 
-	hex2bin(sctx->job.version, version, 4);
-	hex2bin(sctx->job.nbits, nbits, 4);
-	hex2bin(sctx->job.ntime, ntime, 4);
-	sctx->job.clean = clean;
+	hex2bin(sctx->job.version, n->version, 4);
+	hex2bin(sctx->job.nbits, n->nbits, 4);
+	hex2bin(sctx->job.ntime, n->ntime, 4);
+	sctx->job.clean = n->clean;
 
 	sctx->job.diff = sctx->next_diff;
+	sctx->job.tv_notify = n->tv_notify;
+	sctx->notify_count++;
 
 	pthread_mutex_unlock(&sctx->work_lock);
 
-	ret = true;
-
-out:
-	return ret;
+	events_job(sctx->pool_id, n->job_id, n->job_id_len, n->clean);
 }
 
-static bool stratum_set_difficulty(struct stratum_ctx *sctx, json_t *params)
+static bool stratum_notify(struct stratum_ctx *sctx, json_t *params)
 {
-	double diff;
+	struct stratum_notify_args n = { 0 };
+	size_t extra_len = stratum_extradata_len();
+	json_t *merkle_arr;
+	int i, p = 0;
+
+	gettimeofday(&n.tv_notify, NULL);
+
+	n.job_id = json_string_value(json_array_get(params, p++));
+	n.prevhash = json_string_value(json_array_get(params, p++));
+	if (extra_len && json_array_size(params) == 10) {
+		n.extradata = json_string_value(json_array_get(params, p++));
+		if (!n.extradata || strlen(n.extradata) != extra_len) {
+			applog(LOG_ERR, "Stratum notify: invalid %s parameter",
+				extra_len == 64 ? "claim" : "UTXO root");
+			return false;
+		}
+	}
+	n.coinb1 = json_string_value(json_array_get(params, p++));
+	n.coinb2 = json_string_value(json_array_get(params, p++));
+	merkle_arr = json_array_get(params, p++);
+	if (!merkle_arr || !json_is_array(merkle_arr))
+		return false;
+	n.merkle_count = (int) json_array_size(merkle_arr);
+	n.version = json_string_value(json_array_get(params, p++));
+	n.nbits = json_string_value(json_array_get(params, p++));
+	n.ntime = json_string_value(json_array_get(params, p++));
+	n.clean = json_is_true(json_array_get(params, p));
+
+	if (!n.job_id || !n.prevhash || !n.coinb1 || !n.coinb2 || !n.version || !n.nbits || !n.ntime ||
+	    strlen(n.prevhash) != 64 || strlen(n.version) != 8 ||
+	    strlen(n.nbits) != 8 || strlen(n.ntime) != 8) {
+		applog(LOG_ERR, "Stratum notify: invalid parameters");
+		return false;
+	}
+	if (n.merkle_count > STRATUM_MAX_MERKLE) {
+		applog(LOG_ERR, "Stratum notify: too many Merkle branches");
+		return false;
+	}
+	for (i = 0; i < n.merkle_count; i++) {
+		n.merkle[i] = json_string_value(json_array_get(merkle_arr, i));
+		if (!n.merkle[i] || strlen(n.merkle[i]) != 64) {
+			applog(LOG_ERR, "Stratum notify: invalid Merkle branch");
+			return false;
+		}
+	}
+	n.job_id_len = strlen(n.job_id);
+	n.coinb1_len = strlen(n.coinb1);
+	n.coinb2_len = strlen(n.coinb2);
+
+	stratum_job_update(sctx, &n);
+	return true;
+}
 
-	diff = json_number_value(json_array_get(params, 0));
+static bool stratum_set_difficulty(struct stratum_ctx *sctx, double diff)
+{
 	if (diff == 0)
 		return false;
 
@@ -1801,6 +2277,247 @@ static bool stratum_set_difficulty(struct stratum_ctx *sctx, json_t *params)
 	return true;
 }
 
+/**
+ * Stratum fast path: a flat json tokenizer for the usual pool messages,
+ * strings are referenced in the line (no allocation, no unescaping).
+ * Anything it does not expect goes to the jansson parser.
+ */
+#define STJ_TOKENS 96
+#define STJ_DEPTH 8
+
+enum stj_type { STJ_OBJECT = 1, STJ_ARRAY, STJ_STRING, STJ_PRIMITIVE };
+
+struct stj_tok {
+	enum stj_type type;
+	int start, end; // string content, without the quotes
+	int size;       // direct children
+	int next;       // first token after this one and its children
+};
+
+static int stj_parse(const char *js, struct stj_tok *tok, int max)
+{
+	int stack[STJ_DEPTH], depth = 0, n = 0;
+	const char *p;
+
+	for (p = js; *p; p++) {
+		struct stj_tok *t;
+		switch (*p) {
+		case ' ': case '\t': case '\r': case '\n': case ':': case ',':
+			continue;
+		case '}': case ']':
+			if (!depth)
+				return -1;
+			t = &tok[stack[--depth]];
+			if (t->type != (*p == '}' ? STJ_OBJECT : STJ_ARRAY))
+				return -1;
+			t->end = (int) (p - js) + 1;
+			t->next = n;
+			continue;
+		}
+		if (n >= max)
+			return -1;
+		t = &tok[n];
+		if (depth)
+			tok[stack[depth - 1]].size++;
+		t->size = 0;
+		t->start = (int) (p - js);
+		if (*p == '{' || *p == '[') {
+			if (depth >= STJ_DEPTH)
+				return -1;
+			t->type = *p == '{' ? STJ_OBJECT : STJ_ARRAY;
+			stack[depth++] = n++;
+			continue;
+		}
+		if (*p == '"') {
+			t->type = STJ_STRING;
+			t->start++;
+			for (p++; *p != '"'; p++)
+				if (!*p || *p == '\\')
+					return -1;
+		} else {
+			t->type = STJ_PRIMITIVE;
+			while (p[1] && !strchr(",]} \t\r\n:", p[1]))
+				p++;
+		}
+		t->end = (int) (p - js) + (t->type == STJ_PRIMITIVE);
+		t->next = ++n;
+	}
+	return depth ? -1 : n;
+}
+
+/* i-th element of an array, or the value of a key in an object */
+static int stj_item(const struct stj_tok *tok, int arr, int i)
+{
+	int t = arr + 1;
+	if (arr < 0 || tok[arr].type != STJ_ARRAY || i >= tok[arr].size)
+		return -1;
+	while (i--)
+		t = tok[t].next;
+	return t;
+}
+
+static int stj_key(const char *js, const struct stj_tok *tok, int obj, const char *key)
+{
+	size_t len = strlen(key);
+	int i, t = obj + 1;
+	for (i = 0; i + 1 < tok[obj].size; i += 2) {
+		if (tok[t].type == STJ_STRING && tok[t].end - tok[t].start == (int) len &&
+		    !memcmp(js + tok[t].start, key, len))
+			return t + 1;
+		t = tok[t + 1].next;
+	}
+	return -1;
+}
+
+/* a string token, of fixed length if len is set */
+static const char *stj_str(const char *js, const struct stj_tok *tok, int t, size_t len)
+{
+	if (t < 0 || tok[t].type != STJ_STRING)
+		return NULL;
+	if (len && (size_t) (tok[t].end - tok[t].start) != len)
+		return NULL;
+	return js + tok[t].start;
+}
+
+static inline size_t stj_len(const struct stj_tok *tok, int t)
+{
+	return (size_t) (tok[t].end - tok[t].start);
+}
+
+/* token equal to a string (stj_eq) or to a literal like true or null (stj_is) */
+static bool stj_match(const char *js, const struct stj_tok *tok, int t,
+	enum stj_type type, const char *lit)
+{
+	size_t len = strlen(lit);
+	return t >= 0 && tok[t].type == type && stj_len(tok, t) == len &&
+		!memcmp(js + tok[t].start, lit, len);
+}
+#define stj_eq(js, tok, t, str) stj_match(js, tok, t, STJ_STRING, str)
+#define stj_is(js, tok, t, lit) stj_match(js, tok, t, STJ_PRIMITIVE, lit)
+
+static bool stratum_notify_fast(struct stratum_ctx *sctx, const char *js,
+	const struct stj_tok *tok, int params, const struct timeval *tv)
+{
+	struct stratum_notify_args n = { 0 };
+	size_t extra_len = stratum_extradata_len();
+	int merkle, i, p = 0;
+
+	n.tv_notify = *tv;
+	n.job_id = stj_str(js, tok, stj_item(tok, params, p), 0);
+	if (!n.job_id)
+		return false;
+	n.job_id_len = stj_len(tok, stj_item(tok, params, p++));
+	n.prevhash = stj_str(js, tok, stj_item(tok, params, p++), 64);
+	if (extra_len && tok[params].size == 10) {
+		n.extradata = stj_str(js, tok, stj_item(tok, params, p++), extra_len);
+		if (!n.extradata)
+			return false;
+	}
+	n.coinb1 = stj_str(js, tok, stj_item(tok, params, p), 0);
+	if (n.coinb1)
+		n.coinb1_len = stj_len(tok, stj_item(tok, params, p));
+	p++;
+	n.coinb2 = stj_str(js, tok, stj_item(tok, params, p), 0);
+	if (n.coinb2)
+		n.coinb2_len = stj_len(tok, stj_item(tok, params, p));
+	p++;
+	merkle = stj_item(tok, params, p++);
+	if (merkle < 0 || tok[merkle].type != STJ_ARRAY || tok[merkle].size > STRATUM_MAX_MERKLE)
+		return false;
+	n.merkle_count = tok[merkle].size;
+	for (i = 0; i < n.merkle_count; i++) {
+		n.merkle[i] = stj_str(js, tok, stj_item(tok, merkle, i), 64);
+		if (!n.merkle[i])
+			return false;
+	}
+	n.version = stj_str(js, tok, stj_item(tok, params, p++), 8);
+	n.nbits = stj_str(js, tok, stj_item(tok, params, p++), 8);
+	n.ntime = stj_str(js, tok, stj_item(tok, params, p++), 8);
+	n.clean = stj_is(js, tok, stj_item(tok, params, p), "true");
+
+	if (!n.prevhash || !n.coinb1 || !n.coinb2 || !n.version || !n.nbits || !n.ntime)
+		return false;
+
+	stratum_job_update(sctx, &n);
+	return true;
+}
+
+/**
+ * Returns 1 if the line was handled, 0 if it is not a method call,
+ * -1 if it must go through jansson (unexpected shape or method)
+ */
+static int stratum_handle_method_fast(struct stratum_ctx *sctx, const char *s)
+{
+	struct stj_tok tok[STJ_TOKENS];
+	struct timeval tv;
+	int m, params, n;
+
+	gettimeofday(&tv, NULL);
+	n = stj_parse(s, tok, STJ_TOKENS);
+	if (n < 1 || tok[0].type != STJ_OBJECT)
+		return -1;
+
+	m = stj_key(s, tok, 0, "method");
+	if (m < 0 || stj_is(s, tok, m, "null"))
+		return 0;
+	params = stj_key(s, tok, 0, "params");
+	if (tok[m].type != STJ_STRING || params < 0 || tok[params].type != STJ_ARRAY)
+		return -1;
+
+	if (stj_eq(s, tok, m, "mining.notify")) {
+		if (!stratum_notify_fast(sctx, s, tok, params, &tv))
+			return -1;
+		return 1;
+	}
+	if (stj_eq(s, tok, m, "mining.set_difficulty")) {
+		m = stj_item(tok, params, 0);
+		if (m < 0 || tok[m].type != STJ_PRIMITIVE)
+			return -1;
+		if (!sctx->standby)
+			restart_threads();
+		return stratum_set_difficulty(sctx, strtod(s + tok[m].start, NULL));
+	}
+	if (stj_eq(s, tok, m, "mining.set_extranonce")) {
+		m = stj_item(tok, params, 0);
+		n = stj_item(tok, params, 1);
+		if (!stj_str(s, tok, m, 0) || n < 0 || tok[n].type != STJ_PRIMITIVE)
+			return -1;
+		return stratum_set_extranonce(sctx, s + tok[m].start, stj_len(tok, m),
+			atoi(s + tok[n].start), 0);
+	}
+	return -1;
+}
+
+/**
+ * Decode a share submit answer without jansson,
+ * returns false when the line needs the full parser
+ */
+bool stratum_parse_submit_answer(const char *s, int *id, int *result, char *reason, size_t reason_size)
+{
+	struct stj_tok tok[STJ_TOKENS];
+	int t, e;
+
+	if (stj_parse(s, tok, STJ_TOKENS) < 1 || tok[0].type != STJ_OBJECT)
+		return false;
+	t = stj_key(s, tok, 0, "id");
+	if (t < 0 || tok[t].type != STJ_PRIMITIVE || stj_is(s, tok, t, "null"))
+		return false;
+	*id = atoi(s + tok[t].start);
+
+	t = stj_key(s, tok, 0, "result");
+	*result = t < 0 ? -1 : stj_is(s, tok, t, "true");
+
+	*reason = '\0';
+	e = stj_key(s, tok, 0, "error");
+	if (e >= 0 && tok[e].type == STJ_ARRAY) {
+		const char *msg = stj_str(s, tok, stj_item(tok, e, 1), 0);
+		if (msg)
+			snprintf(reason, reason_size, "%.*s", (int) stj_len(tok, stj_item(tok, e, 1)), msg);
+	} else if (e >= 0 && !stj_is(s, tok, e, "null"))
+		return false;
+	return true;
+}
+
 static bool stratum_reconnect(struct stratum_ctx *sctx, json_t *params)
 {
 	json_t *port_val;
@@ -2075,6 +2792,12 @@ bool stratum_handle_method(struct stratum_ctx *sctx, const char *s)
 	const char *method;
 	bool ret = false;
 
+	if (!jsonrpc_2) {
+		int rc = stratum_handle_method_fast(sctx, s);
+		if (rc >= 0)
+			return rc > 0;
+	}
+
 	val = JSON_LOADS(s, &err);
 	if (!val) {
 		applog(LOG_ERR, "JSON decode failed(%d): %s", err.line, err.text);
@@ -2097,7 +2820,7 @@ bool stratum_handle_method(struct stratum_ctx *sctx, const char *s)
 	id = json_object_get(val, "id");
 
 	if (!strcasecmp(method, "mining.notify")) {
-		restart_threads();
+		// the miners are restarted once the new work is built
 		ret = stratum_notify(sctx, params);
 		goto out;
 	}
@@ -2107,14 +2830,23 @@ bool stratum_handle_method(struct stratum_ctx *sctx, const char *s)
 		goto out;
 	}
 	if (!strcasecmp(method, "mining.set_difficulty")) {
-		restart_threads();
-		ret = stratum_set_difficulty(sctx, params);
+		if (!sctx->standby)
+			restart_threads();
+		ret = stratum_set_difficulty(sctx, json_number_value(json_array_get(params, 0)));
 		goto out;
 	}
 	if (!strcasecmp(method, "mining.set_extranonce")) {
 		ret = stratum_parse_extranonce(sctx, params, 0);
 		goto out;
 	}
+	if (!strcasecmp(method, "mining.set_version_mask")) {
+		const char *smask = json_string_value(json_array_get(params, 0));
+		// used by the next jobs
+		if (smask && sctx->vr_mask)
+			sctx->vr_mask = VERSION_ROLLING_MASK & (uint32_t) strtoul(smask, NULL, 16);
+		ret = true;
+		goto out;
+	}
 	if (!strcasecmp(method, "client.reconnect")) {
 		ret = stratum_reconnect(sctx, params);
 		goto out;